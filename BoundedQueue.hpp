@@ -0,0 +1,142 @@
+#ifndef BOUNDED_QUEUE_HPP
+#define BOUNDED_QUEUE_HPP
+
+#include <atomic>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+
+namespace ChatServer
+{
+
+/**
+	A fixed-size, lock-free, multi-producer multi-consumer FIFO (Dmitry
+	Vyukov's bounded queue).  Every cell carries a sequence number that says
+	whose turn it is - a producer's or a consumer's - so claiming a cell is a
+	single compare-and-swap and nobody ever waits on anybody else.  When it's
+	full, Push() fails rather than blocking.
+
+	Items are filled in and taken out in place, through a callback, so a cell's
+	T is reused from one trip round the ring to the next: a cell holding a
+	std::string keeps its capacity, and once the queue is warm pushing
+	doesn't allocate.
+**/
+template<typename T>
+class BoundedQueue
+{
+private:
+	struct Cell
+	{
+		std::atomic<size_t> Sequence;
+		T Data;
+	};
+
+	std::unique_ptr<Cell[]> _aCells;
+	size_t _iMask; // Cell count - 1 (the count is a power of two)
+
+	// Apart, so producers and consumers don't fight over one cache line
+	alignas(64) std::atomic<size_t> _iEnqueue; // Next ticket to push into
+	alignas(64) std::atomic<size_t> _iDequeue; // Next ticket to pop from
+
+	BoundedQueue(const BoundedQueue&);
+	BoundedQueue& operator=(const BoundedQueue&);
+
+public:
+	/** Makes room for at least 'size' items (rounded up to a power of two) **/
+	BoundedQueue(size_t size)
+		: _iEnqueue(0), _iDequeue(0)
+	{
+		size_t count = 2;
+		while(count < size)
+		{
+			count <<= 1;
+		}
+
+		_aCells.reset(new Cell[count]);
+		_iMask = count - 1;
+		for(size_t i = 0; i < count; ++i)
+		{
+			_aCells[i].Sequence.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	/** Claims a cell and calls fill(T&) on it; false (and no call) if the queue is full **/
+	template<typename Fill>
+	bool Push(Fill fill)
+	{
+		Cell* cell;
+		size_t pos = _iEnqueue.load(std::memory_order_relaxed);
+		while(true)
+		{
+			cell = &_aCells[pos & _iMask];
+			size_t seq = cell->Sequence.load(std::memory_order_acquire);
+			intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+			if(diff == 0)
+			{
+				if(_iEnqueue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				{
+					break;
+				}
+			}
+			else if(diff < 0)
+			{
+				// Still holding what was pushed a whole lap ago
+				return false;
+			}
+			else
+			{
+				pos = _iEnqueue.load(std::memory_order_relaxed);
+			}
+		}
+
+		fill(cell->Data);
+		cell->Sequence.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	/** Takes the oldest item, calling take(T&) on it; false if the queue is empty **/
+	template<typename Take>
+	bool Pop(Take take)
+	{
+		Cell* cell;
+		size_t pos = _iDequeue.load(std::memory_order_relaxed);
+		while(true)
+		{
+			cell = &_aCells[pos & _iMask];
+			size_t seq = cell->Sequence.load(std::memory_order_acquire);
+			intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+			if(diff == 0)
+			{
+				if(_iDequeue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				{
+					break;
+				}
+			}
+			else if(diff < 0)
+			{
+				// Nothing pushed here yet
+				return false;
+			}
+			else
+			{
+				pos = _iDequeue.load(std::memory_order_relaxed);
+			}
+		}
+
+		take(cell->Data);
+		cell->Sequence.store(pos + _iMask + 1, std::memory_order_release);
+		return true;
+	}
+
+	/** True if there's nothing to pop (just a snapshot, if others are pushing) **/
+	bool Empty() const
+	{
+		size_t pos = _iDequeue.load(std::memory_order_relaxed);
+		size_t seq = _aCells[pos & _iMask].Sequence.load(std::memory_order_acquire);
+		return seq != pos + 1;
+	}
+};
+
+}
+
+#endif
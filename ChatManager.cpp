@@ -1,346 +1,779 @@
 #include <syslog.h>
+#include <algorithm>
+#include <functional>
 
 #include "ChatManager.hpp"
 #include "ClientHandler.hpp"
+#include "EventLoop.hpp"
+#include "FoldedName.hpp"
+#include "Log.hpp"
+#include "Metrics.hpp"
+#include "ServerConfig.hpp"
+#include "Snapshot.hpp"
 
 using std::vector;
 using std::string;
+using std::string_view;
 
 using ChatServer::ChatManager;
+using ChatServer::ClientHandler;
+using ChatServer::EventLoop;
+using ChatServer::FoldedLess;
+using ChatServer::FormatMessage;
+using ChatServer::Journal;
+using ChatServer::Listing;
+using ChatServer::ListingQuery;
+using ChatServer::Log;
+using ChatServer::MakeMessage;
+using ChatServer::MessageBuilder;
+using ChatServer::Metrics;
+using ChatServer::Name;
+using ChatServer::NameTable;
+using ChatServer::ServerConfig;
+using ChatServer::SendStatus;
+using ChatServer::SnapshotReader;
+using ChatServer::SnapshotWriter;
+
+namespace
+{
+
+const char* ROOMS_HEADER = "Active rooms are: \n";
+const char* ROOMS_MARK = " <-- you are here";
+const char* USERS_HEADER = "Users connected: \n";
+const char* USERS_MARK = " (** this is you)";
+
+}
 
 
-ChatManager::ChatManager()
+ChatManager::ChatManager(const ServerConfig& config)
+	: _config(config), 
+	  _roomListing(ROOMS_HEADER, "rooms", ROOMS_MARK, true), 
+	  _userListing(USERS_HEADER, "users", USERS_MARK, false), 
+	  _historyBudget(config.HistoryTotalBytes)
 {
+	if(!config.JournalDir.empty())
+	{
+		_pJournal.reset(new Journal(
+		       config.JournalDir, 
+		       config.JournalSegmentBytes, 
+		       std::chrono::milliseconds(config.JournalSyncMs)));
+	}
 }
 
 ChatManager::~ChatManager()
 {
 }
 
-string ChatManager::GetProperUserName(const std::string& user)
+void ChatManager::Room::Add(ClientHandler* client)
 {
-	string capsUser = ToUpper(user);
-	for(auto client: _mClients)
+	client->SetRoomSlot(Members.size());
+	Members.push_back(client);
+}
+
+bool ChatManager::Room::Remove(ClientHandler* client)
+{
+	size_t slot = client->GetRoomSlot();
+	if(slot >= Members.size() || Members[slot] != client)
 	{
-		if(ToUpper(client.first) == capsUser)
-		{
-			return client.first;
-		}
+		return false;
 	}
-	return "";
+
+	// Fill the gap with whoever's at the end
+	ClientHandler* last = Members.back();
+	Members[slot] = last;
+	last->SetRoomSlot(slot);
+	Members.pop_back();
+	return true;
+}
+
+size_t ChatManager::ShardFor(const Name& name)
+{
+	return name.Hash() % SHARD_COUNT;
 }
 
-string ChatManager::GetProperRoomName(const std::string& room)
+Name ChatManager::GetProperUserName(string_view user)
 {
-	string capsRoom = ToUpper(room);
-	for(auto room: _mRooms)
+	// A name nobody's using isn't interned, so there's nothing to look up
+	Name name = NameTable::Users().Find(user);
+	if(name.Empty())
 	{
-		if(ToUpper(room.first) == capsRoom)
-		{
-			return room.first;
-		}
+		return name;
 	}
-	return "";
+
+	// Found in any spelling - but it's the user's own that's proper
+	UserShard& shard = _aUserShards[ShardFor(name)];
+	std::lock_guard<std::mutex> lock(shard.Mutex);
+	auto it = shard.Clients.find(name);
+	return it != shard.Clients.end() ? it->first : Name();
 }
 
-vector<string> ChatManager::GetRooms()
+Name ChatManager::GetProperRoomName(string_view room)
 {
-	// TODO: Could this be more efficient, by storing references instead of 
-	//       creating new strings?
-	vector<string> ret;
-	for(auto& room: _mRooms)
+	Name name = NameTable::Rooms().Find(room);
+	if(name.Empty())
 	{
-		ret.push_back(room.first);
+		return name;
 	}
-	return ret;
+
+	RoomShard& shard = _aRoomShards[ShardFor(name)];
+	std::lock_guard<std::mutex> lock(shard.Mutex);
+	auto it = shard.Rooms.find(name);
+	return it != shard.Rooms.end() ? it->first : Name();
 }
 
-vector<string> ChatManager::GetUsersIn(string roomName)
+ChatServer::SharedMessage ChatManager::ListRooms(const Name& here, const ListingQuery& query)
 {
-	vector<string> ret;
-	if(roomName == "")
+	if(_roomListing.Empty())
 	{
-		// Get ALL the users!
-		for(auto& client: _mClients)
-		{
-			ret.push_back(client.first);
-		}
-		return ret;
+		return SharedMessage();
 	}
+	return _roomListing.Render(query, here);
+}
+
+ChatServer::SharedMessage ChatManager::ListUsers(const Name& you, const ListingQuery& query)
+{
+	return _userListing.Render(query, you);
+}
 
-	if(_mRooms.find(roomName) == _mRooms.end())
+ChatServer::SharedMessage ChatManager::ListUsersIn(
+       const Name& roomName, 
+       const Name& you, 
+       const ListingQuery& query)
+{
+	if(roomName.Empty())
 	{
-		// Room doesn't exist, so nobody in it!
-		return ret;
+		// Not a room, so nobody in it!
+		return SharedMessage();
 	}
 
-	auto& room = _mRooms[roomName];
-	for(auto& user: room)
+	// One room's members, sorted as they're asked for - it costs what the
+	// room does, however big the server is
+	Listing::Entries members;
 	{
-		ret.push_back(user);
+		RoomShard& shard = _aRoomShards[ShardFor(roomName)];
+		std::lock_guard<std::mutex> lock(shard.Mutex);
+		auto it = shard.Rooms.find(roomName);
+		if(it == shard.Rooms.end() || it->second.Members.empty())
+		{
+			return SharedMessage();
+		}
+
+		members.reserve(it->second.Members.size());
+		for(auto member: it->second.Members)
+		{
+			members.push_back(Listing::Entry{member->GetUserName().Text(), 0});
+		}
 	}
-	return ret;
+	std::sort(members.begin(), members.end(), [](const Listing::Entry& a, const Listing::Entry& b)
+		{
+			return FoldedLess()(a.Text, b.Text);
+		});
+
+	string header = "Users in " + roomName.Text() + ":\n";
+	return Listing::RenderPage(members, header, "users", query, false, you, USERS_MARK);
 }
 
 bool ChatManager::AddClient(ChatServer::ClientHandler* client)
 {
-	// Only add the client if the user name does not already exist.
-	string userName = client->GetUserName();
-
-	std::lock_guard<std::mutex> lock(_mMutex);
-	if(_mClients.find(userName) == _mClients.end())
+	// Only add the client if the user name does not already exist.  Every
+	// spelling of the name lives in this shard, so the check and the insert
+	// happen under one lock.
+	const Name& userName = client->GetUserName();
+
+	UserShard& shard = _aUserShards[ShardFor(userName)];
+	std::lock_guard<std::mutex> lock(shard.Mutex);
+	if(!shard.Clients.insert(std::make_pair(userName, client)).second)
 	{
-		_mClients[userName] = client;
-		return true;
+		return false;
 	}
-	return false;
+	_userListing.Set(userName, 0);
+	return true;
 }
 
 void ChatManager::RemoveUserFromRoom(
-			const std::string& room, 
-			const std::string& userName)
+			const Name& room,
+			ClientHandler* client,
+			bool farewell)
 {
-	std::lock_guard<std::mutex> lock(_mMutex);
+	if(room.Empty())
+	{
+		return;
+	}
+
+	RoomShard& shard = _aRoomShards[ShardFor(room)];
+	std::lock_guard<std::mutex> lock(shard.Mutex);
 
 	// Remove the user from the room they're in,
 	// if they're in a room
-	string capsUser = ToUpper(userName);
-	if(room != "" && _mRooms.find(room) != _mRooms.end())
+	auto it = shard.Rooms.find(room);
+	if(it != shard.Rooms.end())
 	{
-		auto names = _mRooms[room];
-		for(int i = 0; i < names.size(); ++i)
+		const Name& properRoom = it->first;
+		Room& left = it->second;
+		if(left.Remove(client))
 		{
-			if(ToUpper(names[i]) == capsUser)
-			{	
-				// We found the user in the room, now need to delete them and notify
-				names.erase(names.begin()+i);
-				if(names.size() > 0)
-				{
-					// If there are still people in the room, save that
-					_mRooms[room] = names;
-					PostMsgToRoom(userName + " has left " + room, room, "");
-				}
-				else
-				{
-					// If there's nobody in the room, delete it.
-					_mRooms.erase(room);
-				}
+			const Name& userName = client->GetUserName();
+			SharedMessage goodbye;
+			if(farewell)
+			{
+				goodbye = FormatMessage({"* You have left ", properRoom, "\n"});
+			}
+			if(left.Members.size() > 0)
+			{
+				// If there are still people in the room, tell them
+				Broadcast(FormatMessage({"* ", userName, " has left ", properRoom, "\n"}), left.Members);
+				_roomListing.Set(properRoom, left.Members.size());
+			}
+			else
+			{
+				// If there's nobody in the room, delete it.
+				_roomListing.Remove(properRoom);
+				shard.Rooms.erase(it);
+			}
 
-				// If the user is still connected, send a notification
-				GuardedSend("* You have left " + room + "\n", userName);
-				break;
+			// If the user is still connected, send a notification (a client
+			// that's disconnecting has already left the registry)
+			if(goodbye)
+			{
+				GuardedSend(goodbye, userName);
 			}
 		}
 	}
 }
 
-std::string ChatServer::ChatManager::ToUpper(const std::string& msg)
+bool ChatManager::DoesUserExist(const Name& user)
 {
-	string s = "";
-	for(int i = 0; i < msg.length(); ++i)
-	{
-		s += toupper(msg[i]);
-	}
-	return s;
-}
-
-bool ChatManager::DoesUserExist(const std::string& user)
-{
-	string capsUser = ToUpper(user);
-	for(auto& client: _mClients)
-	{
-		string name = ToUpper(client.second->GetUserName());
-		if(name == capsUser)
-		{
-			return true;
-		}
-	}
-	return false;
+	UserShard& shard = _aUserShards[ShardFor(user)];
+	std::lock_guard<std::mutex> lock(shard.Mutex);
+	return shard.Clients.find(user) != shard.Clients.end();
 }
 
 void ChatManager::RemoveClient(ChatServer::ClientHandler* client)
 {
-	string room = client->GetCurrentRoom();
-	string userName = client->GetUserName();
+	Name room = client->GetCurrentRoom();
+	const Name& userName = client->GetUserName();
 
 	// Remove the user from the list of clients
 	{
-		std::lock_guard<std::mutex> lock(_mMutex);
-		auto it=_mClients.find(userName);
-		if(it != _mClients.end())
+		UserShard& shard = _aUserShards[ShardFor(userName)];
+		std::lock_guard<std::mutex> lock(shard.Mutex);
+		auto it = shard.Clients.find(userName);
+		if(it != shard.Clients.end() && it->second == client)
 		{
-			_mClients.erase(it);
+			shard.Clients.erase(it);
+			_userListing.Remove(userName);
 		}
 	}
 
-	RemoveUserFromRoom(room, userName);
+	RemoveUserFromRoom(room, client, false);
 }
 
-void ChatManager::SwitchRoom(
-	       const string fromRoom, 
-				 const string toRoom, 
+ChatServer::SharedMessage ChatManager::SwitchRoom(
+	       const Name& fromRoom,
+				 const Name& toRoom,
 				 ClientHandler* client)
 {
 	// First remove the user from the old room, if one is specified
-	if(fromRoom != "")
+	if(!fromRoom.Empty())
 	{
-		RemoveUserFromRoom(fromRoom, client->GetUserName());
+		RemoveUserFromRoom(fromRoom, client, true);
 	}
 
-	string dest = "";
+	Name dest;
+	SharedMessage history;
 
 	// Find the toRoom, if it exists
-	if(toRoom != "")
+	if(!toRoom.Empty())
 	{
-		string capsTo = ToUpper(toRoom);
-		for(auto r: _mRooms)
+		RoomShard& shard = _aRoomShards[ShardFor(toRoom)];
+
+		// A room that's been here before picks up where it left off.  That
+		// means reading the journal, which mustn't hold up everyone else in
+		// the shard, so it's read first and spliced in under the lock - unless
+		// somebody's made the room in the meantime, in which case it has its
+		// history already.
+		vector<string> recalled;
+		if(_pJournal && _config.HistoryLines > 0)
 		{
-			if(ToUpper(r.first) == capsTo)
+			bool exists;
 			{
-				// Found the matching room
-				dest = r.first;
+				std::lock_guard<std::mutex> lock(shard.Mutex);
+				exists = shard.Rooms.count(toRoom) > 0;
+			}
+			if(!exists)
+			{
+				recalled = RecallHistory(toRoom);
 			}
 		}
-		if(dest == "")
+
+		std::lock_guard<std::mutex> lock(shard.Mutex);
+
+		// Creates the room if it doesn't exist yet; either way 'it' points at
+		// the room under its proper name.
+		auto it = shard.Rooms.find(toRoom);
+		if(it == shard.Rooms.end())
 		{
-			dest = toRoom;
-			// Need to create it, doesn't exist yet.
-			_mRooms[dest] = vector<string>();
+			it = shard.Rooms.try_emplace(
+			       toRoom, 
+			       _config.HistoryLines, 
+			       _config.HistoryRoomBytes, 
+			       _historyBudget).first;
+			for(auto& line: recalled)
+			{
+				it->second.History.Add(line);
+			}
 		}
-		// Add the client's name to the room
-		_mRooms[dest].push_back(client->GetUserName());
+		dest = it->first;
+
+		// Add the client to the room
+		it->second.Add(client);
+		_roomListing.Set(dest, it->second.Members.size());
 
 		// Tell everyone about the new member
-		PostMsgToRoom("new user joined chat: " + client->GetUserName(), dest, "");
+		Broadcast(FormatMessage({"* new user joined chat: ", client->GetUserName(), "\n"}), it->second.Members);
+
+		// Take a copy of what's been said while we still hold the lock, so 
+		// nothing can slip in between the history and the live messages
+		const RoomHistory& recent = it->second.History;
+		if(recent.Size() > 0)
+		{
+			MessageBuilder replay(recent.Size());
+			recent.AppendTo(replay);
+			history = replay.Finish();
+		}
 	}
 
 	client->SetCurrentRoom(dest);
+	return history;
 }
 
 void ChatManager::PostMsgToRoom(
-			const std::string& msg, 
-			const std::string& roomName, 
-			const std::string& fromUser)
+			string_view msg,
+			const Name& roomName,
+			const Name& fromUser)
 {
-	// Make sure room exists!
-	if(_mRooms.find(roomName) == _mRooms.end())
+	// Format the message, once for everybody, straight into a pooled buffer
+	SharedMessage m;
+	if(!fromUser.Empty())
 	{
-		GuardedSend("Invalid room (" + roomName + ")!\n", fromUser);
-		return;
+		m = FormatMessage({"[", roomName, "] ", fromUser, ": ", msg, "\n"});
+	}
+	else
+	{
+		m = FormatMessage({"* ", msg, "\n"});
 	}
 
-	auto users = _mRooms[roomName];
+	RoomShard& shard = _aRoomShards[ShardFor(roomName)];
+	std::lock_guard<std::mutex> lock(shard.Mutex);
 
-	// Format the message
-	string  m = "";
-	if(fromUser != "")
+	// Make sure room exists!
+	auto it = shard.Rooms.find(roomName);
+	if(it == shard.Rooms.end())
 	{
-		m = "[" + roomName + "] " + fromUser + ": " + msg + "\n";
+		GuardedSend(FormatMessage({"Invalid room (", roomName, ")!\n"}), fromUser);
+		return;
 	}
-	else
+
+	it->second.History.Add(*m);
+	if(_pJournal)
 	{
-		m = "* " + msg + "\n";
+		// Queued under the lock, so the journal has the room's lines in the
+		// order everyone saw them
+		_pJournal->AppendRoom(it->first, m);
 	}
+	Broadcast(m, it->second.Members);
+}
 
-	// Send it to all associated users
-	for(auto& user: users)
+vector<string> ChatManager::RecallHistory(string_view room)
+{
+	vector<string> lines;
+	if(_pJournal && _config.HistoryLines > 0)
 	{
-		GuardedSend(m, user);
+		lines.reserve(_config.HistoryLines);
+		_pJournal->ReadTail(
+		       Journal::RoomStream(room), 
+		       _config.HistoryLines, 
+		       [&lines](const Journal::Record& r) { lines.emplace_back(r.Text); });
 	}
+	return lines;
 }
 
-bool ChatManager::GuardedSend(const string& msg, const string& user)
+void ChatManager::Broadcast(
+			const ChatServer::SharedMessage& msg, 
+			const vector<ClientHandler*>& members)
 {
-	try
+	// Sort the recipients by the loop that owns them, so each loop gets one
+	// queued batch instead of one task per user.  Everyone shares 'msg'.  The
+	// scratch space stays with the thread, so once it's grown to fit the 
+	// biggest room a broadcast doesn't allocate.  (Nothing Deliver does calls
+	// back in here, so it's never in use twice at once.)
+	thread_local vector<std::pair<EventLoop*, ClientHandler*> > recipients;
+	thread_local vector<ClientHandler*> batch;
+
+	recipients.clear();
+	for(auto member: members)
 	{
-		if(_mClients.find(user) == _mClients.end())
+		if(member->StillValid())
 		{
-			// User doesn't exist!
-			throw std::runtime_error(user + " does not exist!");
+			recipients.push_back(std::make_pair(&member->GetLoop(), member));
 		}
+	}
+	std::sort(recipients.begin(), recipients.end());
+	Metrics::Local().FanOut.Record(recipients.size());
 
-		if(_mClients[user] == NULL)
+	// Send it to all associated users.  The room's shard is still locked, so
+	// none of them can leave (and be deleted) until their batch is queued.
+	for(size_t i = 0; i < recipients.size(); )
+	{
+		EventLoop* loop = recipients[i].first;
+		batch.clear();
+		for(; i < recipients.size() && recipients[i].first == loop; ++i)
 		{
-			// Pointer is dead
-			_mClients.erase(user);
-			throw std::runtime_error(user + " points at a null client!");
+			batch.push_back(recipients[i].second);
 		}
+		loop->Deliver(msg, batch);
+	}
+}
+
+SendStatus ChatManager::GuardedSend(const SharedMessage& msg, const Name& user)
+{
+	UserShard& shard = _aUserShards[ShardFor(user)];
+	std::lock_guard<std::mutex> lock(shard.Mutex);
+
+	// This runs for everyone in a room that's emptying out, so failing is
+	// cheap: no exceptions, and the log is queued (and rate limited)
+	auto it = shard.Clients.find(user);
+	if(it == shard.Clients.end())
+	{
+		// User doesn't exist!
+		Log::Write(LOG_NOTICE, "ChatManager::GuardedSend()> Error: %s does not exist!", user.Text().c_str());
+		return SendStatus::NO_SUCH_USER;
+	}
+
+	if(it->second == NULL)
+	{
+		// Pointer is dead
+		shard.Clients.erase(it);
+		_userListing.Remove(user);
+		Log::Write(LOG_NOTICE, "ChatManager::GuardedSend()> Error: %s points at a null client!", user.Text().c_str());
+		return SendStatus::NO_SUCH_USER;
+	}
+
+	if(!it->second->StillValid())
+	{
+		Log::Write(LOG_NOTICE, "ChatManager::GuardedSend()> Error: %s is leaving!", user.Text().c_str());
+		return SendStatus::NOT_DELIVERED;
+	}
+
+	it->second->SendMsg(msg);
+	return SendStatus::SENT;
+}
+
+SendStatus ChatManager::SendMsgToUser(
+			string_view msg,
+			const Name& fromUser,
+			const Name& toUser)
+{
+	// Names are interned, so they're already spelled properly - but the
+	// sender may not be a user at all
+	if(toUser.Empty())
+	{
+		// Nobody to send it to (they may have just left) - the caller tells
+		// the sender
+		return SendStatus::NO_SUCH_USER;
+	}
 
-		if(_mClients[user]->StillValid())
+	SendStatus status;
+	if(DoesUserExist(fromUser))
+	{
+		// Send the message to the target
+		status = GuardedSend(FormatMessage({fromUser, " whispers: ", msg, "\n"}), toUser);
+		if(status == SendStatus::SENT)
 		{
-			_mClients[user]->SendMsg(msg);
-			return true;
+			if(_pJournal)
+			{
+				_pJournal->AppendPrivate(FormatMessage({fromUser, " -> ", toUser, ": ", msg, "\n"}));
+			}
+
+			// We might not have a valid "from" user - but if we do, show this
+			GuardedSend(FormatMessage({"You whisper to ", toUser, ": ", msg, "\n"}), fromUser);
 		}
-		else
+		else if(status == SendStatus::NOT_DELIVERED)
 		{
-			throw std::runtime_error(user + " is leaving!");
+			// If we couldn't send the message, notify the sender.
+			GuardedSend(FormatMessage({toUser, " is not here.\n"}), fromUser);
 		}
 	}
-	catch(std::runtime_error  ex)
+	else
 	{
-		syslog(LOG_NOTICE, "ChatManager::GuardedSend()> Error: %s", ex.what());
+		// Send the message to the target
+		status = GuardedSend(FormatMessage({fromUser, " whispers: ", msg, "\n"}), toUser);
+		if(status == SendStatus::SENT && _pJournal)
+		{
+			_pJournal->AppendPrivate(FormatMessage({fromUser, " -> ", toUser, ": ", msg, "\n"}));
+		}
+
+		// The "from" might be from the sys admin, or $DEITY, or an AI, in which
+		// case we just show "$DEITY whispers: <msg>", but we don't need to (and
+		// probably can't) show $DEITY the corresponding message, because they're
+		// not in the list of clients.
 	}
-	return false;
+	return status;
 }
 
-void ChatManager::SendMsgToUser(
-			const string& msg, 
-			const string& fromUser, 
-			const string& toUser)
+void ChatManager::SaveSnapshot(const string& path)
 {
-	string capsToUser = ToUpper(toUser);
-	string capsFromUser = ToUpper(fromUser);
-	ClientHandler* clientTo = NULL; 
-	ClientHandler* clientFrom = NULL;
+	SnapshotWriter out;
+	size_t users = 0;
+	size_t rooms = WriteRooms(out, users);
+	out.Save(path);
+	syslog(LOG_INFO, "Saved %zu room(s) and %zu user(s) to %s", rooms, users, path.c_str());
+}
 
-	// Find the clients (to and from) in a case-insensitive way
-	for(auto client: _mClients)
+bool ChatManager::LoadSnapshot(const string& path)
+{
+	size_t rooms = 0, users = 0;
+	try
 	{
-		string name = ToUpper(client.second->GetUserName());
-		if(name == capsToUser)
+		SnapshotReader in(path);
+		if(!in.IsOpen())
 		{
-			clientTo = client.second;
+			return false;
 		}
-		else if(name == capsFromUser)
+		rooms = ReadRooms(in, users);
+	}
+	catch(const std::runtime_error& e)
+	{
+		syslog(LOG_WARNING, "Couldn't load the snapshot: %s", e.what());
+		return false;
+	}
+
+	syslog(LOG_NOTICE, "Restored %zu room(s) and %zu user(s) from %s", rooms, users, path.c_str());
+	return true;
+}
+
+size_t ChatManager::WriteRooms(SnapshotWriter& out, size_t& users)
+{
+	// Anyone from the last restart who hasn't logged back in yet is still
+	// expected, so they go in the next snapshot too
+	NameIndex<vector<Name> > returning;
+	for(auto& shard: _aUserShards)
+	{
+		std::lock_guard<std::mutex> lock(shard.Mutex);
+		for(auto& user: shard.Returning)
 		{
-			clientFrom = client.second;
+			returning[user.second].push_back(user.first);
 		}
 	}
 
-	if(clientTo == NULL)
+	// Then one room shard at a time, so the chat carries on while we're at
+	// it.  Each room is as it was at some moment - not all the same moment.
+	// It's just one room after another, then an empty name:
+	//   name, history, member count, members...
+	size_t rooms = 0;
+	users = 0;
+	for(auto& shard: _aRoomShards)
 	{
-		// If we don't have a valid destination, then this makes no sense
-		// COMPLAIN LOUDLY!
-		throw std::runtime_error(
-			"Invalid users in SendMsgToUser (" + fromUser + ", " + toUser + ")"
-			);
+		std::lock_guard<std::mutex> lock(shard.Mutex);
+		for(auto& room: shard.Rooms)
+		{
+			auto& members = room.second.Members;
+			auto expected = returning.find(room.first);
+			size_t count = members.size() + (expected != returning.end() ? expected->second.size() : 0);
+
+			MessageBuilder history(room.second.History.Size());
+			room.second.History.AppendTo(history);
+
+			out.PutString(room.first);
+			out.PutString(*history.Finish());
+			out.PutNumber(count);
+			for(auto member: members)
+			{
+				out.PutString(member->GetUserName());
+			}
+			if(expected != returning.end())
+			{
+				for(auto& user: expected->second)
+				{
+					out.PutString(user);
+				}
+				returning.erase(expected);
+			}
+
+			++rooms;
+			users += count;
+		}
 	}
 
-	if(clientFrom != NULL)
+	// Rooms that emptied out before everyone came back still get them back
+	for(auto& room: returning)
 	{
-		// Send the message to the target
-		if(GuardedSend(clientFrom->GetUserName() + " whispers: " + msg + "\n", 
-									 clientTo->GetUserName()))
+		out.PutString(room.first);
+		out.PutString("");
+		out.PutNumber(room.second.size());
+		for(auto& user: room.second)
 		{
-			// We might not have a valid "from" user - but if we do, show this
-			GuardedSend("You whisper to " + clientTo->GetUserName() + ": " + msg 
-									+ "\n", clientFrom->GetUserName());
+			out.PutString(user);
 		}
-		else
+
+		++rooms;
+		users += room.second.size();
+	}
+
+	out.PutString("");
+	return rooms;
+}
+
+size_t ChatManager::ReadRooms(SnapshotReader& in, size_t& users)
+{
+	size_t rooms = 0;
+	users = 0;
+	while(!in.AtEnd())
+	{
+		string_view name, history, user;
+		uint32_t count;
+		if(!in.GetString(name))
 		{
-			// If we couldn't send the message, notify the sender.
-			GuardedSend(toUser + " is not here.\n", clientFrom->GetUserName());
+			throw std::runtime_error("snapshot is cut short");
+		}
+		if(name.empty())
+		{
+			break;
+		}
+		if(!in.GetString(history) || !in.GetNumber(count))
+		{
+			throw std::runtime_error("snapshot is cut short");
 		}
+
+		// No history saved?  Then whatever the journal has (read before the lock)
+		vector<string> recalled;
+		if(history.empty())
+		{
+			recalled = RecallHistory(name);
+		}
+
+		Name room = NameTable::Rooms().Intern(name);
+		RoomShard& shard = _aRoomShards[ShardFor(room)];
+		std::lock_guard<std::mutex> lock(shard.Mutex);
+		auto it = shard.Rooms.try_emplace(
+		            room,
+		            _config.HistoryLines,
+		            _config.HistoryRoomBytes,
+		            _historyBudget).first;
+		_roomListing.Set(it->first, it->second.Members.size());
+
+		// Every line of history ends in a "\n"
+		RoomHistory& recent = it->second.History;
+		for(auto& line: recalled)
+		{
+			recent.Add(line);
+		}
+		while(!history.empty())
+		{
+			size_t end = history.find('\n');
+			end = end == string_view::npos ? history.length() : end + 1;
+			recent.Add(history.substr(0, end));
+			history.remove_prefix(end);
+		}
+
+		// The room stays empty until its members come back for it
+		for(uint32_t i = 0; i < count; ++i)
+		{
+			if(!in.GetString(user))
+			{
+				throw std::runtime_error("snapshot is cut short");
+			}
+			Name returning = NameTable::Users().Intern(user);
+			UserShard& userShard = _aUserShards[ShardFor(returning)];
+			std::lock_guard<std::mutex> userLock(userShard.Mutex);
+			userShard.Returning[returning] = it->first;
+			++users;
+		}
+		++rooms;
 	}
-	else
+	return rooms;
+}
+
+bool ChatManager::RestoreClient(ClientHandler* client)
+{
+	if(!AddClient(client))
 	{
-		// Send the message to the target
-		GuardedSend(fromUser + " whispers: " + msg + "\n", clientTo->GetUserName());
+		return false;
+	}
 
-		// The "from" might be from the sys admin, or $DEITY, or an AI, in which
-		// case we just show "$DEITY whispers: <msg>", but we don't need to (and 
-		// probably can't) show $DEITY the corresponding message, because they're
-		// not in the list of clients.
+	// They're already where they were - nothing to wait for
+	TakeReturningRoom(client->GetUserName());
+
+	const Name& room = client->GetCurrentRoom();
+	if(!room.Empty())
+	{
+		// Straight back in, without telling anyone: as far as everyone else
+		// is concerned they never left
+		RoomShard& shard = _aRoomShards[ShardFor(room)];
+		std::lock_guard<std::mutex> lock(shard.Mutex);
+		auto it = shard.Rooms.find(room);
+		if(it == shard.Rooms.end())
+		{
+			it = shard.Rooms.try_emplace(
+			       room, 
+			       _config.HistoryLines, 
+			       _config.HistoryRoomBytes, 
+			       _historyBudget).first;
+		}
+		it->second.Add(client);
+		_roomListing.Set(it->first, it->second.Members.size());
+		client->SetCurrentRoom(it->first);
 	}
+	return true;
+}
+
+Name ChatManager::TakeReturningRoom(const Name& user)
+{
+	UserShard& shard = _aUserShards[ShardFor(user)];
+	std::lock_guard<std::mutex> lock(shard.Mutex);
+	auto it = shard.Returning.find(user);
+	if(it == shard.Returning.end())
+	{
+		return Name();
+	}
+
+	Name room = std::move(it->second);
+	shard.Returning.erase(it);
+	return room;
 }
 
+void ChatManager::ForgetReturning()
+{
+	for(auto& shard: _aUserShards)
+	{
+		std::lock_guard<std::mutex> lock(shard.Mutex);
+		shard.Returning.clear();
+	}
+
+	// Only restored rooms can be empty - any other room goes as soon as its
+	// last member leaves
+	for(auto& shard: _aRoomShards)
+	{
+		std::lock_guard<std::mutex> lock(shard.Mutex);
+		for(auto it = shard.Rooms.begin(); it != shard.Rooms.end(); )
+		{
+			if(it->second.Members.empty())
+			{
+				_roomListing.Remove(it->first);
+				it = shard.Rooms.erase(it);
+			}
+			else
+			{
+				++it;
+			}
+		}
+	}
+}
+
+void ChatManager::FlushJournal()
+{
+	if(_pJournal)
+	{
+		_pJournal->Flush();
+	}
+}
@@ -2,15 +2,34 @@
 #define CHAT_MANAGER_HPP
 
 #include <map>
+#include <memory>
 #include <mutex>
 #include <vector>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include "Journal.hpp"
+#include "Listing.hpp"
+#include "Message.hpp"
+#include "Name.hpp"
+#include "RoomHistory.hpp"
 
 namespace ChatServer
 {
 
 // forward declaration to avoid circular #include references
 class ClientHandler;
+class SnapshotReader;
+class SnapshotWriter;
+struct ServerConfig;
+
+/** How a private message went (see ChatManager::SendMsgToUser()) **/
+enum class SendStatus
+{
+	SENT,
+	NO_SUCH_USER, // Nobody by that name (any more)
+	NOT_DELIVERED // They're there, but on their way out
+};
 
 /**
 	Manages lists of rooms and attached clients.
@@ -21,41 +40,130 @@ class ClientHandler;
 
 	Refers all client-specific error handling / message sending
 	to the ClientHandler.
+
+	Users and rooms live in separate lock-striped registries, so traffic in 
+	unrelated rooms doesn't contend.  When both are needed, a room shard is 
+	always locked before a user shard, and only one of each at a time.  The
+	listings lock themselves, last of all.
 **/
 class ChatManager
 {
 private:
-	std::mutex _mMutex; // Avoid threading problems
-	std::map<std::string, std::vector<std::string> > _mRooms; // room name -> list of user names
-	std::map<std::string, ChatServer::ClientHandler*> _mClients; // user name -> client object
+	static const int SHARD_COUNT = 64; // Lock stripes for users and rooms
+
+	/** 
+		Maps an interned name to something.  Every spelling of a name is the
+		same Name, so hashing uses the hash worked out when it was interned,
+		and comparing is comparing pointers.
+	**/
+	template<typename T>
+	using NameIndex = std::unordered_map<ChatServer::Name, T, ChatServer::NameHash>;
+
+	/**
+		One stripe of the user registry.  Names are sharded by their folded
+		hash, so every spelling of a name lands in the same shard.
+	**/
+	struct UserShard
+	{
+		std::mutex Mutex;
+		NameIndex<ChatServer::ClientHandler*> Clients; // user name -> client object
+		NameIndex<ChatServer::Name> Returning; // user name -> room they were in, from a snapshot
+	};
+
+	/**
+		Who's in a room, and what they've been saying lately.  The members are
+		a dense array, in no particular order, and each member's handler knows
+		its own slot in it (see ClientHandler::GetRoomSlot()), so joining and
+		leaving are O(1): a leaver's slot is filled by the last member.
+	**/
+	struct Room
+	{
+		std::vector<ChatServer::ClientHandler*> Members;
+		ChatServer::RoomHistory History;
+
+		Room(size_t historyLines, size_t historyBytes, ChatServer::HistoryBudget& budget)
+			: History(historyLines, historyBytes, budget)
+		{
+		}
+
+		/** Puts the client in the room **/
+		void Add(ChatServer::ClientHandler* client);
+
+		/** Takes the client out; false if they weren't in it **/
+		bool Remove(ChatServer::ClientHandler* client);
+	};
+
+	/**
+		One stripe of the room registry.  Holding a room's shard lock keeps its 
+		members alive, since a client has to leave its room before it goes away,
+		so a room can hold its members' handlers directly.
+	**/
+	struct RoomShard
+	{
+		std::mutex Mutex;
+		NameIndex<Room> Rooms; // room name -> room
+	};
+
+	const ServerConfig& _config;
+	ChatServer::Listing _roomListing; // /rooms: every room and its head count, kept up to date under the room locks
+	ChatServer::Listing _userListing; // /who: everyone logged in, kept up to date under the user locks
+	ChatServer::HistoryBudget _historyBudget; // Shared by every room's history
+	std::unique_ptr<ChatServer::Journal> _pJournal; // NULL unless we're keeping one
+	UserShard _aUserShards[SHARD_COUNT];
+	RoomShard _aRoomShards[SHARD_COUNT];
+
+	/** Picks the shard for a user or room name **/
+	size_t ShardFor(const ChatServer::Name& name);
 
 	// Removes a user from the room, if they exist, and deletes the room if empty.
-	void RemoveUserFromRoom(const std::string& room, const std::string& userName);
+	// Tells them they've left, unless they're disconnecting ('farewell' false).
+	void RemoveUserFromRoom(const ChatServer::Name& room, ChatServer::ClientHandler* client, bool farewell);
+
+	// Sends a message to every one of the members (their room's shard must be locked)
+	void Broadcast(
+	       const ChatServer::SharedMessage& msg, 
+	       const std::vector<ChatServer::ClientHandler*>& members);
+
+	// A room's recent history from the journal, if there is one, oldest
+	// first.  It's read from disk, so never call this holding a shard lock.
+	std::vector<std::string> RecallHistory(std::string_view room);
 
 	// Sends a message to the client, checking for errors
-	bool GuardedSend(const std::string& msg, const std::string& user);
+	ChatServer::SendStatus GuardedSend(const ChatServer::SharedMessage& msg, const ChatServer::Name& user);
 
 public:
-	ChatManager();
+	/** Opens the journal, if the config asks for one (throws std::runtime_error if it can't) **/
+	ChatManager(const ServerConfig& config);
 	~ChatManager();
 
-	/** Upper-cases the given string, useful for checking for name matches **/
-	std::string ToUpper(const std::string& str);
-
 	/** Returns true if the user exists **/
-	bool DoesUserExist(const std::string& user);
+	bool DoesUserExist(const ChatServer::Name& user);
+
+	/** Helpful for avoiding case issues and getting the right user name (empty if there's no such user). **/
+	ChatServer::Name GetProperUserName(std::string_view user);
 
-	/** Helpful for avoiding case issues and getting the right user name. **/
-	std::string GetProperUserName(const std::string& user);
+	/** Helpful for avoiding case issues and getting the right room name (empty if there's no such room). **/
+	ChatServer::Name GetProperRoomName(std::string_view room);
 
-	/** Helpful for avoiding case issues and getting the right room name. **/
-	std::string GetProperRoomName(const std::string& room);
+	/**
+	The /rooms listing: the rooms the query asks for and how many are in
+	each, with 'here' marked.  NULL if there aren't any rooms at all.  The
+	listing is kept up to date as people join and leave, so a page costs
+	what's on it, not what's on the server.
+	**/
+	ChatServer::SharedMessage ListRooms(const ChatServer::Name& here, const ChatServer::ListingQuery& query);
 
-	/** Gets the current list of room names **/
-	std::vector<std::string> GetRooms();
+	/**
+	The /who listing for everyone connected (as much as the query asks
+	for), with 'you' marked.  Kept up to date as people log in and out.
+	**/
+	ChatServer::SharedMessage ListUsers(const ChatServer::Name& you, const ChatServer::ListingQuery& query);
 
-	/** Gets the list of user names in the given room **/
-	std::vector<std::string> GetUsersIn(std::string roomName);
+	/** The /who listing for one room; NULL if there's nobody in it **/
+	ChatServer::SharedMessage ListUsersIn(
+	       const ChatServer::Name& roomName, 
+	       const ChatServer::Name& you, 
+	       const ChatServer::ListingQuery& query);
 
 	/** Adds the given client to the ChatManager's list. **/
 	bool AddClient(ChatServer::ClientHandler* client);
@@ -66,26 +174,74 @@ public:
 	/** 
 	Switches a given client from one room to another, 
 	also used to create and join a room (if 'fromRoom' is
-	equal to "").
+	equal to "").  'fromRoom' may be the client's own current room: it's
+	done with before the client's room gets changed.
+
+	Returns the new room's recent history, for the client to replay (NULL
+	if there isn't any).  Anything said after the join is sent after it.
 	**/
-	void SwitchRoom(
-	       const std::string fromRoom, 
-				 const std::string toRoom, 
+	ChatServer::SharedMessage SwitchRoom(
+	       const ChatServer::Name& fromRoom, 
+				 const ChatServer::Name& toRoom, 
 				 ChatServer::ClientHandler* client
 				 );
 
 	/** Posts the given message to all users in the given room **/
 	void PostMsgToRoom(
-	       const std::string& msg, 
-				 const std::string& roomName, 
-				 const std::string& fromUser);
-
-	/** Sends a private message from the specified user to the other one. **/
-	void SendMsgToUser(
-	     	const std::string& msg, 
-				const std::string& fromUser, 
-				const std::string& toUser
+	       std::string_view msg, 
+				 const ChatServer::Name& roomName, 
+				 const ChatServer::Name& fromUser);
+
+	/** 
+	Sends a private message from the specified user to the other one, and
+	lets the sender know how it went (a sender who isn't a user - the
+	system, say - isn't told).
+	**/
+	ChatServer::SendStatus SendMsgToUser(
+	     	std::string_view msg, 
+				const ChatServer::Name& fromUser, 
+				const ChatServer::Name& toUser
 				);
+
+	/**
+	Saves the rooms, who's in them, and their history, to be picked up
+	again by LoadSnapshot() after a restart.  Throws std::runtime_error if
+	the file can't be written.
+	**/
+	void SaveSnapshot(const std::string& path);
+
+	/**
+	Brings back the rooms from a snapshot, and remembers who was in them so
+	they can be put back when they log in again.  Only for startup, before
+	there are any clients.  Returns false (and logs why) if there wasn't a
+	usable snapshot.
+	**/
+	bool LoadSnapshot(const std::string& path);
+
+	/** 
+	Writes out every room, as SaveSnapshot() does, for ReadRooms() to read
+	back in.  Returns how many rooms, and sets 'users' to how many members.
+	**/
+	size_t WriteRooms(ChatServer::SnapshotWriter& out, size_t& users);
+
+	/** Brings back what WriteRooms() wrote (throws std::runtime_error if it's no good) **/
+	size_t ReadRooms(ChatServer::SnapshotReader& in, size_t& users);
+
+	/**
+	Puts a client handed over from the previous server back where it was:
+	registered under its name, and in its room, without telling anyone.
+	Returns false if the name's been taken in the meantime.
+	**/
+	bool RestoreClient(ChatServer::ClientHandler* client);
+
+	/** The room a user was in when the snapshot was taken (empty if none); only answers once **/
+	ChatServer::Name TakeReturningRoom(const ChatServer::Name& user);
+
+	/** Gives up on anyone who hasn't come back yet, and drops the rooms they left empty **/
+	void ForgetReturning();
+
+	/** Waits until everything sent to the journal (if any) is on disk **/
+	void FlushJournal();
 };
 
 }
@@ -1,32 +1,181 @@
 
 #include "ClientHandler.hpp"
 #include "ChatManager.hpp"
+#include "EventLoop.hpp"
+#include "ServerConfig.hpp"
 #include "Command.hpp"
+#include "FoldedName.hpp"
+#include "Scrub.hpp"
+#include "Log.hpp"
+#include "Metrics.hpp"
 
 #include <iostream>
-#include <sstream>
 #include <functional>
+#include <iterator> // for std::size
+#include <algorithm>
 #include <unistd.h>
 #include <string>
 #include <string.h> // for memset
 #include <stdexcept>
-#include <thread>
+#include <cerrno>
 
-#include <sys/ioctl.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <syslog.h> // syslog!
 
-using std::endl;
 using std::string;
+using std::string_view;
 using std::chrono::seconds;
 using std::chrono::duration_cast;
+using std::chrono::milliseconds;
 using std::chrono::steady_clock;
 
 using ChatServer::Command;
+using ChatServer::Counter;
+using ChatServer::FloodPolicy;
+using ChatServer::FoldedEqual;
+using ChatServer::FormatMessage;
+using ChatServer::ListingQuery;
+using ChatServer::Log;
+using ChatServer::MessageBuilder;
+using ChatServer::Metrics;
+using ChatServer::Name;
+using ChatServer::NameTable;
+using ChatServer::ReadStatus;
+using ChatServer::SendStatus;
+using ChatServer::ServerConfig;
+using ChatServer::SlowConsumerPolicy;
+
+namespace ChatServer
+{
+
+/**
+	Every command the server knows, shared by all connections.  Commands are
+	found by the letter after the '/' - no two start with the same one, so
+	that's a perfect hash, worked out at compile time.
+**/
+struct CommandTable
+{
+	static constexpr Command COMMANDS[] = {
+		{ "/help", "Prints this list, but only when you recognize you need to ask for it.",
+		  &ClientHandler::HelpHandler },
+		{ "/join", "Join the specified chat room.  Creates the room if it doesn't exist.",
+		  &ClientHandler::JoinRoomHandler },
+		{ "/leave", "Leaves the current chat room.",
+		  &ClientHandler::LeaveRoomHandler },
+		{ "/msg", "Send private message to user (/msg wilbur salutations!)",
+		  &ClientHandler::MsgHandler },
+		{ "/quit", "Disconnects from the chat server.  Not for winners.",
+		  &ClientHandler::QuitHandler },
+		{ "/rooms", "List the available chat rooms.  prefix=, offset= and limit= "
+		            "show just some of them (/rooms prefix=lou limit=20)",
+		  &ClientHandler::ListRoomsHandler },
+		{ "/who", "Prints the list of people in the given chat room.  "
+		          "If no room is specified, shows everyone connected.  "
+		          "Takes prefix=, offset= and limit= too (/who Lounge prefix=wil)",
+		  &ClientHandler::WhoHandler },
+	};
+
+	/** Finds the command named by 'token' (e.g. "/join"), or NULL **/
+	static const Command* Find(string_view token);
+
+	/** The /help text, built once **/
+	static const SharedMessage& Help()
+	{
+		static const SharedMessage help = []()
+			{
+				string msg = "Available commands:\n";
+				for(auto& command: COMMANDS)
+				{
+					msg += "\t";
+					msg += command.strString;
+					msg += ": ";
+					msg += command.strDescription;
+					msg += "\n";
+				}
+				return MakeMessage(msg);
+			}();
+		return help;
+	}
+};
+
+/** COMMANDS index for each initial letter, -1 if there's no such command **/
+struct CommandIndex
+{
+	signed char ByInitial[26];
+};
 
-ChatServer::ClientHandler::ClientHandler(int fd, ChatManager& cm)
-	: _iSocketFD(fd), _cm(cm), _bDone(false)
+static constexpr CommandIndex MakeCommandIndex()
+{
+	CommandIndex index = {};
+	for(auto& slot: index.ByInitial)
+	{
+		slot = -1;
+	}
+	for(size_t i = 0; i < std::size(CommandTable::COMMANDS); ++i)
+	{
+		index.ByInitial[CommandTable::COMMANDS[i].strString[1] - 'a'] = i;
+	}
+	return index;
+}
+
+static constexpr bool CommandInitialsAreUnique()
+{
+	auto& commands = CommandTable::COMMANDS;
+	for(size_t i = 0; i < std::size(commands); ++i)
+	{
+		for(size_t j = i + 1; j < std::size(commands); ++j)
+		{
+			if(commands[i].strString[1] == commands[j].strString[1])
+			{
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static_assert(CommandInitialsAreUnique(), "Two commands share an initial - find them some other way");
+
+static constexpr CommandIndex COMMAND_INDEX = MakeCommandIndex();
+
+const Command* CommandTable::Find(string_view token)
+{
+	if(token.length() < 2 || token[1] < 'a' || token[1] > 'z')
+	{
+		return NULL;
+	}
+	int i = COMMAND_INDEX.ByInitial[token[1] - 'a'];
+	if(i < 0 || COMMANDS[i].strString != token)
+	{
+		return NULL;
+	}
+	return &COMMANDS[i];
+}
+
+}
+
+using ChatServer::CommandTable;
+
+ChatServer::ClientHandler::ClientHandler(
+       int fd, 
+       ChatManager& cm, 
+       EventLoop& loop, 
+       char* inputBuffer, 
+       size_t inputSize,
+       OutboundQueue& outbound)
+	: _cm(cm), _loop(loop), _iSocketFD(fd), _framer(inputBuffer, inputSize), 
+	  _iRoomSlot(0), _qOutbound(outbound), _iOutOffset(0), _iOutBytes(0), 
+	  _bWaitingToWrite(false), _bDone(false), _bLoggedIn(false), 
+	  _bReleased(false), _iLoginTriesLeft(MAX_LOGIN_TRIES), 
+	  _tLastRead(steady_clock::now()), 
+	  _idleTimer([this]() { CheckIdle(); }),
+	  _lineBucket(loop.GetConfig().LineRate, loop.GetConfig().LineBurst),
+	  _byteBucket(loop.GetConfig().ByteRate, loop.GetConfig().ByteBurst),
+	  _bFlooding(false),
+	  _throttleTimer([this]() { HandleEvents(EPOLLIN); })
 {
 #if defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
 	// Make sure we ignore SIGPIPE (writing to closed connection)
@@ -35,174 +184,324 @@ ChatServer::ClientHandler::ClientHandler(int fd, ChatManager& cm)
 	setsockopt(_iSocketFD, SOL_SOCKET, SO_NOSIGPIPE, (void *)&set, sizeof(int));
 #endif
 
-	//-------------------------------------------------------
-	// Set up the command objects
-	//-------------------------------------------------------
-	Command quit;
-	quit.strString = "/quit";
-	quit.strDescription = "Disconnects from the chat server.  Not for winners.";
-	quit.Execute = std::bind(&ClientHandler::QuitHandler, this, std::placeholders::_1);
-	_mCommands[quit.strString] = quit;
-
-	Command listRooms;
-	listRooms.strString = "/rooms";
-	listRooms.strDescription = "List the available chat rooms.";
-	listRooms.Execute = std::bind(&ClientHandler::ListRoomsHandler, this, std::placeholders::_1);
-	_mCommands[listRooms.strString] = listRooms;
-
-	Command joinRoom;
-	joinRoom.strString = "/join";
-	joinRoom.strDescription = "Join the specified chat room.  Creates the room if it doesn't exist.";
-	joinRoom.Execute = std::bind(&ClientHandler::JoinRoomHandler, this, std::placeholders::_1);
-	_mCommands[joinRoom.strString] = joinRoom;
-
-	Command leaveRoom;
-	leaveRoom.strString = "/leave";
-	leaveRoom.strDescription = "Leaves the current chat room.";
-	leaveRoom.Execute = std::bind(&ClientHandler::LeaveRoomHandler, this);
-	_mCommands[leaveRoom.strString] = leaveRoom;
-
-	Command who;
-	who.strString = "/who";
-	who.strDescription = "Prints the list of people in the given chat room.  " 
-											 "If no room is specified, shows everyone connected.";
-	who.Execute = std::bind(&ClientHandler::WhoHandler, this, std::placeholders::_1);
-	_mCommands[who.strString] = who;
-
-	Command msg;
-	msg.strString = "/msg";
-	msg.strDescription = "Send private message to user (/msg wilbur salutations!)";
-	msg.Execute = std::bind(&ClientHandler::MsgHandler, this, std::placeholders::_1);
-	_mCommands[msg.strString] = msg;
-
-	Command help;
-	help.strString = "/help";
-	help.strDescription = "Prints this list, but only when you recognize you need to ask for it.";
-	help.Execute = std::bind(&ClientHandler::ListCommands, this);
-	_mCommands[help.strString] = help;
 }
 
 ChatServer::ClientHandler::~ClientHandler()
 {
-	_cm.RemoveClient(this);
+	_loop.GetTimers().Cancel(_idleTimer);
+	_loop.GetFineTimers().Cancel(_throttleTimer);
+	if(_bLoggedIn)
+	{
+		_cm.RemoveClient(this);
+	}
 	close(_iSocketFD);
 }
 
-void ChatServer::ClientHandler::HandleClient()
+void ChatServer::ClientHandler::Start()
 {
-	int result = 0;
+	_loop.GetTimers().Schedule(_idleTimer, seconds(MAX_IDLE_SECONDS + 1));
 
-	try
+	// Everybody gets the same greeting, so it's built once
+	static const SharedMessage greeting = MakeMessage("Welcome to this world!!\nLogin Name?\n");
+	Enqueue(greeting);
+	if(_bDone)
 	{
-		// Make them login first
-		LoginHandler();
+		Finish();
+	}
+}
 
-		while(!_bDone)
+void ChatServer::ClientHandler::Resume(const ClientState& state)
+{
+	_loop.GetTimers().Schedule(_idleTimer, seconds(MAX_IDLE_SECONDS + 1));
+	_iLoginTriesLeft = state.LoginTriesLeft;
+
+	// Whatever they were halfway through typing
+	size_t space = 0;
+	char* buffer = _framer.WriteSpace(state.Input.length(), space);
+	memcpy(buffer, state.Input.data(), state.Input.length());
+	_framer.Commit(state.Input.length());
+
+	if(state.UserName != "")
+	{
+		_userName = NameTable::Users().Intern(state.UserName);
+		_currentRoom = NameTable::Rooms().Intern(state.CurrentRoom);
+		if(!_cm.RestoreClient(this))
 		{
-			// See if there's a message from the client
-			if(!DataPending())
-			{
-				// If it's been too long since they sent anything, assume they DCd
-				auto duration = duration_cast<seconds>(steady_clock::now() - _tLastRead);
-				if(duration.count() > MAX_IDLE_SECONDS)
-				{
-					// Assume they've DCd
-					syslog(
-						LOG_NOTICE, 
-						"Kicking inactive client %s", 
-						_strUserName.c_str()
-						);
-					WriteString("You've been idle for too long.\n");
-					break;
-				}
+			// Somebody's got in with their name in between
+			Bail("their name was taken during the handoff");
+			_userName = Name();
+			_currentRoom = Name();
+		}
+		else
+		{
+			_bLoggedIn = true;
+		}
+	}
 
-				// Nothing to read, or empty message
-				// So sleep for a bit - don't want to spin as fast as possible...
-				std::this_thread::sleep_for(std::chrono::milliseconds(250));
+	// And whatever we hadn't managed to send them yet
+	if(state.Output != "")
+	{
+		Enqueue(MakeMessage(state.Output));
+	}
 
-				// Start over
-				continue;
-			}
+	if(_bDone)
+	{
+		Finish();
+	}
+	else if(_framer.Pending() > 0)
+	{
+		// Lines the old server was holding back (FloodPolicy::DELAY) are
+		// complete already, so the socket won't say there's anything to
+		// read; the throttle timer picks them up
+		_loop.GetFineTimers().Schedule(_throttleTimer, milliseconds(0));
+	}
+}
 
-			string msg = ReadString(); 
-			CommandMessage pcmd;
+ChatServer::ClientState ChatServer::ClientHandler::SaveState() const
+{
+	ClientState state;
+	state.UserName = _bLoggedIn ? _userName.Text() : "";
+	state.CurrentRoom = _currentRoom.Text();
+	state.LoginTriesLeft = _iLoginTriesLeft;
+	state.Input = _framer.Unfinished();
+
+	state.Output.reserve(_iOutBytes);
+	for(size_t i = 0; i < _qOutbound.Size(); ++i)
+	{
+		size_t skip = (i == 0) ? _iOutOffset : 0;
+		state.Output.append(*_qOutbound[i], skip, string::npos);
+	}
+	return state;
+}
 
-			// Check to see if we've got a command or a generic chat message
-			if(ParseCommand(msg, std::ref(pcmd)))
-			{
-				_mCommands[pcmd.CommandString].Execute(pcmd.Args);
-			}
-			else if(_strCurrentRoom != "") 
+void ChatServer::ClientHandler::HandleEvents(uint32_t events)
+{
+	// Clients come and go all the time, so none of that throws; only the
+	// truly unexpected (running out of memory, say) ends up in the catch
+	try
+	{
+		ReadStatus status = ReadStatus::DRAINED;
+		if(events & EPOLLERR)
+		{
+			// A reset is just a rude goodbye
+			int error = 0;
+			socklen_t length = sizeof(error);
+			getsockopt(_iSocketFD, SOL_SOCKET, SO_ERROR, &error, &length);
+			status = (error == ECONNRESET || error == EPIPE) ? ReadStatus::CLOSED : ReadStatus::FAILED;
+		}
+		else
+		{
+			// The socket has room again, so push out whatever's been waiting
+			if(events & EPOLLOUT)
 			{
-				// If they're in a chat room, post a msg
-				_cm.PostMsgToRoom(msg, _strCurrentRoom, _strUserName);
+				Flush();
 			}
-			else
+
+			// See if there are messages from the client
+			if(!_bDone && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)))
 			{
-				// They're not in a chat room, and they didn't issue a command
-				// So suggest something helpful
-				WriteString("Please join a chat room before posting a message.\n");
-				ListCommands();
+				status = ReadMessages();
 			}
 		}
+
+		switch(status)
+		{
+			case ReadStatus::DRAINED:
+				break;
+			case ReadStatus::CLOSED:
+				_bDone = true;
+				break;
+			case ReadStatus::FAILED:
+				Log::Write(LOG_NOTICE, "ClientHandler::HandleEvents()> socket error for user %s", _userName.Text().c_str());
+				_bDone = true;
+				break;
+			case ReadStatus::FLOODED:
+				Bail("client sent too much data");
+				break;
+		}
 	} 
-	catch(const std::runtime_error& ex)
+	catch(const std::exception& ex)
 	{
-		syslog(
+		Log::Write(
 			LOG_ALERT, 
-			"ClientHandler::HandleClient()> Runtime error: %s", 
+			"ClientHandler::HandleEvents()> Runtime error: %s", 
 			ex.what()); 
+		_bDone = true;
 	}
 	catch(...)
 	{
-		syslog(LOG_ALERT, "ClientHandler::HandleClient()> GREMLINS DETECTED!"); 
+		Log::Write(LOG_ALERT, "ClientHandler::HandleEvents()> GREMLINS DETECTED!"); 
+		_bDone = true;
 	}
 
-	ShutdownConnection();
+	if(_bDone)
+	{
+		Finish();
+	}
+}
+
+void ChatServer::ClientHandler::HandleMessage(string_view msg)
+{
+	// Make them login first
+	if(!_bLoggedIn)
+	{
+		LoginHandler(msg);
+		return;
+	}
+
+	CommandMessage pcmd;
+
+	// Check to see if we've got a command or a generic chat message
+	if(ParseCommand(msg, pcmd))
+	{
+		(this->*pcmd.Cmd->Execute)(pcmd.Args);
+	}
+	else if(!_currentRoom.Empty()) 
+	{
+		// If they're in a chat room, post a msg
+		_cm.PostMsgToRoom(msg, _currentRoom, _userName);
+	}
+	else
+	{
+		// They're not in a chat room, and they didn't issue a command
+		// So suggest something helpful
+		WriteString("Please join a chat room before posting a message.\n");
+		ListCommands();
+	}
+}
+
+void ChatServer::ClientHandler::CheckIdle()
+{
+	// Reads only note the time, rather than touching the timer, so this is
+	// where the timer catches up with a client that's still active.
+	auto duration = duration_cast<seconds>(steady_clock::now() - _tLastRead);
+	if(duration.count() <= MAX_IDLE_SECONDS)
+	{
+		_loop.GetTimers().Schedule(
+		  _idleTimer, 
+		  seconds(MAX_IDLE_SECONDS - duration.count() + 1));
+		return;
+	}
+
+	// If it's been too long since they sent anything, assume they DCd
+	Log::Write(
+		LOG_NOTICE, 
+		"Kicking inactive client %s", 
+		_userName.Text().c_str()
+		);
+	WriteString("You've been idle for too long.\n");
+	Metrics::Count(Counter::IDLE_KICKS);
+	Finish();
 }
 
 //---------------------------------------------------------
 // Command handler functions
 //---------------------------------------------------------
-void ChatServer::ClientHandler::ListRoomsHandler(const std::string& args)
+bool ChatServer::ClientHandler::ParseListingQuery(string_view& args, ListingQuery& query)
 {
-	std::ostringstream str;
-	auto roomNames = _cm.GetRooms();
+	const size_t MAX_NUMBER_LENGTH = 9; // Plenty, and no overflow
 
-	// If there aren't any rooms, let them know.
-	if(roomNames.size() <= 0)
+	string_view rest;
+	while(!args.empty())
+	{
+		size_t end = args.find(' ');
+		string_view word = args.substr(0, end);
+		args.remove_prefix(end == string_view::npos ? args.length() : end + 1);
+		if(word.empty())
+		{
+			continue;
+		}
+
+		size_t equals = word.find('=');
+		if(equals == string_view::npos)
+		{
+			if(!rest.empty())
+			{
+				Enqueue(FormatMessage({"Only one name, please ('", rest, "' or '", word, "')\n"}));
+				return false;
+			}
+			rest = word;
+			continue;
+		}
+
+		// Names are only ever letters and numbers, and so are these
+		string_view option = word.substr(0, equals);
+		string_view value = word.substr(equals + 1);
+		bool numeric = option != "prefix";
+		bool valid = !value.empty() && (!numeric || value.length() <= MAX_NUMBER_LENGTH);
+		size_t number = 0;
+		for(char c: value)
+		{
+			bool digit = '0' <= c && c <= '9';
+			bool letter = ('A' <= c && c <= 'Z') || ('a' <= c && c <= 'z');
+			valid = valid && (digit || (!numeric && letter));
+			if(numeric && digit)
+			{
+				number = number * 10 + (c - '0');
+			}
+		}
+
+		if(option != "prefix" && option != "offset" && option != "limit")
+		{
+			Enqueue(FormatMessage({"Unknown option '", option, "' - try prefix=, offset= or limit=\n"}));
+			return false;
+		}
+		if(!valid || (option == "limit" && number == 0))
+		{
+			Enqueue(FormatMessage({"That's not a valid ", option, ": '", value, "'\n"}));
+			return false;
+		}
+
+		if(option == "prefix")
+		{
+			query.Prefix = value;
+		}
+		else if(option == "offset")
+		{
+			query.Offset = number;
+		}
+		else
+		{
+			query.Limit = std::min(number, ListingQuery::MAX_PAGE);
+		}
+	}
+
+	args = rest;
+	return true;
+}
+
+void ChatServer::ClientHandler::ListRoomsHandler(string_view args)
+{
+	ListingQuery query;
+	if(!ParseListingQuery(args, query))
 	{
-		WriteString("No active rooms.  Make one with '/join " 
-							  + _strUserName + "sPartyTimeLounge'!\n");
 		return;
 	}
 
-	str << "Active rooms are: " << endl;
-	for(auto& room: roomNames)
+	// The listing is kept up to date as rooms change, so there's nothing to build
+	SharedMessage rooms = _cm.ListRooms(_currentRoom, query);
+
+	// If there aren't any rooms, let them know.
+	if(!rooms)
 	{
-		auto occupants = _cm.GetUsersIn(room);
-		str << "  * " << room << "(" << occupants.size() << ")"; 
-		if(_strCurrentRoom == room)
-		{
-			str << " <-- you are here";
-		}
-		str << endl;
+		Enqueue(FormatMessage({"No active rooms.  Make one with '/join ", 
+		                       _userName, "sPartyTimeLounge'!\n"}));
+		return;
 	}
-	str << "end of list" << endl;
-	WriteString(str.str());
+	Enqueue(rooms);
 }
 
-void ChatServer::ClientHandler::JoinRoomHandler(const std::string& args)
+void ChatServer::ClientHandler::JoinRoomHandler(string_view args)
 {
 	// Make sure they're not furiously standing still
-	if(_cm.ToUpper(args) == _cm.ToUpper(_strCurrentRoom))
+	if(FoldedEqual()(args, _currentRoom))
 	{
-		WriteString("You stay in " + _strCurrentRoom + "...\n");
+		Enqueue(FormatMessage({"You stay in ", _currentRoom, "...\n"}));
 		return;
 	}
 
 	// Make sure the name doesn't have any weird characters
-	for(int i = 0; i < args.length(); ++i)
+	for(size_t i = 0; i < args.length(); ++i)
 	{
 		// If the current letter isn't A-Za-z0-9, try again.
 		if(!(('A' <= args[i] && args[i] <= 'Z') ||
@@ -214,75 +513,65 @@ void ChatServer::ClientHandler::JoinRoomHandler(const std::string& args)
 		}
 	}
 
-	_cm.SwitchRoom(_strCurrentRoom, args, this);
-	WriteString("entering room: " + _strCurrentRoom + "\n");
+	SharedMessage history = _cm.SwitchRoom(_currentRoom, NameTable::Rooms().Intern(args), this);
+	Enqueue(FormatMessage({"entering room: ", _currentRoom, "\n"}));
+	if(history)
+	{
+		// Catch them up on what they missed, in one go
+		Enqueue(history);
+	}
 	WhoHandler(args);
 }
 
-void ChatServer::ClientHandler::WhoHandler(const std::string& args)
+void ChatServer::ClientHandler::WhoHandler(string_view args)
 {
-	std::ostringstream str;
-	string roomName = _cm.GetProperRoomName(args);
-
-	if(roomName == "" && args != "")
+	ListingQuery query;
+	if(!ParseListingQuery(args, query))
 	{
-		// The room name they specified is not valid
-		str << "Room '" << args << "' does not exist." << endl;
-		WriteString(str.str());
 		return;
 	}
 
-	// Get the list of users in the given room
-	auto users = _cm.GetUsersIn(roomName);
-
-	// If they asked for an empty room...
-	if(users.size() == 0 && roomName != "")
+	// Everyone is a listing that's kept ready
+	if(args.empty())
 	{
-		str << "Room '" << roomName << "' is empty." << endl;
-		WriteString(str.str());
+		Enqueue(_cm.ListUsers(_userName, query));
 		return;
 	}
 
-	// If they asked for ALL users
-	if(args == "")
-	{
-		str << "Users connected: " << endl;
-	}
-	// If they asked for a valid room
-	else
+	Name roomName = _cm.GetProperRoomName(args);
+
+	if(roomName.Empty())
 	{
-		str << "Users in " << roomName << ":" << endl;
+		// The room name they specified is not valid
+		Enqueue(FormatMessage({"Room '", args, "' does not exist.\n"}));
+		return;
 	}
-	for(auto& user: users)
+
+	// Get the list of users in the given room
+	SharedMessage users = _cm.ListUsersIn(roomName, _userName, query);
+
+	// If they asked for an empty room...
+	if(!users)
 	{
-		str << "  * " << user; 
-		if(user == _strUserName)
-		{
-			str << " (** this is you)";
-		}
-		str << endl;
+		Enqueue(FormatMessage({"Room '", roomName, "' is empty.\n"}));
+		return;
 	}
-	str << "end of list" << endl;
-	WriteString(str.str());
+	Enqueue(users);
 }
 
-void ChatServer::ClientHandler::MsgHandler(const std::string& args)
+void ChatServer::ClientHandler::MsgHandler(string_view args)
 {
 	// Extract the target name from the args (should be first word shape)
-	string dest = "";
-	int i;
+	size_t i;
 	for(i = 0; i < args.length(); ++i)
 	{
-		if(('a' <= args[i] && args[i] <= 'z') ||
-		   ('A' <= args[i] && args[i] <= 'Z'))
-		{
-			dest += args[i];
-		}
-		else
+		if(!(('a' <= args[i] && args[i] <= 'z') ||
+		     ('A' <= args[i] && args[i] <= 'Z')))
 		{
 			break;
 		}
 	}
+	string_view dest = args.substr(0, i);
 
 	if(dest.length() <= 0)
 	{
@@ -291,120 +580,121 @@ void ChatServer::ClientHandler::MsgHandler(const std::string& args)
 	}
 
 	// This is an indication of madness. 
-	if(_cm.ToUpper(dest) == _cm.ToUpper(_strUserName))
+	if(FoldedEqual()(dest, _userName))
 	{
-		WriteString("Talking to yourself again, eh " + _strUserName + "?\n");
+		Enqueue(FormatMessage({"Talking to yourself again, eh ", _userName, "?\n"}));
 		return;
 	}
 
-	// See if that's a valid user name
-	if(!_cm.DoesUserExist(dest))
+	// Make sure we've got the right representation of the user name (and
+	// see if that's a valid user name at all)
+	Name properDest = _cm.GetProperUserName(dest);
+	if(properDest.Empty())
 	{
 		// Invalid user name
-		WriteString("User '" + dest + "' does not exist.\n");
+		Enqueue(FormatMessage({"User '", dest, "' does not exist.\n"}));
 		return;
 	}
 
-	// Make sure we've got the right representation of the user name
-	dest = _cm.GetProperUserName(dest);
-
 	// We found the right user! Now need to validate message
 	if(args.length() <= dest.length()+1)
 	{
-		WriteString("You must specify a message to send to " + dest + 
-				"; example: /msg wilbur salutations!\n");
+		Enqueue(FormatMessage({"You must specify a message to send to ", properDest, 
+		                       "; example: /msg wilbur salutations!\n"}));
 		return;
 	}
 
 	// If we made it here, everything's good to go - send the message.
-	string msg = args.substr(i+1);
-	_cm.SendMsgToUser(msg, _strUserName, dest);
+	// (They might have left since we looked them up, though.)
+	if(_cm.SendMsgToUser(args.substr(i+1), _userName, properDest) == SendStatus::NO_SUCH_USER)
+	{
+		Enqueue(FormatMessage({"User '", dest, "' does not exist.\n"}));
+	}
 }
 
-void ChatServer::ClientHandler::LeaveRoomHandler()
+void ChatServer::ClientHandler::LeaveRoomHandler(string_view /* args */)
 {
 	// Sanity check
-	if(_strCurrentRoom == "")
+	if(_currentRoom.Empty())
 	{
 		WriteString("You can't leave a room you never joined...\n");
 		return;
 	}
-	_cm.SwitchRoom(_strCurrentRoom, "", this);
+	_cm.SwitchRoom(_currentRoom, Name(), this);
 }
 
-void ChatServer::ClientHandler::LoginHandler()
+void ChatServer::ClientHandler::HelpHandler(string_view /* args */)
 {
-	try
-	{
-		WriteString("Welcome to this world!!\n");
-
-		_strUserName = "";
-		int tries_left = 5;
-		do
-		{
-			WriteString("Login Name?\n");
-			_strUserName = ReadString();
-
-			if(_strUserName.length() > MAX_USER_NAME_LENGTH)
-			{
-				WriteString("That name's too long.  Try again!\n");
-				_strUserName = "";
-				continue;
-			}
+	ListCommands();
+}
 
-			// Filter out any invalid chars
-			for(int i = 0; i < _strUserName.length(); ++i)
-			{
-				char c = _strUserName[i];
-				if(!(('A' <= c && c <= 'Z') || 
-				     ('a' <= c && c <= 'z')))
-				{
-				 	// If there's an invalid character, TRY AGAIN
-					WriteString("Invalid user name: only letters allowed. Try again!\n");
-					_strUserName = "";
-					break;
-				}
-			}
-			// If we cleared the user name in the previous loop, try again
-			if(_strUserName == "")
-			{
-				continue;
-			}
+void ChatServer::ClientHandler::LoginHandler(string_view name)
+{
+	bool valid = !name.empty();
 
-			// Check for name collision
-			if(_cm.DoesUserExist(_strUserName))
-			{
-				WriteString("That name is taken.  Try again!\n");
+	if(name.length() > MAX_USER_NAME_LENGTH)
+	{
+		WriteString("That name's too long.  Try again!\n");
+		valid = false;
+	}
 
-				// Try again, name was taken
-				_strUserName = "";
-				continue;
-			} 
+	// Filter out any invalid chars
+	for(size_t i = 0; valid && i < name.length(); ++i)
+	{
+		char c = name[i];
+		if(!(('A' <= c && c <= 'Z') || 
+		     ('a' <= c && c <= 'z')))
+		{
+		 	// If there's an invalid character, TRY AGAIN
+			WriteString("Invalid user name: only letters allowed. Try again!\n");
+			valid = false;
+		}
+	}
 
-			_cm.AddClient(this);
+	// Check for name collision
+	if(valid)
+	{
+		_userName = NameTable::Users().Intern(name);
+		if(_cm.DoesUserExist(_userName) || !_cm.AddClient(this))
+		{
+			WriteString("That name is taken.  Try again!\n");
 
-		} while(_strUserName == "" && --tries_left > 0);
+			// Try again, name was taken
+			_userName = Name();
+			valid = false;
+		}
+	} 
 
-		if(tries_left <= 0)
+	// If the name didn't make it, they get another go (maybe)
+	if(!valid)
+	{
+		if(--_iLoginTriesLeft <= 0)
 		{
 			WriteString("Max number of attempts reached.  "  
 									"No soup for you!  Come back one year!\n");
 			Bail("too many invalid login attempts");
+			return;
 		}
-
-		WriteString("Welcome, " + _strUserName + "\n");
-		ListCommands();
+		WriteString("Login Name?\n");
+		return;
 	}
-	catch(const std::runtime_error& ex)
+
+	_bLoggedIn = true;
+	WriteString("Welcome, " + _userName.Text() + "\n");
+	ListCommands();
+
+	// Back after a restart?  Then straight back to where they were.
+	Name room = _cm.TakeReturningRoom(_userName);
+	if(!room.Empty())
 	{
-		syslog(LOG_NOTICE, "Problem with login: %s",ex.what());
-		_bDone = true;
+		JoinRoomHandler(room);
 	}
 }
 
-void ChatServer::ClientHandler::QuitHandler(std::string args)
+void ChatServer::ClientHandler::QuitHandler(string_view /* args */)
 {
 	_cm.RemoveClient(this);
+	_bLoggedIn = false;
 	WriteString("BYE\n");
 	_bDone = true;
 }
@@ -413,251 +703,441 @@ void ChatServer::ClientHandler::QuitHandler(std::string args)
 // Utility functions
 //---------------------------------------------------------
 
-void ChatServer::ClientHandler::ShutdownConnection()
+void ChatServer::ClientHandler::Finish()
 {
-	// Don't want any more reading / writing
-	std::lock_guard<std::mutex> lock(_mMutex);
+	if(_bReleased)
+	{
+		return;
+	}
+	_bReleased = true;
+	Metrics::Count(Counter::DISCONNECTS);
 
-	try
+	// Get out of the chat before anyone else can queue messages for us
+	if(_bLoggedIn)
 	{
-		// Tell the main loop we're done
-		_bDone = true;
+		_cm.RemoveClient(this);
+		_bLoggedIn = false;
+	}
 
-		// Tell the OS we're not writing any more
-		shutdown(_iSocketFD, SHUT_WR);
+	_loop.GetTimers().Cancel(_idleTimer);
+	_loop.GetFineTimers().Cancel(_throttleTimer);
+	ShutdownConnection();
+	_loop.Release(this);
+}
 
-		// Put the socket in non-blocking mode
-		// (we don't want a blocking read call to hold us up)
-		fcntl(_iSocketFD, F_SETFL, O_NONBLOCK);
+void ChatServer::ClientHandler::ShutdownConnection()
+{
+	// Tell the main loop we're done
+	_bDone = true;
 
-		// Read any remaining data, throw it away
-		const int BUF_SIZE = 256;
-		char buf[BUF_SIZE];
-		int bytesRead = 0;
-		do
-		{
-			bytesRead = recv(_iSocketFD, buf, BUF_SIZE, 0);
-		}
-		while(bytesRead > 0);
+	// Tell the OS we're not writing any more (errors don't matter, we're
+	// shutting down)
+	shutdown(_iSocketFD, SHUT_WR);
 
-		// Tell the OS we're not reading any more
-		shutdown(_iSocketFD, SHUT_RD);
-	}
-	catch(...)
+	// The socket is already non-blocking, so a read won't hold us up.
+	// Read any remaining data, throw it away
+	const int BUF_SIZE = 256;
+	char buf[BUF_SIZE];
+	int bytesRead = 0;
+	do
 	{
-		// Silently drop errors here - we're shutting down
+		bytesRead = recv(_iSocketFD, buf, BUF_SIZE, 0);
 	}
+	while(bytesRead > 0);
+
+	// Tell the OS we're not reading any more
+	shutdown(_iSocketFD, SHUT_RD);
 }
 
 void ChatServer::ClientHandler::ListCommands()
 {
-	string msg = "Available commands:\n";
-	for(auto& item: _mCommands)
+	Enqueue(CommandTable::Help());
+}
+
+void ChatServer::ClientHandler::SendMsg(const SharedMessage& msg)
+{
+	if(_loop.InLoopThread())
+	{
+		Deliver(msg);
+	}
+	else
 	{
-		msg += "\t" + item.second.strString + ": " 
-		       + item.second.strDescription + "\n";
+		// Only the owning loop touches the socket.  The loop won't delete us 
+		// until it has run everything queued ahead of the delete.
+		_loop.Post([this, msg]() { Deliver(msg); });
 	}
-	WriteString(msg);
 }
 
-void ChatServer::ClientHandler::SendMsg(const std::string& msg)
+void ChatServer::ClientHandler::Deliver(const SharedMessage& msg)
 {
-	WriteString(msg);
+	if(_bDone)
+	{
+		return;
+	}
+
+	Enqueue(msg);
+
+	// Someone else's message might be what broke the connection; we can't
+	// leave the chat in the middle of their broadcast, so do it afterwards.
+	if(_bDone && !_bReleased)
+	{
+		_loop.Post([this]() { Finish(); });
+	}
 }
 
-std::string ChatServer::ClientHandler::ReadString()
+ChatServer::ReadStatus ChatServer::ClientHandler::ReadMessages()
 {
 	const int BUF_SIZE = 512;
 	const int MAX_MSG_SIZE = 1024;
-	int bytesRead = 0;
-	char buffer[BUF_SIZE];
-	memset(buffer, '\0', BUF_SIZE);
-	string msg = "";
-
-	// There's something to read - so get a lock and read!
-	std::lock_guard<std::mutex> lock(_mMutex);
+	char* line;
+	size_t length;
+	bool delay = _loop.GetConfig().Flood == FloodPolicy::DELAY;
 
-	// Read all available bytes, create a string, but keep it reasonable
-	int bytesAvailable = 0;
-	do
+	// Edge-triggered - read until the socket is empty
+	while(!_bDone)
 	{
-		bytesRead = recv(_iSocketFD, buffer, BUF_SIZE, 0);
+		// Every complete line is a message, however many came in together -
+		// including any held over from when they were last over the limits
+		auto now = steady_clock::now();
+		while(!_bDone)
+		{
+			// Leave the rest where it is, and the socket unread, until they've
+			// caught up; the timer will pick up where we left off
+			auto debt = std::max(_lineBucket.Debt(now), _byteBucket.Debt(now));
+			if(delay && debt.count() > 0)
+			{
+				if(!_throttleTimer.IsScheduled())
+				{
+					Metrics::Count(Counter::FLOODS);
+				}
+				_loop.GetFineTimers().Schedule(_throttleTimer, duration_cast<milliseconds>(debt) + milliseconds(1));
+				return ReadStatus::DRAINED;
+			}
+
+			if(!_framer.NextLine(line, length))
+			{
+				break;
+			}
+			Metrics::Count(Counter::LINES_IN);
+			if(Admit(length, now))
+			{
+				HandleMessage(Scrub(line, length));
+			}
+		}
+
+		// If there's this much and still no end of line...
+		if(_framer.Pending() > MAX_MSG_SIZE)
+		{
+			// The client sent way too much stuff, time to kick them
+			return ReadStatus::FLOODED;
+		}
+
+		size_t space = 0;
+		char* buffer = _framer.WriteSpace(BUF_SIZE, space);
+		ssize_t bytesRead = recv(_iSocketFD, buffer, space, 0);
 
 		if(bytesRead == 0)
 		{
-			throw std::runtime_error("Client disconnect detected in ReadString()");
+			// Deal with anything they didn't get to finish, then let them go
+			if(_framer.Remainder(line, length) && Admit(length, steady_clock::now()))
+			{
+				HandleMessage(Scrub(line, length));
+			}
+			return ReadStatus::CLOSED;
 		}
 
 		if(bytesRead < 0)
 		{
-			throw std::runtime_error("could not read from client socket.");
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				return ReadStatus::DRAINED;
+			}
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			return (errno == ECONNRESET) ? ReadStatus::CLOSED : ReadStatus::FAILED;
 		}
 
 		// Make a note of when this read happened
 		_tLastRead = std::chrono::steady_clock::now();
+		_framer.Commit(bytesRead);
+		Metrics::Count(Counter::BYTES_IN, bytesRead);
+	}
+	return ReadStatus::DRAINED;
+}
 
-		msg += buffer;
-		ioctl(_iSocketFD, FIONREAD, &bytesAvailable);
+bool ChatServer::ClientHandler::Admit(size_t length, steady_clock::time_point now)
+{
+	// The line ending counts too, or empty lines would be free
+	switch(_loop.GetConfig().Flood)
+	{
+		case FloodPolicy::DELAY:
+			// Always handled; ReadMessages() holds up the next one
+			_lineBucket.Charge(1, now);
+			_byteBucket.Charge(length + 1, now);
+			return true;
+		case FloodPolicy::DROP:
+			if(TakeLine(length, now))
+			{
+				_bFlooding = false;
+				return true;
+			}
+			if(!_bFlooding)
+			{
+				// Once per flood, not once per line
+				_bFlooding = true;
+				Metrics::Count(Counter::FLOODS);
+				WriteString("You're sending too fast - some of your messages were dropped.\n");
+			}
+			return false;
+		case FloodPolicy::DISCONNECT:
+			if(TakeLine(length, now))
+			{
+				return true;
+			}
+			Metrics::Count(Counter::FLOODS);
+			Bail("client sent too fast");
+			return false;
 	}
-	while(msg.length() < MAX_MSG_SIZE && bytesAvailable > 0);
+	return true;
+}
 
-	// If we get here, and the buffer is at the cap, but there's more data...
-	if(msg.length() >= MAX_MSG_SIZE && bytesAvailable > 0)
+bool ChatServer::ClientHandler::TakeLine(size_t length, steady_clock::time_point now)
+{
+	// Both or neither, or a line the byte limit turns away would still use
+	// up one of their lines
+	if(!_lineBucket.Allows(1, now) || !_byteBucket.Allows(length + 1, now))
 	{
-		// The client sent way too much stuff, time to kick them
-		throw std::runtime_error("client sent too much data");
+		return false;
 	}
+	_lineBucket.Charge(1, now);
+	_byteBucket.Charge(length + 1, now);
+	return true;
+}
 
-	return Scrub(msg);
+void ChatServer::ClientHandler::WriteString(string_view msg)
+{
+	Enqueue(FormatMessage({msg}));
 }
 
-void ChatServer::ClientHandler::WriteString(const std::string& msg)
+void ChatServer::ClientHandler::Enqueue(const SharedMessage& msg)
 {
-	std::lock_guard<std::mutex> lock(_mMutex);
+	if(_bReleased || msg->length() == 0)
+	{
+		return;
+	}
+
+	_qOutbound.PushBack(msg);
+	_iOutBytes += msg->length();
 
-	// Make sure the socket is in a valid state before trying to send
-	int error = 0;
-	socklen_t len = sizeof (error);
-	int retval = getsockopt (_iSocketFD, SOL_SOCKET, SO_ERROR, &error, &len );
-	if(retval != 0)
+	if(_iOutBytes > _loop.GetConfig().OutboundHighWater)
 	{
-		// Problem with the socket, we should bail
-		Bail("socket error detected before writing, aborting");
+		HandleSlowConsumer();
+	}
+
+	// If the socket is already full, the loop will tell us (EPOLLOUT) when 
+	// there's room again - no point asking it now.
+	if(!_bDone && !_bWaitingToWrite)
+	{
+		Flush();
+	}
+}
+
+void ChatServer::ClientHandler::HandleSlowConsumer()
+{
+	const ServerConfig& config = _loop.GetConfig();
+	if(config.SlowConsumer == SlowConsumerPolicy::DISCONNECT)
+	{
+		_qOutbound.Clear();
+		_iOutBytes = 0;
+		_iOutOffset = 0;
+		Metrics::Count(Counter::SEND_FAILURES);
+		Bail("client can't keep up with its messages");
 		return;
 	}
 
+	// Drop the oldest lines until we're back under the low watermark, but
+	// never one that's partly sent - that would garble the stream.
+	int dropped = 0;
+	size_t oldest = (_iOutOffset > 0) ? 1 : 0;
+	while(_iOutBytes > config.OutboundLowWater && oldest < _qOutbound.Size())
+	{
+		_iOutBytes -= _qOutbound[oldest]->length();
+		_qOutbound.Erase(oldest);
+		++dropped;
+	}
+
+	Log::Write(
+		LOG_NOTICE, 
+		"Dropped %d queued messages for slow client %s", 
+		dropped, 
+		_userName.Text().c_str());
+}
+
+void ChatServer::ClientHandler::Flush()
+{
+	const int MAX_IOV = 64; // Messages handed to the kernel per call
+
 	// Send the message
 #ifdef __linux
 	int flags = 0 | MSG_NOSIGNAL; // <-- Prevents SIGPIPE (among other things)
 #else
 	int flags = 0;
 #endif
-	int result = send(_iSocketFD, msg.c_str(), sizeof(char)*msg.length(), flags);
-	if(result < 0)
+	_bWaitingToWrite = false;
+	while(!_qOutbound.Empty())
 	{
-		Bail("could not write to client socket");
+		// Gather as much of the queue as we can into one call
+		struct iovec iov[MAX_IOV];
+		int count = 0;
+		for(size_t i = 0; i < _qOutbound.Size() && count < MAX_IOV; ++i)
+		{
+			const string& m = *_qOutbound[i];
+			size_t skip = (count == 0) ? _iOutOffset : 0;
+			iov[count].iov_base = const_cast<char*>(m.data() + skip);
+			iov[count].iov_len = m.length() - skip;
+			++count;
+		}
+
+		struct msghdr hdr;
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.msg_iov = iov;
+		hdr.msg_iovlen = count;
+
+		ssize_t result = sendmsg(_iSocketFD, &hdr, flags);
+		if(result < 0)
+		{
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				// The loop will tell us (EPOLLOUT) when there's room again
+				_bWaitingToWrite = true;
+				return;
+			}
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			_qOutbound.Clear();
+			_iOutBytes = 0;
+			_iOutOffset = 0;
+			Metrics::Count(Counter::SEND_FAILURES);
+			Bail("could not write to client socket");
+			return;
+		}
+
+		// Only let go of a message once all of it has gone out
+		size_t sent = result;
+		size_t lines = 0;
+		_iOutBytes -= sent;
+		Metrics::Count(Counter::BYTES_OUT, sent);
+		while(sent > 0)
+		{
+			size_t remaining = _qOutbound[0]->length() - _iOutOffset;
+			if(sent < remaining)
+			{
+				_iOutOffset += sent;
+				break;
+			}
+			sent -= remaining;
+			_qOutbound.PopFront();
+			_iOutOffset = 0;
+			++lines;
+		}
+		Metrics::Count(Counter::LINES_OUT, lines);
 	}
 }
 
 void ChatServer::ClientHandler::Bail(const std::string err)
 {
-	syslog(
+	Log::Write(
 		LOG_ALERT, 
-		"Bailing on client thread for user %s because %s",
-		_strUserName.c_str(),
+		"Bailing on client for user %s because %s",
+		_userName.Text().c_str(),
 		err.c_str()
 		);
 	_bDone = true;
 }
 
-std::string ChatServer::ClientHandler::Scrub(const std::string& msg)
+string_view ChatServer::ClientHandler::Scrub(char* msg, size_t length)
 {
-	// Make sure every character is ascii, and it ends with null terminator
-	// int of 32-126 inclusive, avoids \t, \n, etc.
-	string scrubbed = "";
-	for(int i = 0; i < msg.length(); ++i)
-	{
-		if(msg[i] == '\0' || msg[i] == '\n' || msg[i] == '\r')
-		{
-			// Found a null-terminator - this should be the end of the string
-			// Also, assume that \n or \r signal the end of a message
-			return scrubbed;
-		}
-
-		if((msg[i] >= 32 && msg[i] <= 126)) 
-		{
-			scrubbed += msg[i];
-		}
-    else
-    {
-      scrubbed += ' ';
-    }
-	}
-	return scrubbed;
+	// Make sure every character is printable ascii, and stop at the first 
+	// null-terminator / end of line.  Done in place, in the input buffer.
+	return string_view(msg, ScrubInPlace(msg, length));
 }
 
 bool ChatServer::ClientHandler::ParseCommand(
-       const std::string& msg, 
+       string_view msg, 
 			 ChatServer::CommandMessage& pcmd)
 {
 	// If the string doesn't start with '/', it's not a command.
-	if(msg[0] != '/')
+	if(msg.empty() || msg[0] != '/')
 	{
 		return false;
 	}
 
-	string cmd = "/";
-	for(int i = 1; i < msg.length(); ++i)
+	// The command is everything up to the first non-[a-z] char (after the
+	// initial '/')
+	size_t length = 1;
+	while(length < msg.length() && msg[length] >= 'a' && msg[length] <= 'z')
 	{
-		// Accumulate all the characters until the first non-[a-z] char
-		// (after the initial '/')
-		if(msg[i] >= 'a' && msg[i] <= 'z')
-		{
-			cmd += msg[i];
-		}
-		else
-		{
-			break;
-		}
+		++length;
 	}
 
 	// If the length of accumulated chars is 0, we don't have a command.
-	if(cmd.length() <= 1)
+	if(length <= 1)
 	{
 		return false;
 	}
 
-	// We MIGHT have an actual command - search command structure
-	if(_mCommands.find(cmd) != _mCommands.end())
+	// We MIGHT have an actual command - look it up
+	pcmd.Cmd = CommandTable::Find(msg.substr(0, length));
+	if(pcmd.Cmd == NULL)
 	{
-		// Found a valid command!
-		pcmd.CommandString = cmd;
-
-		// Now might have to deal with args
-		if(msg.length() - cmd.length() > 0)
-		{
-			pcmd.Args = msg.substr(pcmd.CommandString.length()+1);
-		}
-		else
-		{
-			pcmd.Args = msg.substr(pcmd.CommandString.length()); 
-		}
-		return true;
+		return false;
 	}
-	
-	// If we made it here, we didn't find it.
-	return false;
+
+	// Whatever follows the separator after the command is the args
+	pcmd.Args = msg.substr(std::min(length + 1, msg.length()));
+	return true;
 }
 
-bool ChatServer::ClientHandler::DataPending()
+//---------------------------------------------------------
+// Getters & setters
+//---------------------------------------------------------
+const Name& ChatServer::ClientHandler::GetUserName() const
 {
-	int bytesAvailable = 0;
-	if(ioctl(_iSocketFD, FIONREAD, &bytesAvailable) < 0)
-	{
-		throw std::runtime_error("Could not run ioctl to get bytes available.");
-	}
+	return _userName;
+}
 
-	return bytesAvailable > 0;
+const Name& ChatServer::ClientHandler::GetCurrentRoom() const
+{
+	return _currentRoom;
 }
 
+void ChatServer::ClientHandler::SetCurrentRoom(const Name& room)
+{
+	_currentRoom = room;
+}
 
-//---------------------------------------------------------
-// Getters & setters
-//---------------------------------------------------------
-std::string ChatServer::ClientHandler::GetUserName() const
+size_t ChatServer::ClientHandler::GetRoomSlot() const
+{
+	return _iRoomSlot;
+}
+
+void ChatServer::ClientHandler::SetRoomSlot(size_t slot)
 {
-	return _strUserName;
+	_iRoomSlot = slot;
 }
 
-std::string ChatServer::ClientHandler::GetCurrentRoom() const
+int ChatServer::ClientHandler::GetSocket() const
 {
-	return _strCurrentRoom;
+	return _iSocketFD;
 }
 
-void ChatServer::ClientHandler::SetCurrentRoom(const std::string& room)
+ChatServer::EventLoop& ChatServer::ClientHandler::GetLoop() const
 {
-	std::lock_guard<std::mutex> lock(_mMutex);
-	_strCurrentRoom = room;
+	return _loop;
 }
 
 bool ChatServer::ClientHandler::StillValid()
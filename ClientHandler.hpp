@@ -1,26 +1,62 @@
 #ifndef CLIENT_HANDLER_HPP
 #define CLIENT_HANDLER_HPP
 
-#include <map>
-#include <mutex>
+#include <atomic>
 #include <string>
+#include <string_view>
 #include <chrono>
+#include <cstdint>
 #include "Command.hpp"
+#include "Message.hpp"
+#include "Name.hpp"
+#include "LineFramer.hpp"
+#include "OutboundQueue.hpp"
+#include "RateLimit.hpp"
+#include "TimerWheel.hpp"
 
 namespace ChatServer
 {
 
-// Forward declaration to avoid circular #include references.
+// Forward declarations to avoid circular #include references.
 class ChatManager;
+class EventLoop;
+struct ListingQuery;
 
 /**
 	Used as return value from ClientHandler::ParseCommand, to encapsulate both a 
-	command string and the remaining arguments.
+	command and the remaining arguments (a view into the message).
 **/
 struct CommandMessage
 {
-	std::string CommandString;
-	std::string Args;
+	const ChatServer::Command* Cmd;
+	std::string_view Args;
+};
+
+/**
+	Everything about a connection that has to survive being handed from one
+	server process to the next (see Handoff) - the socket itself goes
+	separately.
+**/
+struct ClientState
+{
+	std::string UserName; // "" if they haven't logged in yet
+	std::string CurrentRoom;
+	int LoginTriesLeft;
+	std::string Input; // Received, but not a whole line yet
+	std::string Output; // Queued for them, but not sent yet
+};
+
+/**
+	How a read went.  Everything but DRAINED ends the connection - but
+	they're all things that happen to connections every day, so they're
+	returned rather than thrown.
+**/
+enum class ReadStatus
+{
+	DRAINED, // Read everything there was; wait for more
+	CLOSED, // The client hung up
+	FAILED, // The socket reported an error
+	FLOODED // The client sent a line that's far too long
 };
 
 /**
@@ -29,94 +65,182 @@ struct CommandMessage
 	Takes a file descriptor in the constructor, and is intended to manage
 	all sending to and receiving from the client connected on that descriptor.
 
-	Designed to run ClientHandler::HandleClient() in its own thread.  Note that
-	the methods ReadString() and WriteString() are blocking (synchronous).
+	Driven by an EventLoop as a small state machine: the loop calls
+	HandleEvents() whenever the (non-blocking) socket becomes readable or
+	writable, and the handler moves from logging in to chatting to done.
+	Everything except SendMsg() must be called on the owning loop's thread.
 **/
 class ClientHandler
 {
+	friend struct CommandTable; // Needs at the command handlers
+
 private:
-	const int MAX_USER_NAME_LENGTH = 30; // Make sure user names aren't too big
+	const size_t MAX_USER_NAME_LENGTH = 30; // Make sure user names aren't too big
 	const int MAX_IDLE_SECONDS = 300; // If no msgs in 5 minutes, kick them!
+	const int MAX_LOGIN_TRIES = 5; // Invalid names allowed before we give up
 
-	std::mutex _mMutex; // To avoid threading issues when reading/writing
 	ChatManager& _cm;
+	EventLoop& _loop; // The loop that owns this connection
 	int _iSocketFD; // Socket for talking to the client
-	std::map<std::string, ChatServer::Command> _mCommands; // Command structure
-	std::string _strUserName; // User name associated with this connection
-	std::string _strCurrentRoom; // Name of room this user is currently in
-	bool _bDone; // Set to false to kill the connection and stop the thread
+	ChatServer::LineFramer _framer; // Input from the client, split into lines
+	ChatServer::Name _userName; // User name associated with this connection
+	ChatServer::Name _currentRoom; // Name of room this user is currently in
+	size_t _iRoomSlot; // Where we are in the room's member list (ChatManager's, under its lock)
+	ChatServer::OutboundQueue& _qOutbound; // Waiting for the socket (kept in our ConnectionPool slot)
+	size_t _iOutOffset; // How much of _qOutbound.front() has already gone out
+	size_t _iOutBytes; // Unsent bytes in _qOutbound
+	bool _bWaitingToWrite; // Socket is full, waiting for EPOLLOUT
+	std::atomic<bool> _bDone; // Set to true to kill the connection
+	bool _bLoggedIn; // Set once the user has picked a valid name
+	bool _bReleased; // Set once the loop has been told to let go of us
+	int _iLoginTriesLeft; // Counts down with every bad login name
 	std::chrono::steady_clock::time_point _tLastRead; // Detecting DCs/inactive
+	ChatServer::TimerWheel::Timer _idleTimer; // Goes off when they might be idle
+	ChatServer::TokenBucket _lineBucket; // Lines they can send (see ServerConfig::LineRate)
+	ChatServer::TokenBucket _byteBucket; // Bytes they can send (see ServerConfig::ByteRate)
+	bool _bFlooding; // Over the limits, and already told so (FloodPolicy::DROP)
+	ChatServer::TimerWheel::Timer _throttleTimer; // Goes off when they're back within the limits (FloodPolicy::DELAY; on the loop's fine timers)
 
 	/** Shuts down the socket and cleans up any remaining data **/
 	void ShutdownConnection();
 
+	/** 
+	Kicks the client if they haven't said anything in too long, otherwise 
+	sets the idle timer for when they could next be idle.
+	**/
+	void CheckIdle();
+
+	/** Leaves the chat, shuts down, and hands us back to the loop to delete **/
+	void Finish();
+
 	/**  Sends a list of commands to the connected client **/
 	void ListCommands();
 
 	/** 
-	Reads a string from the client, scrubs it and returns a std::string
-	WARNING - THIS WILL BLOCK THE CLIENT - you can't read or write from 
-	other threads while this is waiting for input. 
+	Reads everything waiting on the socket, and handles each complete line
+	as a message.  Partial lines are kept until the rest arrives.  If the
+	client's over its rate limits, and they're to be delayed, it stops
+	reading (leaving the kernel to hold them up) until the throttle timer
+	says they're back within them.
+	**/
+	ChatServer::ReadStatus ReadMessages(); 
+
+	/**
+	Counts a line against the rate limits, and returns false if it's not to
+	be handled - because they're over the limits, and the policy is to drop
+	it or kick them for it.
 	**/
-	std::string ReadString(); 
+	bool Admit(size_t length, std::chrono::steady_clock::time_point now);
 
-	/** Writes a string to the client **/
-	void WriteString(const std::string& msg);
+	/**
+	Takes a line of 'length' bytes out of both buckets if they've both got
+	room for it; takes nothing out of either if they haven't.
+	**/
+	bool TakeLine(size_t length, std::chrono::steady_clock::time_point now);
 
-	/** Scrubs the buffer for invalid characters, returns a string version **/
-	std::string Scrub(const std::string& msg);
+	/** Queues a string for the client, and sends as much as the socket takes **/
+	void WriteString(std::string_view msg);
 
-	/** Checks to see if data from the client is waiting on the socket **/
-	bool DataPending();
+	/** Queues a message for the client, and sends as much as the socket takes **/
+	void Enqueue(const ChatServer::SharedMessage& msg);
+
+	/** Sends as much of the pending output as the socket will take **/
+	void Flush();
+
+	/** Applies the configured policy once the outbound queue gets too big **/
+	void HandleSlowConsumer();
+
+	/** Writes a message on behalf of another client (loop thread only) **/
+	void Deliver(const ChatServer::SharedMessage& msg);
+
+	/** Handles one message from the client, based on where they are **/
+	void HandleMessage(std::string_view msg);
+
+	/** Scrubs the buffer (in place) for invalid characters, returns a view of what's left **/
+	std::string_view Scrub(char* msg, size_t length);
 
 	/** Checks to see if the given message is a valid command **/
 	bool IsCommand(const std::string& msg);
 
 	/** Parses the given message into a CommandMessage object **/
-	bool ParseCommand(const std::string& msg, ChatServer::CommandMessage& pcmd);
+	bool ParseCommand(std::string_view msg, ChatServer::CommandMessage& pcmd);
 
 	/** In case of emergency, call this **/
 	void Bail(const std::string err);
 
-	/** Handles user authentication **/
-	void LoginHandler();
+	/** Handles user authentication, one attempted name at a time **/
+	void LoginHandler(std::string_view name);
 
 	/** Handles the /quit command **/
-	void QuitHandler(std::string args);
+	void QuitHandler(std::string_view args);
 
 	/** Handles joining a new room **/
-	void JoinRoomHandler(const std::string& args);
+	void JoinRoomHandler(std::string_view args);
 
 	/** Handles leaving the current room **/
-	void LeaveRoomHandler();
+	void LeaveRoomHandler(std::string_view args);
+
+	/** 
+	Takes the listing options (prefix=, offset=, limit=) out of a /rooms or
+	/who's arguments, and leaves whatever else there was in 'args'.  Tells
+	the client, and returns false, if they don't make sense.
+	**/
+	bool ParseListingQuery(std::string_view& args, ChatServer::ListingQuery& query);
 
 	/** Lists the given rooms **/
-	void ListRoomsHandler(const std::string& args);
+	void ListRoomsHandler(std::string_view args);
 
 	/** Lists the people in the room **/
-	void WhoHandler(const std::string& args);
+	void WhoHandler(std::string_view args);
 
 	/** Sends a private message **/
-	void MsgHandler(const std::string& args);
+	void MsgHandler(std::string_view args);
+
+	/** Handles the /help command **/
+	void HelpHandler(std::string_view args);
 
 public:
-	ClientHandler(int fd, ChatManager& cm);
+	static const size_t INPUT_BUFFER_SIZE = 2048; // Input buffer each connection gets
+
+	/** 'inputBuffer' (of 'inputSize' bytes) and 'outbound' (empty) must outlive the handler **/
+	ClientHandler(int fd, ChatManager& cm, EventLoop& loop, char* inputBuffer, size_t inputSize, ChatServer::OutboundQueue& outbound);
 	~ClientHandler();
 
-	/** Main loop **/
-	void HandleClient();
+	/** Greets the client and asks them to log in **/
+	void Start();
+
+	/** Picks up where a connection handed over from the previous server left off, instead of Start() **/
+	void Resume(const ChatServer::ClientState& state);
+
+	/** Takes down everything Resume() needs to carry on (loop thread only) **/
+	ChatServer::ClientState SaveState() const;
+
+	/** Reacts to the epoll events reported for this client's socket **/
+	void HandleEvents(uint32_t events);
+
+	/** Returns the socket this client is talking on **/
+	int GetSocket() const;
+
+	/** Returns the loop that owns this client **/
+	EventLoop& GetLoop() const;
 
 	/** Returns the user's name **/
-	std::string GetUserName() const;
+	const ChatServer::Name& GetUserName() const;
 
 	/** Returns the current room name **/
-	std::string GetCurrentRoom() const;
+	const ChatServer::Name& GetCurrentRoom() const;
 
 	/** Sets the current room value **/
-	void SetCurrentRoom(const std::string& room);
+	void SetCurrentRoom(const ChatServer::Name& room);
+
+	/** Where this client is in its room's member list (room's shard locked) **/
+	size_t GetRoomSlot() const;
+
+	/** Moves this client in its room's member list (room's shard locked) **/
+	void SetRoomSlot(size_t slot);
 
-	/** Sends the given message to the user. **/
-	void SendMsg(const std::string& msg);
+	/** Sends the given message to the user (safe to call from any thread). **/
+	void SendMsg(const ChatServer::SharedMessage& msg);
 
 	/** If this returns false, this client is going away soon. **/
 	bool StillValid();
@@ -1,18 +1,22 @@
-
 #ifndef COMMAND_HPP
 #define COMMAND_HPP
 
-#include <string>
-#include <functional>
+#include <string_view>
 
 namespace ChatServer
 {
 
+class ClientHandler;
+
+/**
+	One slash command.  The whole set lives in a single constant table that
+	every connection shares, so there's nothing to build per client.
+**/
 struct Command
 {
-	std::string strString;
-	std::string strDescription;
-	std::function<void(std::string)> Execute;
+	std::string_view strString;
+	std::string_view strDescription;
+	void (ClientHandler::*Execute)(std::string_view args);
 };
 
 }
@@ -0,0 +1,84 @@
+#include "ConnectionPool.hpp"
+#include "ClientHandler.hpp"
+
+#include <new>
+
+using ChatServer::ConnectionPool;
+using ChatServer::ClientHandler;
+using ChatServer::OutboundQueue;
+
+/** Room for one connection: the handler itself, then its buffers **/
+struct ConnectionPool::Slot
+{
+	alignas(ClientHandler) unsigned char Handler[sizeof(ClientHandler)];
+	alignas(OutboundQueue) unsigned char Outbound[sizeof(OutboundQueue)];
+	char Input[ClientHandler::INPUT_BUFFER_SIZE];
+
+	OutboundQueue& Queue()
+	{
+		return *std::launder(reinterpret_cast<OutboundQueue*>(Outbound));
+	}
+};
+
+ConnectionPool::ConnectionPool(size_t capacity)
+	: _aSlots(new Slot[capacity]), _iCapacity(capacity), _iTouched(0)
+{
+	// Nothing is constructed in the slots yet, so untouched ones don't cost 
+	// any RSS - and nor does listing them, as they're all past _iTouched
+}
+
+ConnectionPool::~ConnectionPool()
+{
+	// Whoever owns the handlers must Destroy() them first
+	for(size_t i = 0; i < _iTouched; ++i)
+	{
+		_aSlots[i].Queue().~OutboundQueue();
+	}
+	delete[] _aSlots;
+}
+
+ClientHandler* ConnectionPool::Create(int fd, ChatManager& cm, EventLoop& loop)
+{
+	// A slot that's been used before is still warm, so those go first; only
+	// once they're all taken is a new one broken into
+	Slot* slot;
+	if(!_vFree.empty())
+	{
+		slot = _vFree.back();
+	}
+	else if(_iTouched < _iCapacity)
+	{
+		slot = &_aSlots[_iTouched];
+		new (slot->Outbound) OutboundQueue();
+		++_iTouched;
+		_vFree.push_back(slot);
+	}
+	else
+	{
+		return NULL;
+	}
+
+	ClientHandler* client = new (slot->Handler) ClientHandler(fd, cm, loop, slot->Input, sizeof(slot->Input), slot->Queue());
+	_vFree.pop_back();
+	return client;
+}
+
+void ConnectionPool::Destroy(ClientHandler* client)
+{
+	// The handler lives at the very start of its slot.  Whatever it hadn't
+	// sent is let go of, but the queue itself stays for the next one.
+	Slot* slot = reinterpret_cast<Slot*>(client);
+	client->~ClientHandler();
+	slot->Queue().Clear();
+	_vFree.push_back(slot);
+}
+
+size_t ConnectionPool::InUse() const
+{
+	return _iTouched - _vFree.size();
+}
+
+size_t ConnectionPool::Capacity() const
+{
+	return _iCapacity;
+}
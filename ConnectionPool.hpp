@@ -0,0 +1,64 @@
+#ifndef CONNECTION_POOL_HPP
+#define CONNECTION_POOL_HPP
+
+#include <vector>
+#include <cstddef>
+
+namespace ChatServer
+{
+
+// Forward declarations to avoid circular #include references.
+class ChatManager;
+class ClientHandler;
+class EventLoop;
+
+/**
+	Preallocated homes for one loop's connections.  Each slot holds a
+	ClientHandler, its input buffer and its outbound queue side by side; the 
+	slots are allocated in one block when the loop starts and recycled 
+	through a free list, so a burst of connects and disconnects never goes 
+	near malloc for them, and the most memory connections can take is known 
+	up front.
+
+	A slot's outbound queue is built the first time the slot is used and 
+	only cleared after that, so it keeps the memory it's grown into for the 
+	next connection rather than handing it back.
+
+	Slots are handed out most-recently-freed first, so a new connection
+	usually lands in memory that's still in cache, and a slot nobody has 
+	used yet is only broken into once every used one is taken.  Loop 
+	thread only.
+**/
+class ConnectionPool
+{
+private:
+	struct Slot;
+
+	Slot* _aSlots; // All of them, in one allocation
+	size_t _iCapacity; // How many there are
+	size_t _iTouched; // Slots [0, _iTouched) have been used, and have their outbound queues built; the rest are untouched
+	std::vector<Slot*> _vFree; // The used ones given back; the back is used next
+
+	ConnectionPool(const ConnectionPool&);
+	ConnectionPool& operator=(const ConnectionPool&);
+
+public:
+	ConnectionPool(size_t capacity);
+	~ConnectionPool();
+
+	/** Builds a handler for the socket in a free slot; NULL if they're all taken **/
+	ChatServer::ClientHandler* Create(int fd, ChatServer::ChatManager& cm, ChatServer::EventLoop& loop);
+
+	/** Destroys a handler from Create() and frees its slot **/
+	void Destroy(ChatServer::ClientHandler* client);
+
+	/** Number of slots in use **/
+	size_t InUse() const;
+
+	/** Total number of slots **/
+	size_t Capacity() const;
+};
+
+}
+
+#endif
@@ -0,0 +1,460 @@
+#include "EventLoop.hpp"
+#include "ChatManager.hpp"
+#include "ClientHandler.hpp"
+#include "ServerConfig.hpp"
+#include "Log.hpp"
+#include "Metrics.hpp"
+
+#include <chrono>
+#include <future>
+#include <cerrno>
+#include <stdexcept>
+#include <string_view>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h> // for strerror
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <syslog.h> // syslog!
+
+using std::vector;
+using std::string;
+using std::string_view;
+using std::function;
+using std::chrono::milliseconds;
+using std::chrono::microseconds;
+using std::chrono::duration_cast;
+using std::chrono::steady_clock;
+
+using ChatServer::EventLoop;
+using ChatServer::AddressLimits;
+using ChatServer::ClientHandler;
+using ChatServer::Counter;
+using ChatServer::Log;
+using ChatServer::Metrics;
+using ChatServer::PeerAddress;
+
+namespace
+{
+
+/** Notes how long a batch took from being posted to being sent **/
+void RecordDelivery(steady_clock::time_point posted)
+{
+	auto took = duration_cast<microseconds>(steady_clock::now() - posted);
+	Metrics::Local().DeliveryMicros.Record(took.count());
+}
+
+const char ADDRESS_NOTICE[] = "Too many connections from your address - try again later.\n";
+const char FULL_NOTICE[] = "The server is full - try again later.\n";
+
+/** Tells a connection we're turning away why, if it'll take it without waiting, and hangs up **/
+void Refuse(int fd, string_view notice)
+{
+	ssize_t ignored = send(fd, notice.data(), notice.length(), MSG_DONTWAIT | MSG_NOSIGNAL);
+	(void)ignored;
+	close(fd);
+}
+
+}
+
+EventLoop::EventLoop(ChatManager& cm, const ServerConfig& config, AddressLimits& limits)
+	: _cm(cm), _config(config), _limits(limits), _iEpollFD(-1), _iWakeFD(-1), _iListenFD(-1), 
+	  _bDone(false), _bPaused(false), 
+	  _pool((config.MaxConnections + config.LoopCount - 1) / config.LoopCount), 
+	  _timers(milliseconds(TIMER_TICK_MS)),
+	  _fineTimers(milliseconds(FINE_TIMER_TICK_MS))
+{
+	_iEpollFD = epoll_create1(EPOLL_CLOEXEC);
+	if(_iEpollFD < 0)
+	{
+		throw std::runtime_error("could not create epoll instance");
+	}
+
+	_iWakeFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(_iWakeFD < 0)
+	{
+		close(_iEpollFD);
+		throw std::runtime_error("could not create eventfd for the event loop");
+	}
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = _iWakeFD;
+	if(epoll_ctl(_iEpollFD, EPOLL_CTL_ADD, _iWakeFD, &ev) != 0)
+	{
+		close(_iWakeFD);
+		close(_iEpollFD);
+		throw std::runtime_error("could not watch the eventfd");
+	}
+}
+
+EventLoop::~EventLoop()
+{
+	for(auto client: _vConnections)
+	{
+		if(client != NULL)
+		{
+			_pool.Destroy(client);
+		}
+	}
+	_vConnections.clear();
+
+	if(_iListenFD >= 0)
+	{
+		close(_iListenFD);
+	}
+	close(_iWakeFD);
+	close(_iEpollFD);
+}
+
+void EventLoop::Run()
+{
+	struct epoll_event events[MAX_EVENTS];
+
+	_tidOwner = std::this_thread::get_id();
+
+	while(!_bDone)
+	{
+		// Sleep until something happens, or the next timer on either wheel is due
+		int timeout = -1;
+		if(!_bPaused)
+		{
+			auto now = steady_clock::now();
+			int coarse = _timers.NextTimeout(now);
+			int fine = _fineTimers.NextTimeout(now);
+			timeout = (coarse < 0 || (fine >= 0 && fine < coarse)) ? fine : coarse;
+		}
+		int count = epoll_wait(_iEpollFD, events, MAX_EVENTS, timeout);
+		if(count < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			Log::Write(LOG_ALERT, "EventLoop::Run()> epoll_wait failed: %s", strerror(errno));
+			break;
+		}
+
+		for(int i = 0; i < count; ++i)
+		{
+			int fd = events[i].data.fd;
+			if(fd == _iWakeFD)
+			{
+				// Just clear the counter, the tasks get run below
+				uint64_t value;
+				while(read(_iWakeFD, &value, sizeof(value)) > 0);
+				continue;
+			}
+
+			// Whatever it is, the next server will see it for itself
+			if(_bPaused)
+			{
+				continue;
+			}
+
+			if(fd == _iListenFD)
+			{
+				AcceptConnections();
+				continue;
+			}
+
+			if(fd < (int)_vConnections.size() && _vConnections[fd] != NULL)
+			{
+				_vConnections[fd]->HandleEvents(events[i].events);
+			}
+		}
+
+		RunTasks();
+		if(!_bPaused)
+		{
+			auto now = steady_clock::now();
+			_fineTimers.Advance(now);
+			_timers.Advance(now);
+		}
+	}
+}
+
+void EventLoop::Stop()
+{
+	Post([this]() { _bDone = true; });
+}
+
+void EventLoop::Post(function<void()> task)
+{
+	{
+		std::lock_guard<std::mutex> lock(_mMutex);
+		_vTasks.push_back(std::move(task));
+	}
+
+	uint64_t one = 1;
+	if(write(_iWakeFD, &one, sizeof(one)) < 0 && errno != EAGAIN)
+	{
+		Log::Write(LOG_ALERT, "EventLoop::Post()> could not wake loop: %s", strerror(errno));
+	}
+}
+
+const ChatServer::ServerConfig& EventLoop::GetConfig() const
+{
+	return _config;
+}
+
+ChatServer::TimerWheel& EventLoop::GetTimers()
+{
+	return _timers;
+}
+
+ChatServer::TimerWheel& EventLoop::GetFineTimers()
+{
+	return _fineTimers;
+}
+
+bool EventLoop::InLoopThread() const
+{
+	return _tidOwner == std::this_thread::get_id();
+}
+
+void EventLoop::Adopt(int fd)
+{
+	Post([this, fd]() { AddConnection(fd); });
+}
+
+void EventLoop::Listen(int fd)
+{
+	// The accept loop runs until EAGAIN, so it mustn't block
+	int flags = fcntl(fd, F_GETFL, 0);
+	if(flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+	{
+		throw std::runtime_error("could not make the listening socket non-blocking");
+	}
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.fd = fd;
+	if(epoll_ctl(_iEpollFD, EPOLL_CTL_ADD, fd, &ev) != 0)
+	{
+		throw std::runtime_error("could not watch the listening socket");
+	}
+	_iListenFD = fd;
+}
+
+int EventLoop::GetListener() const
+{
+	return _iListenFD;
+}
+
+void EventLoop::Resume(int fd, ChatServer::ClientState state)
+{
+	Post([this, fd, state]() { AddConnection(fd, &state); });
+}
+
+void EventLoop::Pause()
+{
+	RunAndWait([this]() { _bPaused = true; });
+}
+
+void EventLoop::Unpause()
+{
+	// Anything that came in while we were paused was missed (the events are
+	// edge-triggered), so have everyone look for themselves
+	RunAndWait([this]()
+		{
+			_bPaused = false;
+			for(auto client: _vConnections)
+			{
+				if(client != NULL)
+				{
+					client->HandleEvents(EPOLLIN | EPOLLOUT);
+				}
+			}
+			if(_iListenFD >= 0)
+			{
+				AcceptConnections();
+			}
+		});
+}
+
+vector<std::pair<int, ChatServer::ClientState> > EventLoop::Export()
+{
+	vector<std::pair<int, ClientState> > ret;
+	RunAndWait([this, &ret]()
+		{
+			for(auto client: _vConnections)
+			{
+				if(client != NULL && client->StillValid())
+				{
+					ret.push_back(std::make_pair(client->GetSocket(), client->SaveState()));
+				}
+			}
+		});
+	return ret;
+}
+
+void EventLoop::RunAndWait(function<void()> task)
+{
+	std::promise<void> done;
+	Post([&task, &done]()
+		{
+			task();
+			done.set_value();
+		});
+	done.get_future().wait();
+}
+
+void EventLoop::Deliver(const ChatServer::SharedMessage& msg, const vector<ClientHandler*>& clients)
+{
+	auto posted = steady_clock::now();
+	if(InLoopThread())
+	{
+		for(auto client: clients)
+		{
+			client->SendMsg(msg);
+		}
+		RecordDelivery(posted);
+		return;
+	}
+
+	// One task for the whole batch, rather than one per client
+	Post([msg, clients, posted]() 
+		{
+			for(auto client: clients)
+			{
+				client->SendMsg(msg);
+			}
+			RecordDelivery(posted);
+		});
+}
+
+void EventLoop::Release(ClientHandler* client)
+{
+	int fd = client->GetSocket();
+	epoll_ctl(_iEpollFD, EPOLL_CTL_DEL, fd, NULL);
+	_vConnections[fd] = NULL;
+	_limits.Leave(_vPeers[fd]);
+
+	// Other threads may have already queued messages for this client, so the
+	// delete has to wait its turn behind them.
+	Post([this, client]() { _pool.Destroy(client); });
+}
+
+void EventLoop::RunTasks()
+{
+	// Swapped rather than moved, so neither list gives up its room and
+	// posting doesn't allocate once they've grown to a busy loop's batches
+	{
+		std::lock_guard<std::mutex> lock(_mMutex);
+		_vRunning.swap(_vTasks);
+	}
+
+	for(auto& task: _vRunning)
+	{
+		task();
+	}
+	_vRunning.clear();
+}
+
+void EventLoop::AddConnection(int fd, const ClientState* state)
+{
+	// Everything on the loop is non-blocking
+	int flags = fcntl(fd, F_GETFL, 0);
+	if(flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+	{
+		Log::Write(LOG_NOTICE, "EventLoop::AddConnection()> could not set O_NONBLOCK");
+		close(fd);
+		return;
+	}
+
+	// Replies are small and go out whole (Flush() gathers everything queued
+	// into one sendmsg), so Nagle would only hold each one back for the ACK
+	// of the last - a delayed ACK's 40ms or so, on every round trip
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	// Checked before anything's built for it, so turning a flood away is cheap
+	PeerAddress peer = PeerAddress::Of(fd);
+	if(!_limits.Admit(peer, state == NULL))
+	{
+		Metrics::Count(Counter::REFUSALS);
+		Refuse(fd, ADDRESS_NOTICE);
+		return;
+	}
+
+	ClientHandler* client = _pool.Create(fd, _cm, *this);
+	if(client == NULL)
+	{
+		Log::Write(
+			LOG_NOTICE, 
+			"EventLoop::AddConnection()> all %zu connection slots in use, turning one away", 
+			_pool.Capacity()
+			);
+		_limits.Leave(peer);
+		Refuse(fd, FULL_NOTICE);
+		return;
+	}
+
+	// fds are small and reused, so they make a good index
+	if(fd >= (int)_vConnections.size())
+	{
+		_vConnections.resize(fd + 1, NULL);
+		_vPeers.resize(fd + 1);
+	}
+	_vConnections[fd] = client;
+	_vPeers[fd] = peer;
+
+	// Edge-triggered, so we only hear about changes; the handler has to read
+	// (and write) until the socket says EAGAIN.
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.fd = fd;
+	if(epoll_ctl(_iEpollFD, EPOLL_CTL_ADD, fd, &ev) != 0)
+	{
+		Log::Write(LOG_NOTICE, "EventLoop::AddConnection()> epoll_ctl failed: %s", strerror(errno));
+		_vConnections[fd] = NULL;
+		_limits.Leave(peer);
+		_pool.Destroy(client);
+		return;
+	}
+
+	if(state != NULL)
+	{
+		client->Resume(*state);
+	}
+	else
+	{
+		Metrics::Count(Counter::ACCEPTS);
+		client->Start();
+	}
+}
+
+void EventLoop::AcceptConnections()
+{
+	// Edge-triggered, so keep going until the backlog is empty
+	while(true)
+	{
+		int fd = accept4(_iListenFD, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if(fd < 0)
+		{
+			if(errno == EINTR || errno == ECONNABORTED)
+			{
+				continue;
+			}
+			if(errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				// If we logged every invalid connection attempt, we'd probably fill 
+				// up on logs PDQ - but running out of fds is worth a mention.
+				if(errno == EMFILE || errno == ENFILE)
+				{
+					Log::Write(LOG_ALERT, "EventLoop::AcceptConnections()> %s", strerror(errno));
+				}
+			}
+			return;
+		}
+
+		AddConnection(fd);
+	}
+}
@@ -0,0 +1,151 @@
+#ifndef EVENT_LOOP_HPP
+#define EVENT_LOOP_HPP
+
+#include <mutex>
+#include <string>
+#include <utility>
+#include <thread>
+#include <vector>
+#include <functional>
+#include "ConnectionPool.hpp"
+#include "Message.hpp"
+#include "RateLimit.hpp"
+#include "TimerWheel.hpp"
+
+namespace ChatServer
+{
+
+// Forward declarations to avoid circular #include references.
+class ChatManager;
+class ClientHandler;
+struct ClientState;
+struct ServerConfig;
+
+/**
+	An edge-triggered epoll reactor that owns a set of client connections.
+
+	Every ClientHandler belongs to exactly one EventLoop, and all of its reads,
+	writes and state changes happen on that loop's thread.  Other threads talk
+	to a loop by posting tasks with EventLoop::Post(), which wakes the loop
+	through an eventfd.
+
+	Handlers are never deleted in the middle of an event - Release() removes
+	them from epoll and queues the delete behind any tasks that might still
+	refer to them.  They're built in (and returned to) the loop's
+	ConnectionPool, which caps how many connections the loop will take.
+
+	A loop can also own a listening socket (see Listen()), in which case it
+	accepts its own connections; with SO_REUSEPORT the kernel spreads new
+	connections across every loop's listener.
+**/
+class EventLoop
+{
+private:
+	static const int MAX_EVENTS = 256; // Events handled per epoll_wait() call
+	static constexpr int TIMER_TICK_MS = 1000; // Resolution of _timers
+	static constexpr int FINE_TIMER_TICK_MS = 1; // Resolution of _fineTimers
+
+	ChatManager& _cm;
+	const ServerConfig& _config;
+	AddressLimits& _limits; // Shared by all the loops
+	int _iEpollFD; // The epoll instance
+	int _iWakeFD; // eventfd used to wake the loop when tasks are posted
+	int _iListenFD; // Listening socket owned by this loop, or -1
+	bool _bDone; // Set to true to stop the loop
+	bool _bPaused; // Ignoring clients, the listener and timers (see Pause())
+	std::thread::id _tidOwner; // Thread currently running Run()
+
+	std::mutex _mMutex; // Guards _vTasks
+	std::vector<std::function<void()> > _vTasks; // Posted from other threads
+	std::vector<std::function<void()> > _vRunning; // The batch RunTasks() took; swapped with _vTasks, so both stay warm
+
+	ConnectionPool _pool; // Where this loop's clients live
+	std::vector<ClientHandler*> _vConnections; // Indexed by fd; NULL if not ours
+	std::vector<PeerAddress> _vPeers; // Indexed by fd, like _vConnections: where each is from
+	TimerWheel _timers; // Deadlines for this loop's clients
+	TimerWheel _fineTimers; // Deadlines that have to be kept to the millisecond (throttling)
+
+	/** Runs everything that has been posted to this loop **/
+	void RunTasks();
+
+	/**
+	Starts watching the given socket, and creates a handler for it - a new
+	one, or (given 'state') one carrying on from the previous server.  New
+	ones from an address that's over its limits are turned away.
+	**/
+	void AddConnection(int fd, const ChatServer::ClientState* state = NULL);
+
+	/** Runs the task on the loop's thread, and waits for it to finish (not from the loop's thread!) **/
+	void RunAndWait(std::function<void()> task);
+
+	/** Accepts everything waiting on the listening socket **/
+	void AcceptConnections();
+
+public:
+	EventLoop(ChatManager& cm, const ServerConfig& config, AddressLimits& limits);
+	~EventLoop();
+
+	/** Runs the loop in the calling thread until Stop() is called **/
+	void Run();
+
+	/** Asks the loop to stop (safe to call from any thread) **/
+	void Stop();
+
+	/** Runs the given task on the loop's thread (safe to call from any thread) **/
+	void Post(std::function<void()> task);
+
+	/** Returns the server's settings **/
+	const ServerConfig& GetConfig() const;
+
+	/** Returns the timers for this loop's clients (loop thread only) **/
+	TimerWheel& GetTimers();
+
+	/**
+	Returns the timers for deadlines that can't wait for the next whole
+	second, like a throttled client's next line (loop thread only).
+	**/
+	TimerWheel& GetFineTimers();
+
+	/** Returns true if the caller is running on this loop's thread **/
+	bool InLoopThread() const;
+
+	/** Hands a freshly accepted socket over to this loop **/
+	void Adopt(int fd);
+
+	/** Makes this loop accept connections from the given listening socket **/
+	void Listen(int fd);
+
+	/** Returns the loop's own listening socket, or -1 **/
+	int GetListener() const;
+
+	/** Hands over a socket from the previous server, along with where its client was up to **/
+	void Resume(int fd, ChatServer::ClientState state);
+
+	/**
+	Freezes the loop for a handoff: once this returns, the loop has stopped
+	reading from its clients, accepting and firing timers, so nothing more
+	happens in the chat on its account.  Queued tasks (messages from other
+	loops) still run.  Blocks until it's done; not from the loop's thread.
+	**/
+	void Pause();
+
+	/** Undoes Pause(), if the handoff fell through **/
+	void Unpause();
+
+	/** Takes down every live connection's socket and state (only while paused) **/
+	std::vector<std::pair<int, ChatServer::ClientState> > Export();
+
+	/** 
+	Sends the message to each of the given clients, all of which must belong 
+	to this loop.  From another thread this is a single queued task, no 
+	matter how many clients there are.
+	**/
+	void Deliver(const SharedMessage& msg, const std::vector<ClientHandler*>& clients);
+
+	/** Stops watching the client, and deletes it once it's safe to **/
+	void Release(ClientHandler* client);
+};
+
+}
+
+#endif
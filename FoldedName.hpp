@@ -0,0 +1,87 @@
+#ifndef FOLDED_NAME_HPP
+#define FOLDED_NAME_HPP
+
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <cstddef>
+
+namespace ChatServer
+{
+
+/** Upper-cases a single ASCII character - names are only ever ASCII **/
+inline char FoldChar(char c)
+{
+	return ('a' <= c && c <= 'z') ? c - ('a' - 'A') : c;
+}
+
+/**
+	Hashes a name as if it were upper-cased, without building the upper-cased
+	copy (FNV-1a over the folded bytes).  Paired with FoldedEqual this lets a
+	hash map be keyed by the proper spelling of a name but found by any
+	spelling in a single probe - and, being transparent, found by a
+	string_view without making a std::string of it first.
+**/
+struct FoldedHash
+{
+	typedef void is_transparent;
+
+	size_t operator()(std::string_view name) const
+	{
+		uint64_t hash = 14695981039346656037ULL;
+		for(size_t i = 0; i < name.length(); ++i)
+		{
+			hash ^= static_cast<unsigned char>(FoldChar(name[i]));
+			hash *= 1099511628211ULL;
+		}
+		return static_cast<size_t>(hash);
+	}
+};
+
+/** Compares two names, ignoring case **/
+struct FoldedEqual
+{
+	typedef void is_transparent;
+
+	bool operator()(std::string_view a, std::string_view b) const
+	{
+		if(a.length() != b.length())
+		{
+			return false;
+		}
+		for(size_t i = 0; i < a.length(); ++i)
+		{
+			if(FoldChar(a[i]) != FoldChar(b[i]))
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+};
+
+/**
+	Orders names as if they were upper-cased, so every spelling of a name
+	sorts to the same place and the names sharing a prefix (in any case)
+	sit next to each other.
+**/
+struct FoldedLess
+{
+	bool operator()(std::string_view a, std::string_view b) const
+	{
+		size_t length = a.length() < b.length() ? a.length() : b.length();
+		for(size_t i = 0; i < length; ++i)
+		{
+			char x = FoldChar(a[i]), y = FoldChar(b[i]);
+			if(x != y)
+			{
+				return static_cast<unsigned char>(x) < static_cast<unsigned char>(y);
+			}
+		}
+		return a.length() < b.length();
+	}
+};
+
+}
+
+#endif
@@ -0,0 +1,437 @@
+#include "Handoff.hpp"
+#include "ChatManager.hpp"
+#include "EventLoop.hpp"
+#include "Log.hpp"
+#include "Snapshot.hpp"
+
+#include <stdexcept>
+#include <cerrno>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <string.h> // for memcpy, strerror
+#include <syslog.h> // syslog!
+
+using std::string;
+using std::string_view;
+using std::vector;
+using std::pair;
+
+using ChatServer::ChatManager;
+using ChatServer::ClientState;
+using ChatServer::EventLoop;
+using ChatServer::Handoff;
+using ChatServer::Log;
+using ChatServer::SnapshotReader;
+using ChatServer::SnapshotWriter;
+
+namespace
+{
+
+const char MAGIC[8] = { 'C', 'H', 'A', 'T', 'H', 'A', 'N', 'D' };
+const size_t FD_BATCH = 250; // Sockets per message (the kernel takes at most 253)
+const int TIMEOUT_SECONDS = 30; // Longest either side waits on the other
+const char ACK = 'K'; // "Got it all, you can go now"
+
+/** What comes first, so the new server knows what to expect **/
+struct Header
+{
+	char Magic[8];
+	uint32_t Listeners; // Listening sockets
+	uint32_t Clients; // Client sockets (and states)
+	uint64_t Length; // Bytes of state, after the sockets
+};
+
+void SendAll(int fd, const void* data, size_t length)
+{
+	const char* next = static_cast<const char*>(data);
+	while(length > 0)
+	{
+		ssize_t sent = send(fd, next, length, MSG_NOSIGNAL);
+		if(sent < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if(sent <= 0)
+		{
+			throw std::runtime_error(string("send failed: ") + strerror(errno));
+		}
+		next += sent;
+		length -= sent;
+	}
+}
+
+void ReceiveAll(int fd, void* data, size_t length)
+{
+	char* next = static_cast<char*>(data);
+	while(length > 0)
+	{
+		ssize_t got = recv(fd, next, length, 0);
+		if(got < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if(got == 0)
+		{
+			throw std::runtime_error("the other side hung up");
+		}
+		if(got < 0)
+		{
+			throw std::runtime_error(string("recv failed: ") + strerror(errno));
+		}
+		next += got;
+		length -= got;
+	}
+}
+
+/** Sends the sockets along with a single byte, as SCM_RIGHTS **/
+void SendSockets(int fd, const int* sockets, size_t count)
+{
+	char byte = 0;
+	struct iovec iov = { &byte, 1 };
+	vector<char> control(CMSG_SPACE(count * sizeof(int)));
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.data();
+	msg.msg_controllen = control.size();
+
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), sockets, count * sizeof(int));
+
+	while(sendmsg(fd, &msg, MSG_NOSIGNAL) < 0)
+	{
+		if(errno != EINTR)
+		{
+			throw std::runtime_error(string("sendmsg failed: ") + strerror(errno));
+		}
+	}
+}
+
+/** Receives one batch from SendSockets(), adding them to 'sockets' **/
+void ReceiveSockets(int fd, vector<int>& sockets)
+{
+	char byte;
+	struct iovec iov = { &byte, 1 };
+	vector<char> control(CMSG_SPACE(FD_BATCH * sizeof(int)));
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.data();
+	msg.msg_controllen = control.size();
+
+	ssize_t got;
+	while((got = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR);
+	if(got <= 0)
+	{
+		throw std::runtime_error(string("recvmsg failed: ") + (got == 0 ? "hung up" : strerror(errno)));
+	}
+
+	for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+		{
+			size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			const char* data = reinterpret_cast<const char*>(CMSG_DATA(cmsg));
+			for(size_t i = 0; i < count; ++i)
+			{
+				int socket;
+				memcpy(&socket, data + i * sizeof(int), sizeof(int));
+				sockets.push_back(socket);
+			}
+		}
+	}
+
+	// Out of fds, most likely - we can't carry on without all of them
+	if(msg.msg_flags & MSG_CTRUNC)
+	{
+		throw std::runtime_error("some of the sockets didn't make it (out of file descriptors?)");
+	}
+}
+
+/** Don't let either side hang for ever waiting on the other **/
+void SetTimeouts(int fd)
+{
+	struct timeval timeout = { TIMEOUT_SECONDS, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+/** Fills in a Unix socket address, if the path fits **/
+void MakeAddress(const string& path, struct sockaddr_un& address)
+{
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if(path.length() >= sizeof(address.sun_path))
+	{
+		throw std::runtime_error("handoff socket path is too long: " + path);
+	}
+	memcpy(address.sun_path, path.c_str(), path.length());
+}
+
+}
+
+Handoff::Handoff(const string& path)
+	: _strPath(path), _iListenFD(-1)
+{
+}
+
+Handoff::~Handoff()
+{
+	if(_iListenFD >= 0)
+	{
+		close(_iListenFD);
+	}
+}
+
+std::mutex& Handoff::AcceptMutex()
+{
+	return _mAccepting;
+}
+
+bool Handoff::Receive(
+			ChatManager& cm,
+			vector<int>& listeners,
+			vector<pair<int, ClientState> >& clients)
+{
+	struct sockaddr_un address;
+	MakeAddress(_strPath, address);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(fd < 0)
+	{
+		throw std::runtime_error(string("could not create handoff socket: ") + strerror(errno));
+	}
+	if(connect(fd, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) != 0)
+	{
+		int error = errno;
+		close(fd);
+		if(error == ENOENT || error == ECONNREFUSED)
+		{
+			// Nobody there
+			return false;
+		}
+		throw std::runtime_error("could not connect to " + _strPath + ": " + strerror(error));
+	}
+	SetTimeouts(fd);
+
+	vector<int> sockets;
+	try
+	{
+		Header header;
+		ReceiveAll(fd, &header, sizeof(header));
+		if(memcmp(header.Magic, MAGIC, sizeof(MAGIC)) != 0)
+		{
+			throw std::runtime_error("that's not a chatd on the other end");
+		}
+
+		size_t expected = static_cast<size_t>(header.Listeners) + header.Clients;
+		while(sockets.size() < expected)
+		{
+			ReceiveSockets(fd, sockets);
+		}
+		if(sockets.size() != expected)
+		{
+			throw std::runtime_error("got more sockets than we were told to expect");
+		}
+
+		string body(header.Length, '\0');
+		ReceiveAll(fd, &body[0], body.length());
+
+		// The rooms come first, just like a snapshot...
+		SnapshotReader in(body.data(), body.length());
+		size_t users = 0;
+		size_t rooms = cm.ReadRooms(in, users);
+
+		// ...then everybody's connection, in the same order as their sockets
+		for(uint32_t i = 0; i < header.Clients; ++i)
+		{
+			string_view user, room, input, output;
+			uint32_t tries;
+			if(!in.GetString(user) || !in.GetString(room) || !in.GetNumber(tries) ||
+			   !in.GetString(input) || !in.GetString(output))
+			{
+				throw std::runtime_error("the state is cut short");
+			}
+
+			ClientState state;
+			state.UserName = user;
+			state.CurrentRoom = room;
+			state.LoginTriesLeft = tries;
+			state.Input = input;
+			state.Output = output;
+			clients.push_back(std::make_pair(sockets[header.Listeners + i], state));
+		}
+		listeners.assign(sockets.begin(), sockets.begin() + header.Listeners);
+
+		// All there - the old server can go
+		SendAll(fd, &ACK, 1);
+		syslog(
+			LOG_NOTICE,
+			"Took over %u listener(s), %u connection(s) and %zu room(s)",
+			header.Listeners,
+			header.Clients,
+			rooms);
+	}
+	catch(const std::runtime_error& e)
+	{
+		for(int socket: sockets)
+		{
+			close(socket);
+		}
+		clients.clear();
+		close(fd);
+		throw;
+	}
+
+	close(fd);
+	return true;
+}
+
+void Handoff::Listen()
+{
+	struct sockaddr_un address;
+	MakeAddress(_strPath, address);
+
+	_iListenFD = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(_iListenFD < 0)
+	{
+		throw std::runtime_error(string("could not create handoff socket: ") + strerror(errno));
+	}
+
+	// Anything already there is from the server we took over from (or one
+	// that's gone), and only the newest server should be answering.  Only
+	// our own user gets to connect.
+	unlink(_strPath.c_str());
+	mode_t mask = umask(0077);
+	int result = bind(_iListenFD, reinterpret_cast<struct sockaddr*>(&address), sizeof(address));
+	umask(mask);
+	if(result != 0 || listen(_iListenFD, 1) != 0)
+	{
+		throw std::runtime_error("could not listen on " + _strPath + ": " + strerror(errno));
+	}
+}
+
+void Handoff::Serve(ChatManager& cm, const vector<EventLoop*>& loops, const vector<int>& listeners)
+{
+	while(true)
+	{
+		int fd = accept4(_iListenFD, NULL, NULL, SOCK_CLOEXEC);
+		if(fd < 0)
+		{
+			if(errno != EINTR && errno != ECONNABORTED)
+			{
+				syslog(LOG_ERR, "Handoff::Serve()> accept failed: %s", strerror(errno));
+				sleep(1);
+			}
+			continue;
+		}
+
+		// The socket's only for us, but make sure
+		struct ucred peer;
+		socklen_t length = sizeof(peer);
+		if(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &length) != 0 || peer.uid != getuid())
+		{
+			syslog(LOG_WARNING, "Handoff::Serve()> turned away a connection from another user");
+			close(fd);
+			continue;
+		}
+		SetTimeouts(fd);
+
+		syslog(LOG_NOTICE, "Handing over to pid %d", static_cast<int>(peer.pid));
+		if(Send(fd, cm, loops, listeners))
+		{
+			// It's all theirs now.  The loops are frozen and their sockets
+			// belong to the new server, so don't touch anything on the way out.
+			syslog(LOG_NOTICE, "Handed over to pid %d, exiting", static_cast<int>(peer.pid));
+			Log::Flush();
+			closelog();
+			_exit(EXIT_SUCCESS);
+		}
+		close(fd);
+	}
+}
+
+bool Handoff::Send(
+			int fd,
+			ChatManager& cm,
+			const vector<EventLoop*>& loops,
+			const vector<int>& listeners)
+{
+	// Stop the main thread accepting, then freeze every loop.  From here on
+	// nothing changes: no input is read, no timers fire, nobody joins.
+	std::lock_guard<std::mutex> accepting(_mAccepting);
+	for(auto loop: loops)
+	{
+		loop->Pause();
+	}
+
+	bool done = false;
+	try
+	{
+		vector<pair<int, ClientState> > clients;
+		for(auto loop: loops)
+		{
+			auto some = loop->Export();
+			clients.insert(clients.end(), some.begin(), some.end());
+		}
+
+		// Everything said so far has to be on disk before the new server
+		// starts adding to the journal
+		cm.FlushJournal();
+
+		SnapshotWriter out;
+		size_t users = 0;
+		cm.WriteRooms(out, users);
+		vector<int> sockets(listeners);
+		for(auto& client: clients)
+		{
+			const ClientState& state = client.second;
+			out.PutString(state.UserName);
+			out.PutString(state.CurrentRoom);
+			out.PutNumber(state.LoginTriesLeft);
+			out.PutString(state.Input);
+			out.PutString(state.Output);
+			sockets.push_back(client.first);
+		}
+
+		Header header;
+		memcpy(header.Magic, MAGIC, sizeof(MAGIC));
+		header.Listeners = listeners.size();
+		header.Clients = clients.size();
+		header.Length = out.Body().length();
+		SendAll(fd, &header, sizeof(header));
+
+		for(size_t i = 0; i < sockets.size(); i += FD_BATCH)
+		{
+			SendSockets(fd, &sockets[i], std::min(FD_BATCH, sockets.size() - i));
+		}
+		SendAll(fd, out.Body().data(), out.Body().length());
+
+		char ack = 0;
+		ReceiveAll(fd, &ack, 1);
+		done = (ack == ACK);
+	}
+	catch(const std::runtime_error& e)
+	{
+		syslog(LOG_ERR, "Handoff failed, carrying on: %s", e.what());
+	}
+
+	if(!done)
+	{
+		for(auto loop: loops)
+		{
+			loop->Unpause();
+		}
+	}
+	return done;
+}
@@ -0,0 +1,85 @@
+#ifndef HANDOFF_HPP
+#define HANDOFF_HPP
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <mutex>
+#include "ClientHandler.hpp"
+
+namespace ChatServer
+{
+
+// Forward declarations to avoid circular #include references.
+class ChatManager;
+class EventLoop;
+
+/**
+	Passes a running server's sockets and state on to its replacement, so an
+	upgrade doesn't drop a single connection.
+
+	The running server listens on a Unix domain socket.  The new one (started
+	with --takeover) connects to it, and the old one then:
+
+	  1. pauses every event loop, so nothing more happens in the chat;
+	  2. takes down the rooms (as in a snapshot) and every connection's state,
+	     and flushes the journal;
+	  3. sends a header, then the listening sockets and the client sockets
+	     (SCM_RIGHTS, a batch at a time), then the state;
+	  4. waits for the new server to say it has everything, and exits.
+
+	If anything goes wrong before step 4 the old server unpauses and carries
+	on as if nothing happened, and the new one gives up.
+**/
+class Handoff
+{
+private:
+	std::string _strPath; // Where the Unix socket lives
+	int _iListenFD; // Our end, once we're listening for a successor
+	std::mutex _mAccepting; // Held while handing off, so nobody accepts behind our back
+
+	Handoff(const Handoff&);
+	Handoff& operator=(const Handoff&);
+
+	/** Hands everything to the successor on 'fd'; true if it took it **/
+	bool Send(
+	       int fd,
+	       ChatManager& cm,
+	       const std::vector<EventLoop*>& loops,
+	       const std::vector<int>& listeners);
+
+public:
+	Handoff(const std::string& path);
+	~Handoff();
+
+	/**
+	Takes over from the server listening at the path: fills in its
+	listening sockets and its clients (socket and state), and its rooms go
+	straight into 'cm'.  Returns false if there's nobody to take over from;
+	throws std::runtime_error if the takeover starts but doesn't work out.
+	**/
+	bool Receive(
+	       ChatManager& cm,
+	       std::vector<int>& listeners,
+	       std::vector<std::pair<int, ChatServer::ClientState> >& clients);
+
+	/**
+	Whoever accepts connections outside the event loops (the main thread,
+	without reuseport) holds this from accept() until the connection has
+	been passed to a loop, so a handoff never misses one.
+	**/
+	std::mutex& AcceptMutex();
+
+	/** Starts listening at the path for a successor (throws std::runtime_error if it can't) **/
+	void Listen();
+
+	/**
+	Waits for successors, for ever.  When one takes everything over, this
+	process exits (without cleaning up - the sockets aren't ours any more).
+	**/
+	void Serve(ChatManager& cm, const std::vector<EventLoop*>& loops, const std::vector<int>& listeners);
+};
+
+}
+
+#endif
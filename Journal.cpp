@@ -0,0 +1,853 @@
+#include "Journal.hpp"
+#include "FoldedName.hpp"
+
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string.h> // for memcpy, strerror
+#include <syslog.h>
+
+using std::string;
+using std::string_view;
+using std::vector;
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
+using std::chrono::system_clock;
+
+using ChatServer::Journal;
+using ChatServer::SharedMessage;
+
+const char* const Journal::PRIVATE_STREAM = "private";
+
+namespace
+{
+
+const char FILE_MAGIC[8] = { 'C', 'H', 'A', 'T', 'L', 'O', 'G', '1' };
+const size_t FILE_HEADER_SIZE = 16; // Magic, then reserved; records start after it
+const size_t PAGE_SIZE = 4096;
+const auto IDLE_CLOSE = seconds(60); // Streams nobody's written to for this long get closed
+const auto IDLE_CHECK = seconds(1); // How often to look for them when there's nothing to sync
+
+/**
+	What comes before each record's text.  Length is written last, so a
+	reader that sees a non-zero Length sees the rest of the record too; 0
+	marks the end of what's been written.  Records are padded to 8 bytes.
+**/
+struct RecordHeader
+{
+	uint32_t Length; // Bytes of text
+	uint32_t Check; // Checksum of everything else
+	uint64_t Seq;
+	int64_t TimeUs;
+};
+
+/** One entry in a segment's .idx file **/
+struct IndexEntry
+{
+	uint64_t Seq;
+	int64_t TimeUs;
+	uint64_t Offset; // Where the record starts in the .log file
+};
+
+size_t RecordSize(size_t length)
+{
+	return (sizeof(RecordHeader) + length + 7) & ~static_cast<size_t>(7);
+}
+
+/** FNV-1a over the record's sequence number, time and text **/
+uint32_t Checksum(uint64_t seq, int64_t timeUs, string_view text)
+{
+	uint32_t hash = 2166136261U;
+	auto mix = [&hash](const void* data, size_t length) {
+		const unsigned char* bytes = static_cast<const unsigned char*>(data);
+		for(size_t i = 0; i < length; ++i)
+		{
+			hash ^= bytes[i];
+			hash *= 16777619U;
+		}
+	};
+	mix(&seq, sizeof(seq));
+	mix(&timeUs, sizeof(timeUs));
+	mix(text.data(), text.length());
+	return hash;
+}
+
+/**
+	Reads the record at 'offset' in a mapped segment, if there's a whole,
+	valid one there.  'next' is set to where the one after it starts.
+**/
+bool ReadRecord(const char* base, size_t size, size_t offset, Journal::Record& record, size_t& next)
+{
+	if(offset + sizeof(RecordHeader) > size || offset % 8 != 0)
+	{
+		return false;
+	}
+
+	const RecordHeader* header = reinterpret_cast<const RecordHeader*>(base + offset);
+	uint32_t length = __atomic_load_n(&header->Length, __ATOMIC_ACQUIRE);
+	if(length == 0 || RecordSize(length) > size - offset)
+	{
+		return false;
+	}
+
+	record.Seq = header->Seq;
+	record.TimeUs = header->TimeUs;
+	record.Text = string_view(base + offset + sizeof(RecordHeader), length);
+	if(header->Check != Checksum(record.Seq, record.TimeUs, record.Text))
+	{
+		return false;
+	}
+
+	next = offset + RecordSize(length);
+	return true;
+}
+
+/** "00000000000000000001.log" and friends **/
+string SegmentName(uint64_t first, const char* extension)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "/%020llu.%s", static_cast<unsigned long long>(first), extension);
+	return name;
+}
+
+/** mkdir -p **/
+bool MakeDirs(const string& path)
+{
+	for(size_t slash = path.find('/', 1); ; slash = path.find('/', slash + 1))
+	{
+		string part = path.substr(0, slash);
+		if(mkdir(part.c_str(), 0750) != 0 && errno != EEXIST)
+		{
+			return false;
+		}
+		if(slash == string::npos)
+		{
+			return true;
+		}
+	}
+}
+
+/** First sequence numbers of a stream's segments, in order **/
+vector<uint64_t> ListSegments(const string& dir)
+{
+	vector<uint64_t> ret;
+	DIR* d = opendir(dir.c_str());
+	if(d == NULL)
+	{
+		return ret;
+	}
+
+	while(struct dirent* entry = readdir(d))
+	{
+		string_view name(entry->d_name);
+		if(name.length() == 24 && name.substr(20) == ".log")
+		{
+			ret.push_back(strtoull(entry->d_name, NULL, 10));
+		}
+	}
+	closedir(d);
+
+	std::sort(ret.begin(), ret.end());
+	return ret;
+}
+
+/** Every entry in an index file (a torn one at the end is left off) **/
+vector<IndexEntry> LoadIndex(const string& path)
+{
+	vector<IndexEntry> ret;
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if(fd < 0)
+	{
+		return ret;
+	}
+
+	struct stat info;
+	if(fstat(fd, &info) == 0)
+	{
+		ret.resize(info.st_size / sizeof(IndexEntry));
+		ssize_t bytes = pread(fd, ret.data(), ret.size() * sizeof(IndexEntry), 0);
+		ret.resize(bytes > 0 ? bytes / sizeof(IndexEntry) : 0);
+	}
+	close(fd);
+	return ret;
+}
+
+/** A segment mapped read-only, for the readers **/
+class MappedSegment
+{
+	const char* _pData;
+	size_t _iSize;
+
+	MappedSegment(const MappedSegment&);
+	MappedSegment& operator=(const MappedSegment&);
+
+public:
+	MappedSegment(const string& path)
+		: _pData(NULL), _iSize(0)
+	{
+		int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if(fd < 0)
+		{
+			return;
+		}
+
+		// Segments never shrink, so nothing we map can go away under us
+		struct stat info;
+		if(fstat(fd, &info) == 0 && info.st_size > static_cast<off_t>(FILE_HEADER_SIZE))
+		{
+			void* map = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			if(map != MAP_FAILED)
+			{
+				_pData = static_cast<const char*>(map);
+				_iSize = info.st_size;
+			}
+		}
+		close(fd);
+	}
+
+	~MappedSegment()
+	{
+		if(_pData != NULL)
+		{
+			munmap(const_cast<char*>(_pData), _iSize);
+		}
+	}
+
+	const char* Data() const { return _pData; }
+	size_t Size() const { return _iSize; }
+};
+
+}
+
+/**
+	The writer's end of a stream: the segment it's filling, mapped read-write,
+	and its index file.  Only the writer thread ever touches these.
+**/
+struct Journal::Stream
+{
+	string Dir;
+	int Fd; // Open segment
+	int IndexFd; // Its index
+	char* Map;
+	size_t Size; // Length of the mapping (the segment's whole size)
+	size_t Used; // Bytes written so far, header included
+	size_t Synced; // Bytes flushed to disk so far
+	uint64_t FirstSeq; // First sequence number in the open segment
+	uint64_t NextSeq;
+	int64_t LastTime; // Keeps times in order, even if the clock steps back
+	bool Dirty; // Written to since the last sync
+	steady_clock::time_point LastWrite;
+
+	Stream(const string& dir)
+		: Dir(dir), Fd(-1), IndexFd(-1), Map(NULL), Size(0), Used(0), Synced(0),
+		  FirstSeq(1), NextSeq(1), LastTime(0), Dirty(false), LastWrite(steady_clock::now())
+	{
+	}
+
+	~Stream()
+	{
+		Close();
+	}
+
+	/** Opens (creating if need be) and maps the segment starting at 'first' **/
+	bool Open(uint64_t first, size_t segmentBytes);
+
+	/** Finds the end of what's been written to the open segment, after a restart **/
+	void Recover();
+
+	/** Appends one record (the caller makes sure it fits) **/
+	void Append(string_view text, int64_t timeUs);
+
+	/** Flushes the open segment up to Used, and its index **/
+	bool Sync();
+
+	/** Syncs and unmaps the open segment **/
+	void Close();
+};
+
+bool Journal::Stream::Open(uint64_t first, size_t segmentBytes)
+{
+	string path = Dir + SegmentName(first, "log");
+	Fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0640);
+	IndexFd = open((Dir + SegmentName(first, "idx")).c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0640);
+	if(Fd < 0 || IndexFd < 0)
+	{
+		syslog(LOG_ERR, "Journal: can't open %s: %s", path.c_str(), strerror(errno));
+		return false;
+	}
+
+	struct stat info;
+	if(fstat(Fd, &info) != 0)
+	{
+		return false;
+	}
+
+	// A new segment gets its full size up front - the file is sparse, so
+	// disk space is only used as it fills
+	bool fresh = info.st_size == 0;
+	if(fresh)
+	{
+		if(ftruncate(Fd, segmentBytes) != 0)
+		{
+			syslog(LOG_ERR, "Journal: can't size %s: %s", path.c_str(), strerror(errno));
+			return false;
+		}
+		info.st_size = segmentBytes;
+	}
+
+	if(info.st_size < static_cast<off_t>(FILE_HEADER_SIZE))
+	{
+		syslog(LOG_ERR, "Journal: %s is truncated", path.c_str());
+		return false;
+	}
+
+	void* map = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, Fd, 0);
+	if(map == MAP_FAILED)
+	{
+		syslog(LOG_ERR, "Journal: can't map %s: %s", path.c_str(), strerror(errno));
+		return false;
+	}
+	Map = static_cast<char*>(map);
+	Size = info.st_size;
+	FirstSeq = first;
+	NextSeq = first;
+	Used = FILE_HEADER_SIZE;
+
+	if(fresh)
+	{
+		memcpy(Map, FILE_MAGIC, sizeof(FILE_MAGIC));
+		Synced = 0;
+		return true;
+	}
+
+	if(memcmp(Map, FILE_MAGIC, sizeof(FILE_MAGIC)) != 0)
+	{
+		syslog(LOG_ERR, "Journal: %s isn't a journal segment", path.c_str());
+		return false;
+	}
+
+	Recover();
+	return true;
+}
+
+void Journal::Stream::Recover()
+{
+	// Start from the last index entry that points at a good record -
+	// anything after it in the index can't be trusted
+	vector<IndexEntry> index = LoadIndex(Dir + SegmentName(FirstSeq, "idx"));
+	size_t kept = index.size();
+	size_t offset = FILE_HEADER_SIZE;
+	Journal::Record record;
+	size_t next;
+	while(kept > 0)
+	{
+		const IndexEntry& entry = index[kept - 1];
+		if(ReadRecord(Map, Size, entry.Offset, record, next) && record.Seq == entry.Seq)
+		{
+			offset = entry.Offset;
+			NextSeq = entry.Seq;
+			break;
+		}
+		--kept;
+	}
+	if(ftruncate(IndexFd, kept * sizeof(IndexEntry)) != 0)
+	{
+		syslog(LOG_ERR, "Journal: can't trim the index in %s: %s", Dir.c_str(), strerror(errno));
+	}
+
+	// Then walk forward to the end, re-adding any index entries that were
+	// lost, until the records run out (or stop making sense)
+	while(ReadRecord(Map, Size, offset, record, next) && record.Seq == NextSeq)
+	{
+		if((record.Seq - FirstSeq) % INDEX_INTERVAL == 0 && record.Seq > (kept > 0 ? index[kept - 1].Seq : 0))
+		{
+			IndexEntry entry = { record.Seq, record.TimeUs, offset };
+			if(write(IndexFd, &entry, sizeof(entry)) != sizeof(entry))
+			{
+				syslog(LOG_ERR, "Journal: can't write the index in %s: %s", Dir.c_str(), strerror(errno));
+			}
+		}
+		LastTime = record.TimeUs;
+		++NextSeq;
+		offset = next;
+	}
+	Used = offset;
+
+	// Clear away anything half-written after the end, so a reader can never
+	// mistake it for a record once new ones are written in front of it.
+	// Pages that are still all zero mean we've reached untouched space.
+	for(size_t page = Used; page < Size; )
+	{
+		size_t end = std::min(Size, (page / PAGE_SIZE + 1) * PAGE_SIZE);
+		bool clean = true;
+		for(size_t i = page; i < end && clean; ++i)
+		{
+			clean = Map[i] == 0;
+		}
+		if(clean)
+		{
+			break;
+		}
+		memset(Map + page, 0, end - page);
+		page = end;
+	}
+	Synced = 0;
+	Dirty = true;
+}
+
+void Journal::Stream::Append(string_view text, int64_t timeUs)
+{
+	timeUs = std::max(timeUs, LastTime);
+
+	RecordHeader* header = reinterpret_cast<RecordHeader*>(Map + Used);
+	header->Seq = NextSeq;
+	header->TimeUs = timeUs;
+	header->Check = Checksum(NextSeq, timeUs, text);
+	memcpy(Map + Used + sizeof(RecordHeader), text.data(), text.length());
+
+	// Publish it: a reader that sees the length sees everything above
+	__atomic_store_n(&header->Length, static_cast<uint32_t>(text.length()), __ATOMIC_RELEASE);
+
+	if((NextSeq - FirstSeq) % INDEX_INTERVAL == 0)
+	{
+		IndexEntry entry = { NextSeq, timeUs, Used };
+		if(write(IndexFd, &entry, sizeof(entry)) != sizeof(entry))
+		{
+			syslog(LOG_ERR, "Journal: can't write the index in %s: %s", Dir.c_str(), strerror(errno));
+		}
+	}
+
+	Used += RecordSize(text.length());
+	LastTime = timeUs;
+	++NextSeq;
+	Dirty = true;
+	LastWrite = steady_clock::now();
+}
+
+bool Journal::Stream::Sync()
+{
+	bool ok = true;
+	if(Map != NULL && Used > Synced)
+	{
+		size_t start = Synced / PAGE_SIZE * PAGE_SIZE;
+		if(msync(Map + start, Used - start, MS_SYNC) != 0)
+		{
+			syslog(LOG_ERR, "Journal: can't sync %s: %s", Dir.c_str(), strerror(errno));
+			ok = false;
+		}
+		Synced = Used;
+	}
+	if(IndexFd >= 0 && fdatasync(IndexFd) != 0)
+	{
+		ok = false;
+	}
+	Dirty = false;
+	return ok;
+}
+
+void Journal::Stream::Close()
+{
+	Sync();
+	if(Map != NULL)
+	{
+		munmap(Map, Size);
+		Map = NULL;
+	}
+	if(Fd >= 0)
+	{
+		close(Fd);
+		Fd = -1;
+	}
+	if(IndexFd >= 0)
+	{
+		close(IndexFd);
+		IndexFd = -1;
+	}
+}
+
+string Journal::RoomStream(string_view room)
+{
+	string ret("rooms/");
+	for(char c: room)
+	{
+		ret.push_back(FoldChar(c));
+	}
+	return ret;
+}
+
+Journal::Journal(const string& dir, size_t segmentBytes, milliseconds syncInterval)
+	: _strDir(dir),
+	  _iSegmentBytes(segmentBytes),
+	  _tSyncInterval(syncInterval),
+	  _qEntries(QUEUE_SIZE),
+	  _iDropped(0),
+	  _iDroppedReported(0),
+	  _bSleeping(false),
+	  _bStopping(false),
+	  _iFlushWanted(0),
+	  _iFlushDone(0)
+{
+	if(!MakeDirs(_strDir + "/rooms"))
+	{
+		throw std::runtime_error("Can't create the journal in " + _strDir + ": " + strerror(errno));
+	}
+	_tWriter = std::thread(&Journal::Run, this);
+}
+
+Journal::~Journal()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mMutex);
+		_bStopping = true;
+		_cvWake.notify_one();
+	}
+	_tWriter.join();
+}
+
+bool Journal::AppendRoom(string_view room, const SharedMessage& line)
+{
+	return Enqueue("rooms/", room, line);
+}
+
+bool Journal::AppendPrivate(const SharedMessage& line)
+{
+	return Enqueue(PRIVATE_STREAM, "", line);
+}
+
+bool Journal::Enqueue(string_view prefix, string_view name, const SharedMessage& line)
+{
+	int64_t now = std::chrono::duration_cast<std::chrono::microseconds>(
+	                system_clock::now().time_since_epoch()).count();
+
+	// Filled in place - the cell's string keeps its capacity from last time
+	bool queued = _qEntries.Push([&](Entry& entry) {
+		entry.Stream.assign(prefix);
+		for(char c: name)
+		{
+			entry.Stream.push_back(FoldChar(c));
+		}
+		entry.Line = line;
+		entry.TimeUs = now;
+	});
+
+	if(!queued)
+	{
+		_iDropped.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	// Only bother the writer if it's asleep.  (The fence pairs with the one in
+	// Run(): either it sees our entry, or we see that it's sleeping.)
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if(_bSleeping.load(std::memory_order_relaxed))
+	{
+		std::lock_guard<std::mutex> lock(_mMutex);
+		_cvWake.notify_one();
+	}
+	return true;
+}
+
+void Journal::Flush()
+{
+	std::unique_lock<std::mutex> lock(_mMutex);
+	uint64_t wanted = ++_iFlushWanted;
+	_cvWake.notify_one();
+	_cvFlushed.wait(lock, [this, wanted]() { return _iFlushDone >= wanted; });
+}
+
+uint64_t Journal::Dropped() const
+{
+	return _iDropped.load(std::memory_order_relaxed);
+}
+
+void Journal::Run()
+{
+	auto lastSync = steady_clock::now();
+	bool dirty = false;
+
+	while(true)
+	{
+		uint64_t flushWanted = _iFlushWanted.load();
+		size_t written = 0;
+		while(written < BATCH_SIZE && _qEntries.Pop([this](Entry& entry) { Write(entry); }))
+		{
+			++written;
+		}
+		dirty = dirty || written > 0;
+
+		// Group commit: one flush covers everything written since the last
+		auto now = steady_clock::now();
+		bool stopping = _bStopping.load() && _qEntries.Empty();
+		bool flushing = flushWanted != _iFlushDone && written < BATCH_SIZE;
+		if(stopping || flushing || now - lastSync >= (dirty ? _tSyncInterval : IDLE_CHECK))
+		{
+			SyncAll(now);
+			lastSync = now;
+			dirty = false;
+		}
+		if(flushing)
+		{
+			std::lock_guard<std::mutex> lock(_mMutex);
+			_iFlushDone = flushWanted;
+			_cvFlushed.notify_all();
+		}
+
+		if(stopping)
+		{
+			break;
+		}
+		if(written == BATCH_SIZE)
+		{
+			continue;
+		}
+
+		// Nothing left - sleep until there is, or until the next sync is due
+		std::unique_lock<std::mutex> lock(_mMutex);
+		_bSleeping.store(true, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if(_qEntries.Empty() && !_bStopping.load() && _iFlushWanted.load() == _iFlushDone)
+		{
+			_cvWake.wait_until(lock, lastSync + (dirty ? _tSyncInterval : IDLE_CHECK));
+		}
+		_bSleeping.store(false, std::memory_order_relaxed);
+	}
+
+	_streams.clear();
+}
+
+void Journal::Write(Entry& entry)
+{
+	// Let go of the line whatever happens
+	SharedMessage line;
+	line.swap(entry.Line);
+
+	Stream* stream = GetStream(entry.Stream);
+	if(stream == NULL || !line || line->empty())
+	{
+		return;
+	}
+
+	size_t bytes = RecordSize(line->length());
+	if(bytes > _iSegmentBytes - FILE_HEADER_SIZE)
+	{
+		return;
+	}
+
+	// Start a new segment when this one's full
+	if(stream->Used + bytes > stream->Size)
+	{
+		uint64_t next = stream->NextSeq;
+		int64_t lastTime = stream->LastTime;
+		stream->Close();
+		if(!stream->Open(next, _iSegmentBytes))
+		{
+			stream->Close();
+			return;
+		}
+		stream->LastTime = lastTime;
+	}
+
+	stream->Append(*line, entry.TimeUs);
+}
+
+void Journal::SyncAll(steady_clock::time_point now)
+{
+	for(auto it = _streams.begin(); it != _streams.end(); )
+	{
+		Stream& stream = *it->second;
+		if(stream.Dirty)
+		{
+			stream.Sync();
+		}
+
+		// Don't keep a mapping (and two fds) per room forever
+		if(now - stream.LastWrite > IDLE_CLOSE)
+		{
+			it = _streams.erase(it);
+		}
+		else
+		{
+			++it;
+		}
+	}
+
+	uint64_t dropped = Dropped();
+	if(dropped != _iDroppedReported)
+	{
+		syslog(LOG_WARNING, "Journal: queue full, %llu line(s) not saved",
+		       static_cast<unsigned long long>(dropped - _iDroppedReported));
+		_iDroppedReported = dropped;
+	}
+}
+
+Journal::Stream* Journal::GetStream(const string& name)
+{
+	auto it = _streams.find(name);
+	if(it != _streams.end())
+	{
+		// A stream that couldn't be opened stays closed until it's idled out
+		return it->second->Map != NULL ? it->second.get() : NULL;
+	}
+
+	std::unique_ptr<Stream> stream(new Stream(StreamDir(name)));
+	Stream* ret = stream.get();
+	_streams[name] = std::move(stream);
+
+	if(!MakeDirs(ret->Dir))
+	{
+		syslog(LOG_ERR, "Journal: can't create %s: %s", ret->Dir.c_str(), strerror(errno));
+		return NULL;
+	}
+
+	// Carry on in the newest segment, if there is one
+	vector<uint64_t> segments = ListSegments(ret->Dir);
+	if(!ret->Open(segments.empty() ? 1 : segments.back(), _iSegmentBytes))
+	{
+		ret->Close();
+		return NULL;
+	}
+	return ret;
+}
+
+string Journal::StreamDir(const string& stream) const
+{
+	return _strDir + "/" + stream;
+}
+
+size_t Journal::Scan(
+			const string& stream,
+			uint64_t first,
+			size_t offset,
+			size_t count,
+			const std::function<bool(const Record&)>& want,
+			const RecordFn& fn) const
+{
+	string dir = StreamDir(stream);
+	vector<uint64_t> segments = ListSegments(dir);
+
+	size_t found = 0;
+	for(auto it = std::lower_bound(segments.begin(), segments.end(), first);
+	    it != segments.end() && found < count;
+	    ++it, offset = FILE_HEADER_SIZE)
+	{
+		MappedSegment segment(dir + SegmentName(*it, "log"));
+		Record record;
+		size_t next;
+		while(found < count && ReadRecord(segment.Data(), segment.Size(), offset, record, next))
+		{
+			if(want(record))
+			{
+				fn(record);
+				++found;
+			}
+			offset = next;
+		}
+	}
+	return found;
+}
+
+size_t Journal::ReadFrom(const string& stream, uint64_t seq, size_t count, const RecordFn& fn) const
+{
+	vector<uint64_t> segments = ListSegments(StreamDir(stream));
+	if(segments.empty() || count == 0)
+	{
+		return 0;
+	}
+
+	// The last segment starting at or before 'seq', and the last indexed
+	// record at or before it in there
+	auto segment = std::upper_bound(segments.begin(), segments.end(), seq);
+	uint64_t first = segment == segments.begin() ? segments.front() : *(segment - 1);
+
+	vector<IndexEntry> index = LoadIndex(StreamDir(stream) + SegmentName(first, "idx"));
+	auto entry = std::upper_bound(
+	               index.begin(), index.end(), seq,
+	               [](uint64_t s, const IndexEntry& e) { return s < e.Seq; });
+	size_t offset = entry == index.begin() ? FILE_HEADER_SIZE : (entry - 1)->Offset;
+
+	return Scan(stream, first, offset, count,
+	            [seq](const Record& r) { return r.Seq >= seq; }, fn);
+}
+
+size_t Journal::ReadSince(const string& stream, int64_t timeUs, size_t count, const RecordFn& fn) const
+{
+	vector<uint64_t> segments = ListSegments(StreamDir(stream));
+	if(segments.empty() || count == 0)
+	{
+		return 0;
+	}
+
+	// Every segment's first record is indexed, so the newest segment that
+	// starts before 'timeUs' is where to look.  Times only go forward.
+	uint64_t first = segments.front();
+	vector<IndexEntry> index;
+	for(auto it = segments.rbegin(); it != segments.rend(); ++it)
+	{
+		index = LoadIndex(StreamDir(stream) + SegmentName(*it, "idx"));
+		if(!index.empty() && index.front().TimeUs < timeUs)
+		{
+			first = *it;
+			break;
+		}
+	}
+	if(first == segments.front())
+	{
+		index = LoadIndex(StreamDir(stream) + SegmentName(first, "idx"));
+	}
+
+	auto entry = std::lower_bound(
+	               index.begin(), index.end(), timeUs,
+	               [](const IndexEntry& e, int64_t t) { return e.TimeUs < t; });
+	size_t offset = entry == index.begin() ? FILE_HEADER_SIZE : (entry - 1)->Offset;
+
+	return Scan(stream, first, offset, count,
+	            [timeUs](const Record& r) { return r.TimeUs >= timeUs; }, fn);
+}
+
+uint64_t Journal::LastSeq(const string& stream) const
+{
+	string dir = StreamDir(stream);
+	vector<uint64_t> segments = ListSegments(dir);
+
+	// Newest segment first - it may not have anything in it yet
+	for(auto it = segments.rbegin(); it != segments.rend(); ++it)
+	{
+		MappedSegment segment(dir + SegmentName(*it, "log"));
+		vector<IndexEntry> index = LoadIndex(dir + SegmentName(*it, "idx"));
+
+		uint64_t last = 0;
+		Record record;
+		size_t next;
+		for(size_t offset: { index.empty() ? FILE_HEADER_SIZE : index.back().Offset, FILE_HEADER_SIZE })
+		{
+			while(ReadRecord(segment.Data(), segment.Size(), offset, record, next))
+			{
+				last = record.Seq;
+				offset = next;
+			}
+			if(last != 0)
+			{
+				return last;
+			}
+		}
+	}
+	return 0;
+}
+
+size_t Journal::ReadTail(const string& stream, size_t count, const RecordFn& fn) const
+{
+	uint64_t last = LastSeq(stream);
+	if(last == 0 || count == 0)
+	{
+		return 0;
+	}
+	return ReadFrom(stream, last >= count ? last - count + 1 : 1, count, fn);
+}
@@ -0,0 +1,192 @@
+#ifndef JOURNAL_HPP
+#define JOURNAL_HPP
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <string>
+#include <string_view>
+#include <functional>
+#include <unordered_map>
+#include <condition_variable>
+#include <cstdint>
+#include <cstddef>
+#include "BoundedQueue.hpp"
+#include "Message.hpp"
+
+namespace ChatServer
+{
+
+/**
+	Keeps every line said in a room (and every whisper) on disk, so history
+	survives a restart.
+
+	Posting never touches the disk: Append*() just drops the line, by
+	reference, into a lock-free queue and returns.  A writer thread of the
+	journal's own drains the queue in batches and copies the lines into
+	memory-mapped log files, then flushes everything it has written every
+	'syncInterval' (a group commit - one msync/fdatasync per stream covers
+	however many lines came in).  If the queue is ever full the line is
+	dropped from the journal (not from the chat), and counted.
+
+	On disk, each stream (one per room, by upper-cased name, plus one for
+	whispers) is a directory of segments:
+
+	    <dir>/rooms/LOBBY/00000000000000000001.log   records 1, 2, ...
+	    <dir>/rooms/LOBBY/00000000000000000001.idx   sparse offset index
+	    <dir>/rooms/LOBBY/00000000000004211337.log   next segment
+	    ...
+
+	A segment is preallocated (sparse) to 'segmentBytes' and filled with
+	records; the next one starts when it's full.  Every record carries a
+	sequence number (counting from 1 in each stream), a timestamp and a
+	checksum, so a torn write at the end is found and cut off on restart.
+	The index holds (sequence, time, offset) for every INDEX_INTERVAL-th
+	record, so reading back from a sequence number or a time is a binary
+	search and a short scan.
+
+	The Read*() calls can be used from any thread, while the writer writes.
+	They only see what the writer has got to, which can be a moment behind.
+**/
+class Journal
+{
+public:
+	/** One line read back **/
+	struct Record
+	{
+		uint64_t Seq; // Position in its stream, from 1
+		int64_t TimeUs; // When it was posted, in microseconds since the epoch
+		std::string_view Text; // The line, as sent (only valid during the callback)
+	};
+
+	typedef std::function<void(const Record&)> RecordFn;
+
+	/** Name of the stream whispers go to **/
+	static const char* const PRIVATE_STREAM;
+
+	/** Name of the stream for a room (any spelling of it) **/
+	static std::string RoomStream(std::string_view room);
+
+	/** Starts the writer; throws std::runtime_error if 'dir' can't be used **/
+	Journal(
+	       const std::string& dir,
+	       size_t segmentBytes,
+	       std::chrono::milliseconds syncInterval);
+
+	/** Writes out whatever's still queued, syncs, and stops the writer **/
+	~Journal();
+
+	/** Queues a line said in the room; false if it had to be dropped **/
+	bool AppendRoom(std::string_view room, const ChatServer::SharedMessage& line);
+
+	/** Queues a whisper; false if it had to be dropped **/
+	bool AppendPrivate(const ChatServer::SharedMessage& line);
+
+	/** Waits until everything queued so far has been written and synced **/
+	void Flush();
+
+	/** Sequence number of the newest record in the stream, 0 if it's empty **/
+	uint64_t LastSeq(const std::string& stream) const;
+
+	/** Reads up to 'count' records, starting at sequence number 'seq'; returns how many **/
+	size_t ReadFrom(
+	       const std::string& stream,
+	       uint64_t seq,
+	       size_t count,
+	       const RecordFn& fn) const;
+
+	/** Reads up to 'count' records posted at or after 'timeUs'; returns how many **/
+	size_t ReadSince(
+	       const std::string& stream,
+	       int64_t timeUs,
+	       size_t count,
+	       const RecordFn& fn) const;
+
+	/** Reads the newest 'count' records, oldest first; returns how many **/
+	size_t ReadTail(const std::string& stream, size_t count, const RecordFn& fn) const;
+
+	/** Lines that didn't make it into the journal because the queue was full **/
+	uint64_t Dropped() const;
+
+private:
+	static const size_t QUEUE_SIZE = 64 * 1024; // Lines waiting for the writer
+	static const size_t BATCH_SIZE = 1024; // Most lines written between checks for a sync
+	static const uint64_t INDEX_INTERVAL = 32; // Records per index entry
+
+	/** A line on its way to the writer **/
+	struct Entry
+	{
+		std::string Stream;
+		ChatServer::SharedMessage Line;
+		int64_t TimeUs;
+	};
+
+	struct Stream; // The writer's state for one stream (see Journal.cpp)
+
+	std::string _strDir;
+	size_t _iSegmentBytes; // Size of each log file
+	std::chrono::milliseconds _tSyncInterval; // Longest a written line waits for a sync
+
+	ChatServer::BoundedQueue<Entry> _qEntries;
+	std::atomic<uint64_t> _iDropped;
+	uint64_t _iDroppedReported; // Writer only: last drop count it logged
+
+	// The writer sleeps here when there's nothing to do.  Producers only
+	// take the mutex to wake it, and only if it's actually asleep.
+	std::mutex _mMutex;
+	std::condition_variable _cvWake;
+	std::atomic<bool> _bSleeping;
+	std::atomic<bool> _bStopping;
+
+	// Flush() asks for a sync by bumping _iFlushWanted (under the mutex),
+	// and waits for the writer to catch _iFlushDone up to it
+	std::condition_variable _cvFlushed;
+	std::atomic<uint64_t> _iFlushWanted;
+	uint64_t _iFlushDone;
+
+	std::unordered_map<std::string, std::unique_ptr<Stream> > _streams; // Writer only
+	std::thread _tWriter;
+
+	Journal(const Journal&);
+	Journal& operator=(const Journal&);
+
+	/** Queues a line for the stream '<prefix><folded name>' **/
+	bool Enqueue(
+	       std::string_view prefix,
+	       std::string_view name,
+	       const ChatServer::SharedMessage& line);
+
+	/** The writer thread **/
+	void Run();
+
+	/** Writes one queued line to its stream **/
+	void Write(Entry& entry);
+
+	/** Flushes every stream written since the last sync, and closes idle ones **/
+	void SyncAll(std::chrono::steady_clock::time_point now);
+
+	/** Finds (or opens, and recovers) the writer's state for a stream; NULL if it's unusable **/
+	Stream* GetStream(const std::string& name);
+
+	/** Full path of a stream's directory **/
+	std::string StreamDir(const std::string& stream) const;
+
+	/**
+	Reads records from the stream, starting at segment 'first' (by its first
+	sequence number) and the given offset in it, passing on those that 'want'
+	accepts until 'count' have been passed on.  Shared by the Read*() calls.
+	**/
+	size_t Scan(
+	       const std::string& stream,
+	       uint64_t first,
+	       size_t offset,
+	       size_t count,
+	       const std::function<bool(const Record&)>& want,
+	       const RecordFn& fn) const;
+};
+
+}
+
+#endif
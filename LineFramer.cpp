@@ -0,0 +1,101 @@
+#include "LineFramer.hpp"
+
+#include <string.h> // for memchr, memmove
+
+using ChatServer::LineFramer;
+
+LineFramer::LineFramer(char* buffer, size_t size)
+	: _pBuffer(buffer), _iSize(size), _iStart(0), _iEnd(0), _iScanned(0)
+{
+}
+
+char* LineFramer::WriteSpace(size_t minSpace, size_t& space)
+{
+	if(_iSize - _iEnd < minSpace)
+	{
+		// Slide the unfinished line to the front first; only grow if that
+		// still doesn't leave enough room.
+		size_t pending = _iEnd - _iStart;
+		if(_iStart > 0)
+		{
+			memmove(_pBuffer, _pBuffer + _iStart, pending);
+			_iStart = 0;
+			_iEnd = pending;
+		}
+
+		if(_iSize - _iEnd < minSpace)
+		{
+			if(_pBuffer != _vOverflow.data())
+			{
+				_vOverflow.assign(_pBuffer, _pBuffer + _iEnd);
+			}
+			_vOverflow.resize(_iEnd + minSpace);
+			_pBuffer = _vOverflow.data();
+			_iSize = _vOverflow.size();
+		}
+	}
+
+	space = _iSize - _iEnd;
+	return _pBuffer + _iEnd;
+}
+
+void LineFramer::Commit(size_t count)
+{
+	_iEnd += count;
+}
+
+bool LineFramer::NextLine(char*& line, size_t& length)
+{
+	// Only look at bytes we haven't already searched
+	char* from = _pBuffer + _iStart + _iScanned;
+	size_t unscanned = _iEnd - _iStart - _iScanned;
+	char* newline = static_cast<char*>(memchr(from, '\n', unscanned));
+	if(newline == NULL)
+	{
+		_iScanned += unscanned;
+		return false;
+	}
+
+	line = _pBuffer + _iStart;
+	length = newline - line;
+	if(length > 0 && line[length-1] == '\r')
+	{
+		--length;
+	}
+
+	_iStart = (newline - _pBuffer) + 1;
+	_iScanned = 0;
+
+	// Nothing left over, so the next read can start at the front again
+	if(_iStart == _iEnd)
+	{
+		_iStart = 0;
+		_iEnd = 0;
+	}
+	return true;
+}
+
+bool LineFramer::Remainder(char*& line, size_t& length)
+{
+	if(_iStart == _iEnd)
+	{
+		return false;
+	}
+
+	line = _pBuffer + _iStart;
+	length = _iEnd - _iStart;
+	_iStart = 0;
+	_iEnd = 0;
+	_iScanned = 0;
+	return true;
+}
+
+size_t LineFramer::Pending() const
+{
+	return _iEnd - _iStart;
+}
+
+std::string_view LineFramer::Unfinished() const
+{
+	return std::string_view(_pBuffer + _iStart, _iEnd - _iStart);
+}
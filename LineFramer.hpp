@@ -0,0 +1,66 @@
+#ifndef LINE_FRAMER_HPP
+#define LINE_FRAMER_HPP
+
+#include <vector>
+#include <string_view>
+#include <cstddef>
+
+namespace ChatServer
+{
+
+/**
+	Splits a client's byte stream into lines.
+
+	Reads go straight into the framer's buffer (WriteSpace() / Commit()), and
+	NextLine() hands back each complete line in place, without copying it.
+	Whatever is left over - the start of a line that hasn't finished arriving
+	yet - stays put for the next read.  The buffer belongs to the caller
+	(it's part of the connection's pool slot) and is reused for the life of
+	the connection; only if a read needs more room than it has does the
+	framer move to a bigger one of its own.
+**/
+class LineFramer
+{
+private:
+	char* _pBuffer; // The bytes themselves
+	size_t _iSize; // How big _pBuffer is
+	std::vector<char> _vOverflow; // Our own buffer, once the one we were given is too small
+	size_t _iStart; // First byte not yet handed out as part of a line
+	size_t _iEnd; // One past the last byte read in
+	size_t _iScanned; // Bytes from _iStart already known to have no '\n'
+
+public:
+	LineFramer(char* buffer, size_t size);
+
+	/**
+	Returns a pointer to at least 'minSpace' bytes the caller can read into,
+	and sets 'space' to how many bytes are actually available there.
+	**/
+	char* WriteSpace(size_t minSpace, size_t& space);
+
+	/** Records that 'count' bytes were written into the space from WriteSpace() **/
+	void Commit(size_t count);
+
+	/**
+	Finds the next complete line.  On success, 'line' points at it inside the
+	buffer and 'length' excludes the line ending ("\n" or "\r\n").  The line
+	stays valid (and writable) until the next call to WriteSpace().
+	**/
+	bool NextLine(char*& line, size_t& length);
+
+	/**
+	Hands out whatever's left as a final, unterminated line - for when the
+	client hangs up without finishing it.
+	**/
+	bool Remainder(char*& line, size_t& length);
+
+	/** Number of bytes waiting for the end of their line **/
+	size_t Pending() const;
+
+	/** The bytes waiting for the end of their line **/
+	std::string_view Unfinished() const;
+};
+
+}
+
+#endif
@@ -0,0 +1,262 @@
+#include "Listing.hpp"
+#include "FoldedName.hpp"
+
+#include <algorithm>
+
+using std::string;
+using std::string_view;
+
+using ChatServer::FoldedEqual;
+using ChatServer::FoldedLess;
+using ChatServer::FormatMessage;
+using ChatServer::Listing;
+using ChatServer::ListingQuery;
+using ChatServer::MakeMessage;
+using ChatServer::MessageBuilder;
+using ChatServer::SharedMessage;
+
+namespace
+{
+
+/** Orders entries by name, as they're kept **/
+struct EntryOrder
+{
+	bool operator()(const Listing::Entry& entry, string_view name) const
+	{
+		return FoldedLess()(entry.Text, name);
+	}
+};
+
+/**
+	Compares entries with a prefix as if they were cut off at the prefix's
+	length, so every name starting with it compares equal - and, the names
+	being in FoldedLess order, they're all together.
+**/
+struct PrefixOrder
+{
+	bool operator()(const Listing::Entry& entry, string_view prefix) const
+	{
+		return FoldedLess()(string_view(entry.Text).substr(0, prefix.length()), prefix);
+	}
+
+	bool operator()(string_view prefix, const Listing::Entry& entry) const
+	{
+		return FoldedLess()(prefix, string_view(entry.Text).substr(0, prefix.length()));
+	}
+};
+
+}
+
+Listing::Listing(string_view header, string_view noun, string_view mark, bool counts)
+	: _strHeader(header), _strNoun(noun), _strMark(mark), _bCounts(counts),
+	  _strPage(header), _iBodyEnd(header.length())
+{
+	PutTrailer();
+}
+
+Listing::Entries::iterator Listing::Locate(string_view name)
+{
+	return std::lower_bound(_vEntries.begin(), _vEntries.end(), name, EntryOrder());
+}
+
+void Listing::AppendLine(string& text, const Entry& entry, bool counts)
+{
+	text.append("  * ").append(entry.Text);
+	if(counts)
+	{
+		text.append("(").append(std::to_string(entry.Count)).append(")");
+	}
+}
+
+size_t Listing::LineStart(size_t i) const
+{
+	return i == 0 ? _strHeader.length() : _vLineEnds[i - 1] + 1;
+}
+
+void Listing::ShiftLines(size_t i, ptrdiff_t delta)
+{
+	for(; i < _vLineEnds.size(); ++i)
+	{
+		_vLineEnds[i] += delta;
+	}
+	_iBodyEnd += delta;
+}
+
+void Listing::PutLine(size_t i, bool replace)
+{
+	string line;
+	AppendLine(line, _vEntries[i], _bCounts);
+	line.append("\n");
+
+	size_t start = LineStart(i);
+	ptrdiff_t delta = line.length();
+	if(replace)
+	{
+		size_t old = _vLineEnds[i] + 1 - start;
+		_strPage.replace(start, old, line);
+		_vLineEnds[i] = start + line.length() - 1;
+		delta -= old;
+	}
+	else
+	{
+		_strPage.insert(start, line);
+		_vLineEnds.insert(_vLineEnds.begin() + i, start + line.length() - 1);
+	}
+	ShiftLines(i + 1, delta);
+	_pFirstPage.reset();
+}
+
+void Listing::EraseLine(size_t i)
+{
+	size_t start = LineStart(i);
+	size_t length = _vLineEnds[i] + 1 - start;
+	_strPage.erase(start, length);
+	_vLineEnds.erase(_vLineEnds.begin() + i);
+	ShiftLines(i, -static_cast<ptrdiff_t>(length));
+	_pFirstPage.reset();
+}
+
+void Listing::PutTrailer()
+{
+	// As RenderPage() has it for the first page
+	_strPage.resize(_iBodyEnd);
+	size_t shown = _vLineEnds.size();
+	if(_vEntries.size() > shown)
+	{
+		_strPage.append("  ... and ").append(std::to_string(_vEntries.size() - shown))
+		        .append(" more (offset=").append(std::to_string(shown)).append(")\n");
+	}
+	_strPage.append("end of list\n");
+	_pFirstPage.reset();
+}
+
+void Listing::Set(string_view name, size_t count)
+{
+	std::lock_guard<std::mutex> lock(_mMutex);
+	auto it = Locate(name);
+	size_t i = it - _vEntries.begin();
+	if(it != _vEntries.end() && FoldedEqual()(it->Text, name))
+	{
+		// Just the one line to patch, if it's on the first page at all
+		if(it->Count != count)
+		{
+			it->Count = count;
+			if(_bCounts && i < _vLineEnds.size())
+			{
+				PutLine(i, true);
+			}
+		}
+		return;
+	}
+
+	_vEntries.insert(it, Entry{string(name), count});
+	if(i < ListingQuery::PAGE)
+	{
+		// In it goes, and whatever was last on the page is pushed off
+		PutLine(i, false);
+		if(_vLineEnds.size() > ListingQuery::PAGE)
+		{
+			EraseLine(ListingQuery::PAGE);
+		}
+	}
+	PutTrailer();
+}
+
+void Listing::Remove(string_view name)
+{
+	std::lock_guard<std::mutex> lock(_mMutex);
+	auto it = Locate(name);
+	if(it == _vEntries.end() || !FoldedEqual()(it->Text, name))
+	{
+		return;
+	}
+
+	size_t i = it - _vEntries.begin();
+	_vEntries.erase(it);
+	if(i < _vLineEnds.size())
+	{
+		// Out it goes, and the first name past the page moves up onto it
+		EraseLine(i);
+		if(_vEntries.size() >= ListingQuery::PAGE)
+		{
+			PutLine(ListingQuery::PAGE - 1, false);
+		}
+	}
+	PutTrailer();
+}
+
+bool Listing::Empty()
+{
+	std::lock_guard<std::mutex> lock(_mMutex);
+	return _vEntries.empty();
+}
+
+SharedMessage Listing::Render(const ListingQuery& query, string_view mine)
+{
+	std::lock_guard<std::mutex> lock(_mMutex);
+	if(!query.IsFirstPage())
+	{
+		return RenderPage(_vEntries, _strHeader, _strNoun, query, _bCounts, mine, _strMark);
+	}
+
+	// On the first page?  Then one copy, with the mark spliced in.
+	if(!mine.empty())
+	{
+		auto it = Locate(mine);
+		size_t i = it - _vEntries.begin();
+		if(i < _vLineEnds.size() && FoldedEqual()(it->Text, mine))
+		{
+			string_view all(_strPage);
+			MessageBuilder marked(all.length() + _strMark.length());
+			marked.Append(all.substr(0, _vLineEnds[i])).Append(_strMark).Append(all.substr(_vLineEnds[i]));
+			return marked.Finish();
+		}
+	}
+
+	// Otherwise they get the shared copy, as it is
+	if(!_pFirstPage)
+	{
+		_pFirstPage = MakeMessage(_strPage);
+	}
+	return _pFirstPage;
+}
+
+SharedMessage Listing::RenderPage(
+       const Entries& entries,
+       string_view header,
+       string_view noun,
+       const ListingQuery& query,
+       bool counts,
+       string_view mine,
+       string_view mark)
+{
+	// Everything with the prefix is together, so it's two binary searches
+	// to find, and the page is just the right stretch of that
+	auto matching = std::equal_range(entries.begin(), entries.end(), query.Prefix, PrefixOrder());
+	size_t matches = matching.second - matching.first;
+	if(matches == 0 && !query.Prefix.empty())
+	{
+		return FormatMessage({"No ", noun, " start with '", query.Prefix, "'.\n"});
+	}
+	size_t first = std::min(query.Offset, matches);
+	size_t last = first + std::min(query.Limit, matches - first);
+
+	string text(header);
+	for(auto it = matching.first + first; it != matching.first + last; ++it)
+	{
+		AppendLine(text, *it, counts);
+		if(!mine.empty() && FoldedEqual()(it->Text, mine))
+		{
+			text.append(mark);
+		}
+		text.append("\n");
+	}
+	if(last < matches)
+	{
+		// Let them know there's more, and how to get at it
+		text.append("  ... and ").append(std::to_string(matches - last))
+		    .append(" more (offset=").append(std::to_string(last)).append(")\n");
+	}
+	text.append("end of list\n");
+	return MakeMessage(std::move(text));
+}
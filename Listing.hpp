@@ -0,0 +1,137 @@
+#ifndef LISTING_HPP
+#define LISTING_HPP
+
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstddef>
+#include "Message.hpp"
+
+namespace ChatServer
+{
+
+/**
+	Which part of a listing to show (see Listing::Render()).  Listings are in
+	name order, ignoring case, so the names with a given prefix are all
+	together and any page of them can be found directly.
+**/
+struct ListingQuery
+{
+	static const size_t PAGE = 500; // Shown when nobody says how many
+	static const size_t MAX_PAGE = 1000; // The most anyone can ask for at once
+
+	std::string_view Prefix; // Only names starting with this, in any case ("" for all)
+	size_t Offset; // How many of those to skip
+	size_t Limit; // The most to show
+
+	ListingQuery() : Offset(0), Limit(PAGE)
+	{
+	}
+
+	/** Nothing asked for but the usual - the page that's kept rendered **/
+	bool IsFirstPage() const
+	{
+		return Prefix.empty() && Offset == 0 && Limit == PAGE;
+	}
+};
+
+/**
+	A listing everyone can ask for (/rooms, /who): every name, in order
+	(FoldedLess), and a number to show with each if it's counting something
+	(the head count, for rooms).
+
+	It's kept up to date a name at a time, as names come and go and their
+	counts change, so it never has to be built again: any page is found
+	with a binary search, and the first page - which is what almost
+	everyone asks for - is kept rendered, and patched a line at a time.
+
+	Names are kept as text, so a listing never keeps a Name (and with it, a
+	spelling) alive.  Safe to use from any thread.
+**/
+class Listing
+{
+public:
+	/** One name on the listing **/
+	struct Entry
+	{
+		std::string Text;
+		size_t Count;
+	};
+
+	typedef std::vector<Entry> Entries;
+
+private:
+	std::mutex _mMutex; // Guards everything below
+	std::string _strHeader; // First line of every page
+	std::string _strNoun; // What's listed, for "No rooms start with..."
+	std::string _strMark; // Goes after the asker's own line
+	bool _bCounts; // Show each entry's Count
+	Entries _vEntries; // Everything listed, in FoldedLess order
+	std::string _strPage; // The first page: header, a line for each of the first PAGE entries, trailer
+	std::vector<size_t> _vLineEnds; // Where the "\n" ending each of _strPage's lines is
+	size_t _iBodyEnd; // Where _strPage's lines end and its trailer begins
+	SharedMessage _pFirstPage; // _strPage, as it was when last asked for (NULL once it's changed)
+
+	Listing(const Listing&);
+	Listing& operator=(const Listing&);
+
+	/** Where the entry with the name is, or would go **/
+	Entries::iterator Locate(std::string_view name);
+
+	/** Appends the entry's line, without its "\n" **/
+	static void AppendLine(std::string& text, const Entry& entry, bool counts);
+
+	/** Where line 'i' of the first page starts **/
+	size_t LineStart(size_t i) const;
+
+	/** Moves every line from 'i' on by 'delta' bytes **/
+	void ShiftLines(size_t i, ptrdiff_t delta);
+
+	/** Renders entry 'i' as line 'i' of the first page, in place of what's there if 'replace' **/
+	void PutLine(size_t i, bool replace);
+
+	/** Takes line 'i' off the first page **/
+	void EraseLine(size_t i);
+
+	/** Renders the first page's "... and N more" and "end of list" again **/
+	void PutTrailer();
+
+public:
+	Listing(std::string_view header, std::string_view noun, std::string_view mark, bool counts);
+
+	/** Lists the name with the count, or just changes its count if it's listed already **/
+	void Set(std::string_view name, size_t count);
+
+	/** Takes the name off the listing, if it's on it **/
+	void Remove(std::string_view name);
+
+	/** True if there's nothing listed **/
+	bool Empty();
+
+	/**
+	The page the query asks for, with the mark after 'mine' (if it's on
+	it).  The first page is the kept copy, as it is - or one copy of it,
+	with the mark spliced in - so it costs what's on it, however many
+	names are listed.
+	**/
+	SharedMessage Render(const ListingQuery& query, std::string_view mine);
+
+	/**
+	Renders the page of 'entries' (in FoldedLess order) the query asks
+	for, with 'mark' after 'mine'.  Says so if nothing has the prefix;
+	'noun' is what's being listed.
+	**/
+	static SharedMessage RenderPage(
+	       const Entries& entries,
+	       std::string_view header,
+	       std::string_view noun,
+	       const ListingQuery& query,
+	       bool counts,
+	       std::string_view mine,
+	       std::string_view mark);
+};
+
+}
+
+#endif
@@ -0,0 +1,251 @@
+#include "Log.hpp"
+#include "BoundedQueue.hpp"
+
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <unordered_map>
+#include <cstdio>
+#include <cstdarg>
+#include <algorithm>
+#include <syslog.h> // syslog!
+
+using std::string;
+using std::vector;
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
+
+using ChatServer::BoundedQueue;
+using ChatServer::Log;
+
+namespace
+{
+
+const milliseconds DRAIN_INTERVAL(100); // Longest a line waits to get to syslog
+
+/** A line waiting to go out **/
+struct Entry
+{
+	int Priority;
+	const char* Format; // Where it came from, for rate limiting
+	string Text; // Reused from one trip round the ring to the next
+};
+
+/** One thread's lines **/
+struct Ring
+{
+	BoundedQueue<Entry> Entries;
+	std::atomic<uint64_t> Dropped; // Lines that didn't fit (written by the owner only)
+	uint64_t DroppedReported; // Draining thread only
+
+	Ring() : Entries(Log::RING_SIZE), Dropped(0), DroppedReported(0)
+	{
+	}
+};
+
+/** How much one format string has said this second **/
+struct Site
+{
+	steady_clock::time_point WindowStart;
+	int Written;
+	uint64_t Suppressed;
+	int Priority;
+	string LastSuppressed; // An example of what was kept quiet
+};
+
+/**
+	Everything the log shares between threads.  It's made once and never
+	destroyed, since the draining thread is still going when exit() runs
+	the static destructors.
+**/
+struct Shared
+{
+	std::atomic<bool> Started;
+
+	std::mutex RingsMutex; // Guards Rings
+	vector<Ring*> Rings; // Every thread that's logged anything (never freed)
+
+	// Only touched with DrainMutex held
+	std::mutex DrainMutex;
+	std::unordered_map<const char*, Site> Sites;
+	string LastText; // The last line that went out...
+	int LastPriority;
+	uint64_t Repeats; // ...and how many times it's come up again since
+
+	Shared() : Started(false), LastPriority(0), Repeats(0)
+	{
+	}
+};
+
+Shared& Everyone()
+{
+	static Shared* shared = new Shared();
+	return *shared;
+}
+
+Ring& LocalRing()
+{
+	thread_local Ring* mine = nullptr;
+	if(mine == nullptr)
+	{
+		mine = new Ring();
+		std::lock_guard<std::mutex> lock(Everyone().RingsMutex);
+		Everyone().Rings.push_back(mine);
+	}
+	return *mine;
+}
+
+void EmitRepeats()
+{
+	Shared& shared = Everyone();
+	if(shared.Repeats > 0)
+	{
+		syslog(shared.LastPriority, "last message repeated %llu times", static_cast<unsigned long long>(shared.Repeats));
+		shared.Repeats = 0;
+	}
+}
+
+/** Owns up to whatever a site kept quiet in a second that's now over **/
+void EmitSuppressed(Site& site)
+{
+	if(site.Suppressed > 0)
+	{
+		EmitRepeats();
+		syslog(
+			site.Priority,
+			"%llu similar message(s) suppressed, the last: %s",
+			static_cast<unsigned long long>(site.Suppressed),
+			site.LastSuppressed.c_str());
+		site.Suppressed = 0;
+		Everyone().LastText.clear();
+	}
+}
+
+/** Rate limits, deduplicates, and (maybe) writes out one line **/
+void Emit(const Entry& entry, steady_clock::time_point now)
+{
+	Shared& shared = Everyone();
+	Site& site = shared.Sites[entry.Format];
+	if(now - site.WindowStart >= seconds(1))
+	{
+		EmitSuppressed(site);
+		site.WindowStart = now;
+		site.Written = 0;
+	}
+	if(site.Written >= Log::LINES_PER_SECOND)
+	{
+		++site.Suppressed;
+		site.Priority = entry.Priority;
+		site.LastSuppressed = entry.Text;
+		return;
+	}
+	++site.Written;
+
+	if(entry.Priority == shared.LastPriority && entry.Text == shared.LastText)
+	{
+		++shared.Repeats;
+		return;
+	}
+	EmitRepeats();
+	syslog(entry.Priority, "%s", entry.Text.c_str());
+	shared.LastPriority = entry.Priority;
+	shared.LastText = entry.Text;
+}
+
+/** Writes out everything queued (DrainMutex held) **/
+void Drain()
+{
+	Shared& shared = Everyone();
+	vector<Ring*> rings;
+	{
+		std::lock_guard<std::mutex> lock(shared.RingsMutex);
+		rings = shared.Rings;
+	}
+
+	auto now = steady_clock::now();
+	for(auto ring: rings)
+	{
+		while(ring->Entries.Pop([now](Entry& entry) { Emit(entry, now); }));
+
+		uint64_t dropped = ring->Dropped.load(std::memory_order_relaxed);
+		if(dropped != ring->DroppedReported)
+		{
+			EmitRepeats();
+			syslog(
+				LOG_WARNING,
+				"Log: %llu line(s) dropped, the log couldn't keep up",
+				static_cast<unsigned long long>(dropped - ring->DroppedReported));
+			ring->DroppedReported = dropped;
+			shared.LastText.clear();
+		}
+	}
+
+	// Don't sit on what's been suppressed once its second is up
+	for(auto& site: shared.Sites)
+	{
+		if(site.second.Suppressed > 0 && now - site.second.WindowStart >= seconds(1))
+		{
+			EmitSuppressed(site.second);
+		}
+	}
+	EmitRepeats();
+}
+
+void Run()
+{
+	while(true)
+	{
+		std::this_thread::sleep_for(DRAIN_INTERVAL);
+		std::lock_guard<std::mutex> lock(Everyone().DrainMutex);
+		Drain();
+	}
+}
+
+}
+
+void Log::Write(int priority, const char* format, ...)
+{
+	va_list args;
+	va_start(args, format);
+
+	if(!Everyone().Started.load(std::memory_order_acquire))
+	{
+		vsyslog(priority, format, args);
+		va_end(args);
+		return;
+	}
+
+	// Formatted straight into the ring - and only if there's room
+	Ring& ring = LocalRing();
+	bool queued = ring.Entries.Push([&](Entry& entry)
+		{
+			char line[MAX_LINE];
+			int length = vsnprintf(line, sizeof(line), format, args);
+			entry.Priority = priority;
+			entry.Format = format;
+			entry.Text.assign(line, length < 0 ? 0 : std::min(static_cast<size_t>(length), sizeof(line) - 1));
+		});
+	va_end(args);
+
+	if(!queued)
+	{
+		ring.Dropped.store(ring.Dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+}
+
+void Log::Start()
+{
+	if(!Everyone().Started.exchange(true))
+	{
+		std::thread(Run).detach();
+	}
+}
+
+void Log::Flush()
+{
+	std::lock_guard<std::mutex> lock(Everyone().DrainMutex);
+	Drain();
+}
@@ -0,0 +1,45 @@
+#ifndef LOG_HPP
+#define LOG_HPP
+
+#include <string>
+
+namespace ChatServer
+{
+
+/**
+	Logging that's safe to call from the hot paths.  Write() formats the line
+	into a ring that belongs to the calling thread (a lock-free BoundedQueue,
+	so a full ring just drops the line, and counts it) and returns; a
+	background thread drains every thread's ring into syslog.
+
+	The draining thread also keeps a noisy call site from flooding the log.
+	Each format string gets LINES_PER_SECOND lines a second, and whatever
+	it says past that is suppressed and summed up once the second is over.
+	A line identical to the one before it only bumps a "last message
+	repeated" count.
+
+	Until Start() is called, Write() goes straight to syslog.
+**/
+class Log
+{
+public:
+	static const int LINES_PER_SECOND = 20; // Per format string, before suppressing
+	static const size_t RING_SIZE = 1024; // Lines each thread can have queued
+	static const size_t MAX_LINE = 512; // Longer lines are cut short
+
+	/** Queues a line for syslog; never blocks, never throws **/
+	static void Write(int priority, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+	/** Starts the thread that writes everything out **/
+	static void Start();
+
+	/**
+	Writes out everything queued so far, before returning - for when the
+	process is about to exit without waiting for the thread.
+	**/
+	static void Flush();
+};
+
+}
+
+#endif
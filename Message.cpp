@@ -0,0 +1,197 @@
+#include "Message.hpp"
+
+#include <new>
+
+using std::string;
+using std::string_view;
+
+using ChatServer::MessageBuilder;
+using ChatServer::SharedMessage;
+
+namespace
+{
+
+const size_t POOL_SIZE = 256; // Buffers (and blocks) each thread hangs on to
+const size_t POOLED_CAPACITY = 4096; // Bigger buffers (long /who lists) aren't kept
+const size_t BLOCK_SIZE = 64; // Big enough for a shared_ptr control block
+
+/**
+	Each thread's spare buffers and control blocks.  Plain old data, so it's
+	still safe to use while the thread is exiting; 'Closed' says to stop
+	pooling once DrainPools has run.
+**/
+struct Pools
+{
+	string* Buffers[POOL_SIZE];
+	size_t BufferCount;
+	void* Blocks[POOL_SIZE];
+	size_t BlockCount;
+	bool Closed;
+};
+
+thread_local Pools t_pools;
+
+/** Frees whatever's pooled when its thread exits **/
+struct DrainPools
+{
+	~DrainPools()
+	{
+		while(t_pools.BufferCount > 0)
+		{
+			delete t_pools.Buffers[--t_pools.BufferCount];
+		}
+		while(t_pools.BlockCount > 0)
+		{
+			::operator delete(t_pools.Blocks[--t_pools.BlockCount]);
+		}
+		t_pools.Closed = true;
+	}
+};
+
+thread_local DrainPools t_drain;
+
+string* TakeBuffer()
+{
+	if(t_pools.BufferCount > 0)
+	{
+		return t_pools.Buffers[--t_pools.BufferCount];
+	}
+	return new string();
+}
+
+void GiveBuffer(string* text)
+{
+	(void)&t_drain; // Make sure the pool gets cleaned up with the thread
+	if(t_pools.Closed || t_pools.BufferCount == POOL_SIZE || text->capacity() > POOLED_CAPACITY)
+	{
+		delete text;
+		return;
+	}
+	text->clear();
+	t_pools.Buffers[t_pools.BufferCount++] = text;
+}
+
+void* TakeBlock()
+{
+	if(t_pools.BlockCount > 0)
+	{
+		return t_pools.Blocks[--t_pools.BlockCount];
+	}
+	return ::operator new(BLOCK_SIZE);
+}
+
+void GiveBlock(void* block)
+{
+	(void)&t_drain;
+	if(t_pools.Closed || t_pools.BlockCount == POOL_SIZE)
+	{
+		::operator delete(block);
+		return;
+	}
+	t_pools.Blocks[t_pools.BlockCount++] = block;
+}
+
+/** Sends a finished message's buffer back to the pool **/
+struct RecycleBuffer
+{
+	void operator()(const string* text) const
+	{
+		GiveBuffer(const_cast<string*>(text));
+	}
+};
+
+/** Allocates the shared_ptr's control block from the pool **/
+template<typename T>
+struct BlockAllocator
+{
+	typedef T value_type;
+
+	BlockAllocator() {}
+
+	template<typename U>
+	BlockAllocator(const BlockAllocator<U>&) {}
+
+	T* allocate(size_t n)
+	{
+		if(n == 1 && sizeof(T) <= BLOCK_SIZE)
+		{
+			return static_cast<T*>(TakeBlock());
+		}
+		return static_cast<T*>(::operator new(n * sizeof(T)));
+	}
+
+	void deallocate(T* p, size_t n)
+	{
+		if(n == 1 && sizeof(T) <= BLOCK_SIZE)
+		{
+			GiveBlock(p);
+			return;
+		}
+		::operator delete(p);
+	}
+
+	template<typename U>
+	bool operator==(const BlockAllocator<U>&) const { return true; }
+
+	template<typename U>
+	bool operator!=(const BlockAllocator<U>&) const { return false; }
+};
+
+}
+
+MessageBuilder::MessageBuilder(size_t sizeHint)
+	: _pText(TakeBuffer())
+{
+	_pText->reserve(sizeHint);
+}
+
+MessageBuilder::~MessageBuilder()
+{
+	if(_pText != NULL)
+	{
+		GiveBuffer(_pText);
+	}
+}
+
+MessageBuilder& MessageBuilder::Append(string_view piece)
+{
+	_pText->append(piece.data(), piece.length());
+	return *this;
+}
+
+MessageBuilder& MessageBuilder::AppendNumber(size_t number)
+{
+	char digits[20];
+	char* start = digits + sizeof(digits);
+	do
+	{
+		*--start = '0' + number % 10;
+		number /= 10;
+	}
+	while(number > 0);
+	_pText->append(start, digits + sizeof(digits) - start);
+	return *this;
+}
+
+SharedMessage MessageBuilder::Finish()
+{
+	string* text = _pText;
+	_pText = NULL;
+	return SharedMessage(text, RecycleBuffer(), BlockAllocator<char>());
+}
+
+SharedMessage ChatServer::FormatMessage(std::initializer_list<string_view> pieces)
+{
+	size_t length = 0;
+	for(auto& piece: pieces)
+	{
+		length += piece.length();
+	}
+
+	MessageBuilder builder(length);
+	for(auto& piece: pieces)
+	{
+		builder.Append(piece);
+	}
+	return builder.Finish();
+}
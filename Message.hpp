@@ -0,0 +1,57 @@
+#ifndef MESSAGE_HPP
+#define MESSAGE_HPP
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <initializer_list>
+
+namespace ChatServer
+{
+
+/**
+	A fully formatted line of output.  It's immutable once built, so a single
+	copy can sit in any number of clients' outbound queues at once - a room
+	broadcast formats the line once and hands every member the same pointer.
+**/
+typedef std::shared_ptr<const std::string> SharedMessage;
+
+/** Wraps the given text up as a SharedMessage **/
+inline SharedMessage MakeMessage(std::string text)
+{
+	return std::make_shared<const std::string>(std::move(text));
+}
+
+/**
+	Builds a SharedMessage a piece at a time, straight into a recycled buffer.
+	When the last reference to the message goes, its buffer (and the
+	shared_ptr's bookkeeping) go back to a per-thread pool rather than the
+	heap, so once the pools are warm formatting a line allocates nothing.
+**/
+class MessageBuilder
+{
+	std::string* _pText; // NULL once Finish()ed
+
+	MessageBuilder(const MessageBuilder&);
+	MessageBuilder& operator=(const MessageBuilder&);
+
+public:
+	MessageBuilder(size_t sizeHint = 0);
+	~MessageBuilder();
+
+	/** Adds text to the end of the message **/
+	MessageBuilder& Append(std::string_view piece);
+
+	/** Adds a number, in decimal **/
+	MessageBuilder& AppendNumber(size_t number);
+
+	/** Hands over the finished message; the builder is empty afterwards **/
+	SharedMessage Finish();
+};
+
+/** Glues the pieces together into a message: FormatMessage({"[", room, "] ", ...}) **/
+SharedMessage FormatMessage(std::initializer_list<std::string_view> pieces);
+
+}
+
+#endif
@@ -0,0 +1,327 @@
+#include "Metrics.hpp"
+
+#include <mutex>
+#include <vector>
+#include <cerrno>
+#include <cstdio>
+#include <cstdarg>
+#include <algorithm>
+#include <stdexcept>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <string.h> // for memcpy, strerror
+#include <syslog.h> // syslog!
+
+using std::string;
+using std::vector;
+
+using ChatServer::Counter;
+using ChatServer::Histogram;
+using ChatServer::Metrics;
+using ChatServer::MetricsServer;
+using ChatServer::ThreadMetrics;
+
+namespace
+{
+
+const int REQUEST_WAIT_MS = 1000; // How long a client gets to say what it wants
+const double QUANTILES[] = { 0.5, 0.9, 0.99, 0.999 };
+
+/** How each counter shows up **/
+const struct
+{
+	const char* Name;
+	const char* Help;
+} COUNTERS[] = {
+	{ "chatd_accepts_total", "Connections accepted." },
+	{ "chatd_disconnects_total", "Connections closed, for any reason." },
+	{ "chatd_idle_kicks_total", "Clients kicked for being idle." },
+	{ "chatd_lines_in_total", "Lines read from clients." },
+	{ "chatd_lines_out_total", "Lines written to clients." },
+	{ "chatd_bytes_in_total", "Bytes read from clients." },
+	{ "chatd_bytes_out_total", "Bytes written to clients." },
+	{ "chatd_send_failures_total", "Clients dropped because their output couldn't be sent." },
+	{ "chatd_floods_total", "Times a client went over its rate limits." },
+	{ "chatd_refusals_total", "Connections refused for their address's limits." },
+};
+static_assert(
+       sizeof(COUNTERS) / sizeof(COUNTERS[0]) == static_cast<size_t>(Counter::COUNT),
+       "every counter needs a name");
+
+std::mutex g_mutex; // Guards g_threads
+vector<ThreadMetrics*> g_threads; // Every thread that's counted anything (never freed)
+
+/** Every thread's histogram, added together **/
+struct Totals
+{
+	uint64_t Counts[Histogram::BUCKETS];
+	uint64_t Sum;
+	uint64_t Count;
+
+	Totals() : Sum(0), Count(0)
+	{
+		memset(Counts, 0, sizeof(Counts));
+	}
+
+	void Add(const Histogram& h)
+	{
+		for(size_t i = 0; i < Histogram::BUCKETS; ++i)
+		{
+			uint64_t count = h.Count(i);
+			Counts[i] += count;
+			Count += count;
+		}
+		Sum += h.Sum();
+	}
+
+	/** The smallest value that 'q' of everything recorded is no bigger than **/
+	uint64_t Quantile(double q) const
+	{
+		uint64_t rank = static_cast<uint64_t>(q * Count + 0.5);
+		uint64_t seen = 0;
+		for(size_t i = 0; i < Histogram::BUCKETS; ++i)
+		{
+			seen += Counts[i];
+			if(seen >= rank && seen > 0)
+			{
+				return Histogram::BucketTop(i);
+			}
+		}
+		return 0;
+	}
+};
+
+void Append(string& out, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+void Append(string& out, const char* format, ...)
+{
+	char line[256];
+	va_list args;
+	va_start(args, format);
+	int length = vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+	if(length > 0)
+	{
+		out.append(line, std::min(static_cast<size_t>(length), sizeof(line) - 1));
+	}
+}
+
+/** Writes out a histogram as a summary; 'scale' turns recorded values into the reported unit **/
+void AppendSummary(string& out, const char* name, const char* help, const Totals& totals, double scale)
+{
+	Append(out, "# HELP %s %s\n# TYPE %s summary\n", name, help, name);
+	for(double q: QUANTILES)
+	{
+		Append(out, "%s{quantile=\"%g\"} %.9g\n", name, q, totals.Quantile(q) * scale);
+	}
+	Append(out, "%s_sum %.9g\n", name, totals.Sum * scale);
+	Append(out, "%s_count %llu\n", name, static_cast<unsigned long long>(totals.Count));
+}
+
+void SendAll(int fd, const char* data, size_t length)
+{
+	while(length > 0)
+	{
+		ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+		if(sent < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if(sent <= 0)
+		{
+			return;
+		}
+		data += sent;
+		length -= sent;
+	}
+}
+
+}
+
+Histogram::Histogram()
+	: _iSum(0)
+{
+	for(auto& count: _aCounts)
+	{
+		count.store(0, std::memory_order_relaxed);
+	}
+}
+
+uint64_t Histogram::Count(size_t bucket) const
+{
+	return _aCounts[bucket].load(std::memory_order_relaxed);
+}
+
+uint64_t Histogram::Sum() const
+{
+	return _iSum.load(std::memory_order_relaxed);
+}
+
+uint64_t Histogram::BucketTop(size_t bucket)
+{
+	if(bucket < (1U << SUB_BITS))
+	{
+		return bucket;
+	}
+	int shift = (bucket >> SUB_BITS) - 1;
+	uint64_t bottom = ((1U << SUB_BITS) + (bucket & ((1U << SUB_BITS) - 1))) << shift;
+	return bottom + (1ULL << shift) - 1;
+}
+
+ThreadMetrics::ThreadMetrics()
+{
+	for(auto& counter: Counters)
+	{
+		counter.store(0, std::memory_order_relaxed);
+	}
+}
+
+ThreadMetrics* Metrics::Register()
+{
+	ThreadMetrics* mine = new ThreadMetrics();
+	std::lock_guard<std::mutex> lock(g_mutex);
+	g_threads.push_back(mine);
+	return mine;
+}
+
+string Metrics::Render()
+{
+	uint64_t counters[static_cast<size_t>(Counter::COUNT)] = { 0 };
+	Totals fanOut, delivery;
+	{
+		std::lock_guard<std::mutex> lock(g_mutex);
+		for(auto thread: g_threads)
+		{
+			for(size_t i = 0; i < static_cast<size_t>(Counter::COUNT); ++i)
+			{
+				counters[i] += thread->Counters[i].load(std::memory_order_relaxed);
+			}
+			fanOut.Add(thread->FanOut);
+			delivery.Add(thread->DeliveryMicros);
+		}
+	}
+
+	string out;
+	for(size_t i = 0; i < static_cast<size_t>(Counter::COUNT); ++i)
+	{
+		Append(
+			out,
+			"# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+			COUNTERS[i].Name,
+			COUNTERS[i].Help,
+			COUNTERS[i].Name,
+			COUNTERS[i].Name,
+			static_cast<unsigned long long>(counters[i]));
+	}
+	AppendSummary(
+		out,
+		"chatd_broadcast_fanout",
+		"Recipients of each room message.",
+		fanOut,
+		1);
+	AppendSummary(
+		out,
+		"chatd_delivery_latency_seconds",
+		"From a room message being posted to its recipients' loops having sent it.",
+		delivery,
+		1e-6);
+	return out;
+}
+
+MetricsServer::MetricsServer(const string& path)
+	: _strPath(path), _iListenFD(-1)
+{
+}
+
+MetricsServer::~MetricsServer()
+{
+	if(_iListenFD >= 0)
+	{
+		close(_iListenFD);
+	}
+}
+
+void MetricsServer::Listen()
+{
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if(_strPath.length() >= sizeof(address.sun_path))
+	{
+		throw std::runtime_error("admin socket path is too long: " + _strPath);
+	}
+	memcpy(address.sun_path, _strPath.c_str(), _strPath.length());
+
+	_iListenFD = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(_iListenFD < 0)
+	{
+		throw std::runtime_error(string("could not create admin socket: ") + strerror(errno));
+	}
+
+	// Whatever's there is left over from an earlier run (or the server we
+	// took over from).  Our group gets to read it too, for the monitoring.
+	unlink(_strPath.c_str());
+	mode_t mask = umask(0007);
+	int result = bind(_iListenFD, reinterpret_cast<struct sockaddr*>(&address), sizeof(address));
+	umask(mask);
+	if(result != 0 || listen(_iListenFD, 16) != 0)
+	{
+		throw std::runtime_error("could not listen on " + _strPath + ": " + strerror(errno));
+	}
+}
+
+void MetricsServer::Serve()
+{
+	while(true)
+	{
+		int fd = accept4(_iListenFD, NULL, NULL, SOCK_CLOEXEC);
+		if(fd < 0)
+		{
+			if(errno != EINTR && errno != ECONNABORTED)
+			{
+				syslog(LOG_ERR, "MetricsServer::Serve()> accept failed: %s", strerror(errno));
+				sleep(1);
+			}
+			continue;
+		}
+		Answer(fd);
+		close(fd);
+	}
+}
+
+void MetricsServer::Answer(int fd)
+{
+	// Give them a moment to ask (an HTTP client will), then answer whatever
+	// they asked - there's only the one thing to ask for
+	string request;
+	while(request.find("\r\n\r\n") == string::npos && request.find("\n\n") == string::npos)
+	{
+		struct pollfd ready = { fd, POLLIN, 0 };
+		if(poll(&ready, 1, REQUEST_WAIT_MS) <= 0)
+		{
+			break;
+		}
+		char buf[512];
+		ssize_t got = recv(fd, buf, sizeof(buf), 0);
+		if(got <= 0 || request.length() > 8192)
+		{
+			break;
+		}
+		request.append(buf, got);
+	}
+
+	string body = Metrics::Render();
+	if(request.compare(0, 4, "GET ") == 0)
+	{
+		string header;
+		Append(
+			header,
+			"HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n",
+			body.length());
+		SendAll(fd, header.data(), header.length());
+	}
+	SendAll(fd, body.data(), body.length());
+}
@@ -0,0 +1,162 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <atomic>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+namespace ChatServer
+{
+
+/** Everything counted (see Metrics::Count()) **/
+enum class Counter
+{
+	ACCEPTS, // Connections accepted
+	DISCONNECTS, // Connections closed, for whatever reason
+	IDLE_KICKS, // Clients kicked for saying nothing for too long
+	LINES_IN, // Lines read from clients
+	LINES_OUT, // Lines written to clients (all of each line)
+	BYTES_IN,
+	BYTES_OUT,
+	SEND_FAILURES, // Clients dropped because their output couldn't go out
+	FLOODS, // Times a client went over its rate limits
+	REFUSALS, // Connections refused for their address's limits
+	COUNT
+};
+
+/**
+	A log-linear histogram, in the style of HdrHistogram: values up to 8 get
+	a bucket each, and after that every power of two is split into 8
+	buckets, so anything recorded is known to within 12.5% without keeping
+	the values themselves.  Values past 2^32 land in the last bucket.
+
+	Only one thread records into a histogram, so recording is a plain load
+	and store with no locked instructions; any thread can read it.
+**/
+class Histogram
+{
+public:
+	static const int SUB_BITS = 3; // log2 of the buckets per power of two
+	static const size_t BUCKETS = (32 - SUB_BITS + 1) << SUB_BITS;
+
+private:
+	std::atomic<uint64_t> _aCounts[BUCKETS];
+	std::atomic<uint64_t> _iSum;
+
+	Histogram(const Histogram&);
+	Histogram& operator=(const Histogram&);
+
+public:
+	Histogram();
+
+	/** Adds a value (owning thread only) **/
+	void Record(uint64_t value)
+	{
+		auto& count = _aCounts[BucketFor(value)];
+		count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		_iSum.store(_iSum.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+	}
+
+	/** Values recorded in the bucket so far **/
+	uint64_t Count(size_t bucket) const;
+
+	/** All the values recorded so far, added up **/
+	uint64_t Sum() const;
+
+	/** Which bucket the value goes in **/
+	static size_t BucketFor(uint64_t value)
+	{
+		if(value < (1U << SUB_BITS))
+		{
+			return value;
+		}
+		int top = 63 - __builtin_clzll(value);
+		if(top >= 32)
+		{
+			return BUCKETS - 1;
+		}
+		int shift = top - SUB_BITS;
+		return (static_cast<size_t>(shift + 1) << SUB_BITS) + ((value >> shift) - (1U << SUB_BITS));
+	}
+
+	/** The biggest value that goes in the bucket **/
+	static uint64_t BucketTop(size_t bucket);
+};
+
+/**
+	One thread's counters and histograms.  Each thread only ever writes its
+	own, and each sits on cache lines of its own, so counting on the hot
+	paths costs a couple of uncontended instructions - no locks, no shared
+	cache lines bouncing between cores.
+**/
+struct alignas(64) ThreadMetrics
+{
+	std::atomic<uint64_t> Counters[static_cast<size_t>(Counter::COUNT)];
+	Histogram FanOut; // Recipients of each room broadcast
+	Histogram DeliveryMicros; // From a broadcast to its recipients' loop having sent it
+
+	ThreadMetrics();
+};
+
+/**
+	The server's metrics, kept per thread and only added up when someone
+	asks for them (see Render()).
+**/
+class Metrics
+{
+private:
+	/** Makes a block for the calling thread, and keeps track of it **/
+	static ThreadMetrics* Register();
+
+public:
+	/** The calling thread's metrics **/
+	static ThreadMetrics& Local()
+	{
+		thread_local ThreadMetrics* mine = Register();
+		return *mine;
+	}
+
+	/** Adds to one of the calling thread's counters **/
+	static void Count(Counter counter, uint64_t amount = 1)
+	{
+		auto& value = Local().Counters[static_cast<size_t>(counter)];
+		value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+	}
+
+	/** Every thread's metrics added together, in Prometheus' text format **/
+	static std::string Render();
+};
+
+/**
+	Serves Render() on a Unix domain socket, so the server can be watched
+	without attaching anything to it.  Speaks just enough HTTP for a
+	Prometheus scrape (or curl --unix-socket); anything that doesn't start
+	with a GET - or says nothing at all - just gets the text.
+**/
+class MetricsServer
+{
+private:
+	std::string _strPath;
+	int _iListenFD;
+
+	MetricsServer(const MetricsServer&);
+	MetricsServer& operator=(const MetricsServer&);
+
+	/** Answers one connection **/
+	void Answer(int fd);
+
+public:
+	MetricsServer(const std::string& path);
+	~MetricsServer();
+
+	/** Starts listening at the path (throws std::runtime_error if it can't) **/
+	void Listen();
+
+	/** Answers requests, for ever **/
+	void Serve();
+};
+
+}
+
+#endif
@@ -0,0 +1,151 @@
+#include "Name.hpp"
+#include "FoldedName.hpp"
+
+#include <algorithm>
+#include <mutex>
+#include <unordered_map>
+
+using std::string;
+using std::string_view;
+
+using ChatServer::FoldedEqual;
+using ChatServer::FoldedHash;
+using ChatServer::Name;
+using ChatServer::NameTable;
+
+/** One stripe of a table; the map's keys are views of the name keys' own text **/
+struct NameTable::Shard
+{
+	std::mutex Mutex;
+	std::unordered_map<string_view, Name::Key*, FoldedHash, FoldedEqual> Keys;
+};
+
+const string& Name::None()
+{
+	static const string* none = new string();
+	return *none;
+}
+
+void Name::Release()
+{
+	// Only the last reference needs the table: the others just count down
+	size_t refs = _pEntry->Refs.load(std::memory_order_relaxed);
+	while(refs > 1)
+	{
+		if(_pEntry->Refs.compare_exchange_weak(refs, refs - 1, std::memory_order_acq_rel))
+		{
+			return;
+		}
+	}
+	_pEntry->Table->Release(_pEntry);
+}
+
+NameTable::NameTable()
+	: _aShards(new Shard[SHARD_COUNT])
+{
+}
+
+NameTable& NameTable::Users()
+{
+	static NameTable* users = new NameTable();
+	return *users;
+}
+
+NameTable& NameTable::Rooms()
+{
+	static NameTable* rooms = new NameTable();
+	return *rooms;
+}
+
+NameTable::Shard& NameTable::ShardFor(size_t hash)
+{
+	return _aShards[hash % SHARD_COUNT];
+}
+
+Name NameTable::Intern(string_view text)
+{
+	if(text.empty())
+	{
+		return Name();
+	}
+
+	size_t hash = FoldedHash()(text);
+	Shard& shard = ShardFor(hash);
+	std::lock_guard<std::mutex> lock(shard.Mutex);
+	Name::Key* key;
+	auto it = shard.Keys.find(text);
+	if(it != shard.Keys.end())
+	{
+		key = it->second;
+	}
+	else
+	{
+		key = new Name::Key();
+		key->Text.assign(text);
+		key->Hash = hash;
+		shard.Keys.emplace(key->Text, key);
+	}
+
+	// Hardly any name has more than one spelling in use at once
+	for(auto entry: key->Spellings)
+	{
+		if(entry->Text == text)
+		{
+			entry->Refs.fetch_add(1, std::memory_order_relaxed);
+			return Name(entry);
+		}
+	}
+
+	Name::Entry* entry = new Name::Entry();
+	entry->Text.assign(text);
+	entry->Of = key;
+	entry->Hash = hash;
+	entry->Refs.store(1, std::memory_order_relaxed);
+	entry->Table = this;
+	key->Spellings.push_back(entry);
+	return Name(entry);
+}
+
+Name NameTable::Find(string_view text)
+{
+	if(text.empty())
+	{
+		return Name();
+	}
+
+	Shard& shard = ShardFor(FoldedHash()(text));
+	std::lock_guard<std::mutex> lock(shard.Mutex);
+	auto it = shard.Keys.find(text);
+	if(it == shard.Keys.end())
+	{
+		return Name();
+	}
+	Name::Entry* entry = it->second->Spellings.front();
+	entry->Refs.fetch_add(1, std::memory_order_relaxed);
+	return Name(entry);
+}
+
+void NameTable::Release(Name::Entry* entry)
+{
+	// Nobody can find the entry while we hold the lock, so if this really is
+	// the last reference, it stays the last one until it's gone
+	Shard& shard = ShardFor(entry->Hash);
+	std::lock_guard<std::mutex> lock(shard.Mutex);
+	if(entry->Refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+	{
+		return;
+	}
+
+	Name::Key* key = entry->Of;
+	auto& spellings = key->Spellings;
+	*std::find(spellings.begin(), spellings.end(), entry) = spellings.back();
+	spellings.pop_back();
+	delete entry;
+
+	// The last spelling takes the key with it
+	if(spellings.empty())
+	{
+		shard.Keys.erase(string_view(key->Text));
+		delete key;
+	}
+}
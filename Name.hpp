@@ -0,0 +1,205 @@
+#ifndef NAME_HPP
+#define NAME_HPP
+
+#include <atomic>
+#include <string>
+#include <string_view>
+#include <cstddef>
+#include <utility>
+#include <vector>
+#include "FoldedName.hpp"
+
+namespace ChatServer
+{
+
+class NameTable;
+
+/**
+	A user or room name, interned in a NameTable.  Every spelling of a name
+	that's in use has an entry of its own, holding that spelling, and every
+	spelling of the same name shares a key, holding its folded hash (see
+	FoldedHash).  So a Name is one pointer, copying one bumps a reference
+	count, and two Names from the same table are the same name exactly when
+	their entries share a key - comparing, hashing and sharding them never
+	looks at the characters.  But a Name always reads back exactly as it was
+	interned, however long some other spelling of it has been around.
+
+	The empty Name is no name at all.
+**/
+class Name
+{
+	friend class NameTable;
+
+private:
+	struct Entry;
+
+	/** What every spelling of a name has in common **/
+	struct Key
+	{
+		std::string Text; // The spelling it was first interned with, to find it by (never shown)
+		size_t Hash; // FoldedHash of it
+		std::vector<Entry*> Spellings; // Everything interned under it (guarded by the table)
+	};
+
+	/** One spelling of a name **/
+	struct Entry
+	{
+		std::string Text; // The spelling, exactly
+		Key* Of; // The name it's a spelling of
+		size_t Hash; // The key's hash, so hashing doesn't chase another pointer
+		std::atomic<size_t> Refs; // Names pointing here
+		NameTable* Table; // Where it was interned
+	};
+
+	Entry* _pEntry; // NULL for no name
+
+	/** Takes over a reference the table has already counted **/
+	explicit Name(Entry* entry) : _pEntry(entry)
+	{
+	}
+
+	/** Gives up our reference (the table's, if it's the last one) **/
+	void Release();
+
+	/** The text of no name **/
+	static const std::string& None();
+
+public:
+	Name() : _pEntry(nullptr)
+	{
+	}
+
+	Name(const Name& other) : _pEntry(other._pEntry)
+	{
+		if(_pEntry != nullptr)
+		{
+			_pEntry->Refs.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	Name(Name&& other) : _pEntry(other._pEntry)
+	{
+		other._pEntry = nullptr;
+	}
+
+	Name& operator=(const Name& other)
+	{
+		Name copy(other);
+		std::swap(_pEntry, copy._pEntry);
+		return *this;
+	}
+
+	Name& operator=(Name&& other)
+	{
+		std::swap(_pEntry, other._pEntry);
+		return *this;
+	}
+
+	~Name()
+	{
+		if(_pEntry != nullptr)
+		{
+			Release();
+		}
+	}
+
+	/** The name, spelled as it was interned ("" for no name) **/
+	const std::string& Text() const
+	{
+		return _pEntry != nullptr ? _pEntry->Text : None();
+	}
+
+	/** Lets a Name go anywhere a string_view does **/
+	operator std::string_view() const
+	{
+		return Text();
+	}
+
+	bool Empty() const
+	{
+		return _pEntry == nullptr;
+	}
+
+	/** The folded hash, worked out once when the name was interned **/
+	size_t Hash() const
+	{
+		return _pEntry != nullptr ? _pEntry->Hash : 0;
+	}
+
+	/** The same name, in any spelling **/
+	bool operator==(const Name& other) const
+	{
+		return _pEntry == other._pEntry || 
+		       (_pEntry != nullptr && other._pEntry != nullptr && _pEntry->Of == other._pEntry->Of);
+	}
+
+	bool operator!=(const Name& other) const
+	{
+		return !(*this == other);
+	}
+
+	/** Orders by name, ignoring case, as listings are **/
+	bool operator<(const Name& other) const
+	{
+		return FoldedLess()(Text(), other.Text());
+	}
+};
+
+/** Hashes a Name for a hash map, without hashing it again **/
+struct NameHash
+{
+	size_t operator()(const Name& name) const
+	{
+		return name.Hash();
+	}
+};
+
+/**
+	Where names are interned.  Users and rooms each get their own table, so
+	a room can't lend its spelling to a user who happens to share its name.
+
+	An entry lives as long as a Name points at it, and a key as long as it
+	has any entries.  Lock-striped like the registries: interning and
+	finding lock one stripe, copying a Name locks nothing, and dropping one
+	only locks when it might be the last.
+**/
+class NameTable
+{
+private:
+	struct Shard;
+
+	static const int SHARD_COUNT = 64;
+
+	Shard* _aShards; // Never freed - Names can outlive everything
+
+	NameTable();
+	NameTable(const NameTable&);
+	NameTable& operator=(const NameTable&);
+
+	Shard& ShardFor(size_t hash);
+
+	/** Gives up a reference that may be the entry's last **/
+	void Release(Name::Entry* entry);
+
+	friend class Name;
+
+public:
+	/** The user names **/
+	static NameTable& Users();
+
+	/** The room names **/
+	static NameTable& Rooms();
+
+	/** The name, spelled exactly as given ("" is no name) **/
+	Name Intern(std::string_view text);
+
+	/**
+	The name if it's in use already (in some spelling - only good for
+	looking it up), otherwise no name.  Never allocates.
+	**/
+	Name Find(std::string_view text);
+};
+
+}
+
+#endif
@@ -0,0 +1,76 @@
+#include "OutboundQueue.hpp"
+
+#include <utility>
+
+using ChatServer::OutboundQueue;
+using ChatServer::SharedMessage;
+
+OutboundQueue::OutboundQueue()
+	: _iMask(0), _iHead(0), _iCount(0)
+{
+}
+
+void OutboundQueue::Grow()
+{
+	size_t size = _aRing ? (_iMask + 1) * 2 : FIRST_SIZE;
+	std::unique_ptr<SharedMessage[]> ring(new SharedMessage[size]);
+	for(size_t i = 0; i < _iCount; ++i)
+	{
+		ring[i] = std::move(_aRing[(_iHead + i) & _iMask]);
+	}
+	_aRing = std::move(ring);
+	_iMask = size - 1;
+	_iHead = 0;
+}
+
+bool OutboundQueue::Empty() const
+{
+	return _iCount == 0;
+}
+
+size_t OutboundQueue::Size() const
+{
+	return _iCount;
+}
+
+const SharedMessage& OutboundQueue::operator[](size_t i) const
+{
+	return _aRing[(_iHead + i) & _iMask];
+}
+
+void OutboundQueue::PushBack(const SharedMessage& msg)
+{
+	if(!_aRing || _iCount > _iMask)
+	{
+		Grow();
+	}
+	_aRing[(_iHead + _iCount) & _iMask] = msg;
+	++_iCount;
+}
+
+void OutboundQueue::PopFront()
+{
+	_aRing[_iHead].reset();
+	_iHead = (_iHead + 1) & _iMask;
+	--_iCount;
+}
+
+void OutboundQueue::Erase(size_t i)
+{
+	// Shuffle the older ones up into the gap, and it's the front that goes -
+	// it's only ever near the front that anything is taken out
+	for(; i > 0; --i)
+	{
+		_aRing[(_iHead + i) & _iMask] = std::move(_aRing[(_iHead + i - 1) & _iMask]);
+	}
+	PopFront();
+}
+
+void OutboundQueue::Clear()
+{
+	while(_iCount > 0)
+	{
+		PopFront();
+	}
+	_iHead = 0;
+}
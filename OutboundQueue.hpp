@@ -0,0 +1,63 @@
+#ifndef OUTBOUND_QUEUE_HPP
+#define OUTBOUND_QUEUE_HPP
+
+#include <memory>
+#include <cstddef>
+#include "Message.hpp"
+
+namespace ChatServer
+{
+
+/**
+	The messages waiting to go out to one client, oldest first.
+
+	It's a ring that doubles when it fills up and never shrinks, so once
+	it's grown to the client's usual backlog, queueing and sending don't
+	allocate.  It lives in the connection's pool slot and is only ever
+	cleared, never destroyed, so the next connection in that slot starts
+	with the room it grew.  Not thread-safe: each queue has one owner.
+**/
+class OutboundQueue
+{
+private:
+	static const size_t FIRST_SIZE = 16; // Room made on the first push
+
+	std::unique_ptr<ChatServer::SharedMessage[]> _aRing; // NULL until the first push
+	size_t _iMask; // Ring size - 1 (the size is a power of two)
+	size_t _iHead; // Where the oldest message is
+	size_t _iCount; // How many are queued
+
+	OutboundQueue(const OutboundQueue&);
+	OutboundQueue& operator=(const OutboundQueue&);
+
+	/** Moves everything into a ring twice the size **/
+	void Grow();
+
+public:
+	OutboundQueue();
+
+	/** True if there's nothing queued **/
+	bool Empty() const;
+
+	/** Number of messages queued **/
+	size_t Size() const;
+
+	/** The i'th oldest message (0 is the next to go out) **/
+	const ChatServer::SharedMessage& operator[](size_t i) const;
+
+	/** Queues the message after all the others **/
+	void PushBack(const ChatServer::SharedMessage& msg);
+
+	/** Lets go of the oldest message **/
+	void PopFront();
+
+	/** Lets go of the i'th oldest message, keeping the rest in order **/
+	void Erase(size_t i);
+
+	/** Lets go of everything, keeping the room **/
+	void Clear();
+};
+
+}
+
+#endif
@@ -0,0 +1,177 @@
+#include "RateLimit.hpp"
+#include "ServerConfig.hpp"
+
+#include <algorithm>
+#include <mutex>
+#include <unordered_map>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <string.h> // for memcpy, memcmp, memset
+
+using std::chrono::steady_clock;
+
+using ChatServer::AddressLimits;
+using ChatServer::PeerAddress;
+using ChatServer::PeerAddressHash;
+using ChatServer::ServerConfig;
+using ChatServer::TokenBucket;
+
+namespace
+{
+
+const size_t MIN_SWEEP = 64; // Addresses a shard can hold before it's swept
+
+/** One address's connections **/
+struct Address
+{
+	TokenBucket Connects;
+	size_t Sessions;
+
+	Address(size_t rate, size_t burst) : Connects(rate, burst), Sessions(0)
+	{
+	}
+};
+
+}
+
+/** One stripe of the addresses **/
+struct AddressLimits::Shard
+{
+	std::mutex Mutex;
+	std::unordered_map<PeerAddress, Address, PeerAddressHash> Addresses;
+	size_t SweepAt; // Sweep out idle addresses once there are this many
+
+	Shard() : SweepAt(MIN_SWEEP)
+	{
+	}
+};
+
+PeerAddress PeerAddress::Of(int fd)
+{
+	PeerAddress address;
+	memset(&address, 0, sizeof(address));
+
+	struct sockaddr_storage peer;
+	socklen_t length = sizeof(peer);
+	if(getpeername(fd, reinterpret_cast<struct sockaddr*>(&peer), &length) != 0)
+	{
+		return address;
+	}
+
+	if(peer.ss_family == AF_INET)
+	{
+		auto in = reinterpret_cast<const struct sockaddr_in*>(&peer);
+		address.Bytes[10] = 0xff;
+		address.Bytes[11] = 0xff;
+		memcpy(&address.Bytes[12], &in->sin_addr, 4);
+		address.Known = true;
+	}
+	else if(peer.ss_family == AF_INET6)
+	{
+		auto in6 = reinterpret_cast<const struct sockaddr_in6*>(&peer);
+		memcpy(address.Bytes, &in6->sin6_addr, sizeof(address.Bytes));
+		address.Known = true;
+	}
+	return address;
+}
+
+bool PeerAddress::operator==(const PeerAddress& other) const
+{
+	return Known == other.Known && memcmp(Bytes, other.Bytes, sizeof(Bytes)) == 0;
+}
+
+size_t PeerAddressHash::operator()(const PeerAddress& address) const
+{
+	// FNV-1a, as the names are hashed
+	uint64_t hash = 14695981039346656037ULL;
+	for(auto byte: address.Bytes)
+	{
+		hash ^= byte;
+		hash *= 1099511628211ULL;
+	}
+	return static_cast<size_t>(hash);
+}
+
+AddressLimits::AddressLimits(const ServerConfig& config)
+	: _iConnectRate(config.ConnectRate),
+	  _iConnectBurst(config.ConnectBurst),
+	  _iMaxSessions(config.SessionsPerAddress),
+	  _aShards(new Shard[SHARD_COUNT])
+{
+}
+
+AddressLimits::~AddressLimits()
+{
+	delete[] _aShards;
+}
+
+AddressLimits::Shard& AddressLimits::ShardFor(const PeerAddress& address)
+{
+	return _aShards[PeerAddressHash()(address) % SHARD_COUNT];
+}
+
+bool AddressLimits::Enabled() const
+{
+	return _iConnectRate > 0 || _iMaxSessions > 0;
+}
+
+bool AddressLimits::Admit(const PeerAddress& address, bool fresh)
+{
+	if(!Enabled() || !address.Known)
+	{
+		return true;
+	}
+
+	auto now = steady_clock::now();
+	Shard& shard = ShardFor(address);
+	std::lock_guard<std::mutex> lock(shard.Mutex);
+
+	// Sweep before adding, so the map never grows by more than it's swept
+	if(shard.Addresses.size() >= shard.SweepAt)
+	{
+		for(auto it = shard.Addresses.begin(); it != shard.Addresses.end(); )
+		{
+			if(it->second.Sessions == 0 && it->second.Connects.IsFull(now))
+			{
+				it = shard.Addresses.erase(it);
+			}
+			else
+			{
+				++it;
+			}
+		}
+		shard.SweepAt = std::max(MIN_SWEEP, shard.Addresses.size() * 2);
+	}
+
+	Address& from = shard.Addresses.try_emplace(address, _iConnectRate, _iConnectBurst).first->second;
+	if(fresh)
+	{
+		if(_iMaxSessions > 0 && from.Sessions >= _iMaxSessions)
+		{
+			return false;
+		}
+		if(!from.Connects.Take(1, now))
+		{
+			return false;
+		}
+	}
+	++from.Sessions;
+	return true;
+}
+
+void AddressLimits::Leave(const PeerAddress& address)
+{
+	if(!Enabled() || !address.Known)
+	{
+		return;
+	}
+
+	Shard& shard = ShardFor(address);
+	std::lock_guard<std::mutex> lock(shard.Mutex);
+	auto it = shard.Addresses.find(address);
+	if(it != shard.Addresses.end() && it->second.Sessions > 0)
+	{
+		--it->second.Sessions;
+	}
+}
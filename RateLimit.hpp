@@ -0,0 +1,157 @@
+#ifndef RATE_LIMIT_HPP
+#define RATE_LIMIT_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+
+namespace ChatServer
+{
+
+struct ServerConfig;
+
+/**
+	A token bucket that fills at 'rate' tokens a second and holds 'burst' of
+	them.  It's kept the way GCRA keeps one - as the single time at which
+	the bucket would be full again - so there's nothing to top up, and
+	taking tokens is a couple of additions and a compare.
+
+	A rate of 0 is no limit at all.  Not thread-safe: each bucket has one
+	owner.
+**/
+class TokenBucket
+{
+private:
+	typedef std::chrono::steady_clock::time_point time_point;
+	typedef std::chrono::nanoseconds nanoseconds;
+
+	nanoseconds _tInterval; // How long one token takes to come back (0 for no limit)
+	nanoseconds _tBurst; // How far behind the bucket can be: 'burst' tokens' worth
+	time_point _tFull; // When the bucket will be full again, if nothing more is taken
+
+	/** What taking 'cost' tokens now would move _tFull to **/
+	time_point After(uint64_t cost, time_point now) const
+	{
+		// Nothing costs more than a full bucket, or it could never go through
+		nanoseconds price = _tInterval * cost;
+		if(price > _tBurst)
+		{
+			price = _tBurst;
+		}
+		return (_tFull > now ? _tFull : now) + price;
+	}
+
+public:
+	TokenBucket(size_t rate = 0, size_t burst = 1)
+		: _tInterval(rate > 0 ? nanoseconds(1000000000 / rate) : nanoseconds(0)),
+		  _tBurst(_tInterval * (burst > 0 ? burst : 1))
+	{
+	}
+
+	/** True if 'cost' tokens are there to take (without taking them) **/
+	bool Allows(uint64_t cost, time_point now) const
+	{
+		return _tInterval.count() == 0 || After(cost, now) - now <= _tBurst;
+	}
+
+	/** Takes 'cost' tokens if they're there; false (taking nothing) if they aren't **/
+	bool Take(uint64_t cost, time_point now)
+	{
+		if(!Allows(cost, now))
+		{
+			return false;
+		}
+		Charge(cost, now);
+		return true;
+	}
+
+	/** Takes 'cost' tokens whether they're there or not, running into debt if need be **/
+	void Charge(uint64_t cost, time_point now)
+	{
+		if(_tInterval.count() != 0)
+		{
+			_tFull = After(cost, now);
+		}
+	}
+
+	/** How long until the bucket's out of debt (zero if it isn't in any) **/
+	nanoseconds Debt(time_point now) const
+	{
+		nanoseconds behind = _tFull - now - _tBurst;
+		return behind.count() > 0 ? behind : nanoseconds(0);
+	}
+
+	/** True if the bucket's as full as it gets **/
+	bool IsFull(time_point now) const
+	{
+		return _tFull <= now;
+	}
+};
+
+/** Where a connection's from, as far as the limits care: its IP, in IPv6 form **/
+struct PeerAddress
+{
+	uint8_t Bytes[16]; // IPv4 addresses are mapped (::ffff:a.b.c.d)
+	bool Known; // False if we couldn't tell (it's not limited, then)
+
+	/** The address the socket is connected to **/
+	static PeerAddress Of(int fd);
+
+	bool operator==(const PeerAddress& other) const;
+};
+
+/** Hashes a PeerAddress, for a hash map **/
+struct PeerAddressHash
+{
+	size_t operator()(const PeerAddress& address) const;
+};
+
+/**
+	Limits on what any one address can do: how fast it can open connections
+	(a token bucket each), and how many it can have open at once.  Shared by
+	all the loops, and lock-striped, so loops accepting from different
+	addresses don't contend.
+
+	An address is kept while it has connections open, or its bucket hasn't
+	filled back up - otherwise it could reset its bucket by hanging up -
+	and swept out once it's neither, a few at a time as new ones arrive.
+**/
+class AddressLimits
+{
+private:
+	struct Shard;
+
+	static const int SHARD_COUNT = 64;
+
+	size_t _iConnectRate; // Connections a second, per address (0 for no limit)
+	size_t _iConnectBurst;
+	size_t _iMaxSessions; // Connections open at once, per address (0 for no limit)
+	Shard* _aShards;
+
+	AddressLimits(const AddressLimits&);
+	AddressLimits& operator=(const AddressLimits&);
+
+	Shard& ShardFor(const PeerAddress& address);
+
+public:
+	AddressLimits(const ServerConfig& config);
+	~AddressLimits();
+
+	/** True if there are any limits to keep **/
+	bool Enabled() const;
+
+	/**
+	Counts a connection from the address, if it's within its limits, and
+	returns false (counting nothing) if it isn't.  A connection carried over
+	from the previous server ('fresh' false) is always let in, and only
+	counted against the number open.
+	**/
+	bool Admit(const PeerAddress& address, bool fresh);
+
+	/** Counts a connection Admit()ted from the address as closed **/
+	void Leave(const PeerAddress& address);
+};
+
+}
+
+#endif
@@ -0,0 +1,109 @@
+#include "RoomHistory.hpp"
+#include "Message.hpp"
+
+#include <algorithm>
+#include <string.h> // for memcpy
+
+using std::string_view;
+
+using ChatServer::HistoryBudget;
+using ChatServer::RoomHistory;
+
+HistoryBudget::HistoryBudget(size_t limit)
+	: _iUsed(0), _iLimit(limit)
+{
+}
+
+bool HistoryBudget::Reserve(size_t bytes)
+{
+	size_t used = _iUsed.load(std::memory_order_relaxed);
+	do
+	{
+		if(bytes > _iLimit - used)
+		{
+			return false;
+		}
+	}
+	while(!_iUsed.compare_exchange_weak(used, used + bytes, std::memory_order_relaxed));
+	return true;
+}
+
+void HistoryBudget::Release(size_t bytes)
+{
+	_iUsed.fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+RoomHistory::RoomHistory(size_t maxLines, size_t maxBytes, HistoryBudget& budget)
+	: _budget(budget), _iMaxLines(maxLines), _iMaxBytes(maxBytes), 
+	  _iHead(0), _iUsed(0), _iFirstLine(0), _iLines(0)
+{
+}
+
+RoomHistory::~RoomHistory()
+{
+	if(_aBytes)
+	{
+		_budget.Release(_iMaxBytes);
+	}
+}
+
+void RoomHistory::Add(string_view line)
+{
+	if(_iMaxLines == 0 || line.length() == 0 || line.length() > _iMaxBytes)
+	{
+		return;
+	}
+
+	if(!_aBytes)
+	{
+		// First line in this room - if the server's out of history memory,
+		// the room just goes without (and tries again next time).
+		if(!_budget.Reserve(_iMaxBytes))
+		{
+			return;
+		}
+		_aBytes.reset(new char[_iMaxBytes]);
+		_vLengths.resize(_iMaxLines);
+	}
+
+	while(_iLines == _iMaxLines || _iMaxBytes - _iUsed < line.length())
+	{
+		DropOldest();
+	}
+
+	// Copy it in after the newest line, wrapping around the end if need be
+	size_t tail = (_iHead + _iUsed) % _iMaxBytes;
+	size_t first = std::min(line.length(), _iMaxBytes - tail);
+	memcpy(&_aBytes[tail], line.data(), first);
+	memcpy(&_aBytes[0], line.data() + first, line.length() - first);
+	_iUsed += line.length();
+
+	_vLengths[(_iFirstLine + _iLines) % _iMaxLines] = line.length();
+	++_iLines;
+}
+
+void RoomHistory::DropOldest()
+{
+	size_t length = _vLengths[_iFirstLine];
+	_iHead = (_iHead + length) % _iMaxBytes;
+	_iUsed -= length;
+	_iFirstLine = (_iFirstLine + 1) % _iMaxLines;
+	--_iLines;
+}
+
+void RoomHistory::AppendTo(ChatServer::MessageBuilder& out) const
+{
+	if(_iUsed == 0)
+	{
+		return;
+	}
+
+	size_t first = std::min(_iUsed, _iMaxBytes - _iHead);
+	out.Append(string_view(&_aBytes[_iHead], first));
+	out.Append(string_view(&_aBytes[0], _iUsed - first));
+}
+
+size_t RoomHistory::Size() const
+{
+	return _iUsed;
+}
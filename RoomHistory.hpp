@@ -0,0 +1,85 @@
+#ifndef ROOM_HISTORY_HPP
+#define ROOM_HISTORY_HPP
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <string_view>
+
+namespace ChatServer
+{
+
+class MessageBuilder;
+
+/**
+	Server-wide cap on the memory all the room histories can use between
+	them.  Rooms reserve their whole arena up front, and give it back when
+	they're deleted.  Safe to use from any thread.
+**/
+class HistoryBudget
+{
+private:
+	std::atomic<size_t> _iUsed; // Bytes currently reserved
+	size_t _iLimit; // Most that can be reserved
+
+public:
+	HistoryBudget(size_t limit);
+
+	/** Reserves 'bytes' if there's that much left; false if not **/
+	bool Reserve(size_t bytes);
+
+	/** Gives back what Reserve() took **/
+	void Release(size_t bytes);
+};
+
+/**
+	The last few lines said in a room, already formatted, so they can be
+	replayed to whoever joins next.
+
+	The lines sit end to end in one fixed-size arena used as a ring: new
+	lines go after the newest, wrapping around at the end, and the oldest
+	ones are dropped to make room (or once there are more than 'maxLines').
+	So the whole history is at most two contiguous runs of bytes, and a
+	replay is two copies into one message.  The arena is only allocated
+	when the first line comes in, and only if the HistoryBudget allows.
+
+	Not thread-safe - it lives under its room's shard lock.
+**/
+class RoomHistory
+{
+private:
+	HistoryBudget& _budget;
+	size_t _iMaxLines; // Most lines kept
+	size_t _iMaxBytes; // Arena size
+	std::unique_ptr<char[]> _aBytes; // The arena, once we have one
+	size_t _iHead; // Arena offset of the oldest line
+	size_t _iUsed; // Bytes of lines in the arena
+	std::vector<uint32_t> _vLengths; // Ring of line lengths, oldest at _iFirstLine
+	size_t _iFirstLine;
+	size_t _iLines; // Lines in the arena
+
+	RoomHistory(const RoomHistory&);
+	RoomHistory& operator=(const RoomHistory&);
+
+	/** Forgets the oldest line **/
+	void DropOldest();
+
+public:
+	RoomHistory(size_t maxLines, size_t maxBytes, HistoryBudget& budget);
+	~RoomHistory();
+
+	/** Remembers a line (including its "\n"); lines too big to ever fit are skipped **/
+	void Add(std::string_view line);
+
+	/** Appends every remembered line, oldest first **/
+	void AppendTo(ChatServer::MessageBuilder& out) const;
+
+	/** Bytes of history currently held **/
+	size_t Size() const;
+};
+
+}
+
+#endif
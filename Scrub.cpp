@@ -0,0 +1,131 @@
+#include "Scrub.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CHAT_SCRUB_X86 1
+#endif
+
+typedef size_t (*ScrubFunction)(char*, size_t);
+
+size_t ChatServer::ScrubInPlaceScalar(char* msg, size_t length)
+{
+	// int of 32-126 inclusive, avoids \t, \n, etc.
+	for(size_t i = 0; i < length; ++i)
+	{
+		char c = msg[i];
+		if(c == '\0' || c == '\n' || c == '\r')
+		{
+			// Found a null-terminator - this should be the end of the string
+			// Also, assume that \n or \r signal the end of a message
+			return i;
+		}
+
+		if(!(c >= 32 && c <= 126))
+		{
+			msg[i] = ' ';
+		}
+	}
+	return length;
+}
+
+#ifdef CHAT_SCRUB_X86
+
+// Both kernels look for the end of the line a whole block at a time; the
+// block it's in (and any leftover tail) goes to the scalar version.  The
+// compares are signed, so bytes >= 128 come out negative and get caught by
+// the "less than 32" test along with the control characters.
+
+/** Scrubs 16 bytes, unless the line ends in them (then returns false) **/
+__attribute__((target("sse2"), always_inline))
+static inline bool ScrubBlock16(char* block)
+{
+	__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block));
+	__m128i ends = _mm_or_si128(
+	                 _mm_cmpeq_epi8(v, _mm_setzero_si128()),
+	                 _mm_or_si128(
+	                   _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')), 
+	                   _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))));
+	if(_mm_movemask_epi8(ends) != 0)
+	{
+		return false;
+	}
+
+	__m128i bad = _mm_or_si128(
+	                _mm_cmplt_epi8(v, _mm_set1_epi8(32)), 
+	                _mm_cmpgt_epi8(v, _mm_set1_epi8(126)));
+	v = _mm_or_si128(_mm_andnot_si128(bad, v), _mm_and_si128(bad, _mm_set1_epi8(' ')));
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(block), v);
+	return true;
+}
+
+__attribute__((target("sse2")))
+static size_t ScrubSSE2(char* msg, size_t length)
+{
+	size_t i = 0;
+	while(i + 16 <= length && ScrubBlock16(msg + i))
+	{
+		i += 16;
+	}
+	return i + ChatServer::ScrubInPlaceScalar(msg + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static size_t ScrubAVX2(char* msg, size_t length)
+{
+	const __m256i nul = _mm256_setzero_si256();
+	const __m256i cr = _mm256_set1_epi8('\r');
+	const __m256i lf = _mm256_set1_epi8('\n');
+	const __m256i low = _mm256_set1_epi8(32);
+	const __m256i high = _mm256_set1_epi8(126);
+	const __m256i space = _mm256_set1_epi8(' ');
+
+	size_t i = 0;
+	for(; i + 32 <= length; i += 32)
+	{
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(msg + i));
+		__m256i ends = _mm256_or_si256(
+		                 _mm256_cmpeq_epi8(v, nul),
+		                 _mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, lf)));
+		if(_mm256_movemask_epi8(ends) != 0)
+		{
+			break;
+		}
+
+		// Cheaper to always store than to branch on whether anything changed
+		__m256i bad = _mm256_or_si256(_mm256_cmpgt_epi8(low, v), _mm256_cmpgt_epi8(v, high));
+		v = _mm256_blendv_epi8(v, space, bad);
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(msg + i), v);
+	}
+
+	// One more half-width step, inlined here (VEX encoded) - calling out to 
+	// the SSE2 kernel would pay for an AVX -> SSE transition on every line.
+	if(i + 16 <= length && ScrubBlock16(msg + i))
+	{
+		i += 16;
+	}
+	return i + ChatServer::ScrubInPlaceScalar(msg + i, length - i);
+}
+
+#endif
+
+static ScrubFunction PickScrub()
+{
+#ifdef CHAT_SCRUB_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+	{
+		return ScrubAVX2;
+	}
+	if(__builtin_cpu_supports("sse2"))
+	{
+		return ScrubSSE2;
+	}
+#endif
+	return ChatServer::ScrubInPlaceScalar;
+}
+
+size_t ChatServer::ScrubInPlace(char* msg, size_t length)
+{
+	static const ScrubFunction scrub = PickScrub();
+	return scrub(msg, length);
+}
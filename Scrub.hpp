@@ -0,0 +1,24 @@
+#ifndef SCRUB_HPP
+#define SCRUB_HPP
+
+#include <cstddef>
+
+namespace ChatServer
+{
+
+/**
+	Cleans up a line from a client, in place: the line ends at the first
+	'\0', '\r' or '\n', and anything else outside printable ASCII (32-126)
+	becomes a space.  Returns the length of what's left.
+
+	Works 32 (AVX2) or 16 (SSE2) bytes at a time where the CPU allows,
+	picking the widest version available the first time it's called.
+**/
+size_t ScrubInPlace(char* msg, size_t length);
+
+/** The same thing, one byte at a time - the reference implementation **/
+size_t ScrubInPlaceScalar(char* msg, size_t length);
+
+}
+
+#endif
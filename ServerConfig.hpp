@@ -0,0 +1,95 @@
+#ifndef SERVER_CONFIG_HPP
+#define SERVER_CONFIG_HPP
+
+#include <cstddef>
+#include <string>
+
+namespace ChatServer
+{
+
+/** What to do with a client whose outbound queue passes the high watermark **/
+enum class SlowConsumerPolicy
+{
+	DISCONNECT, // Kick them, they can't keep up
+	DROP_OLDEST // Throw away their oldest queued lines, down to the low watermark
+};
+
+/** What to do with a client sending faster than its rate limits **/
+enum class FloodPolicy
+{
+	DELAY, // Stop reading from them until they're back within the limits
+	DROP, // Throw away their lines until they're back within the limits
+	DISCONNECT // Kick them
+};
+
+/**
+	Everything that can be tuned from the command line (see main.cpp).  Filled
+	in once at startup, and read-only after that.
+**/
+struct ServerConfig
+{
+	int Port; // TCP port to listen on
+	int LoopCount; // Number of event loops (threads)
+	bool ReusePort; // Each loop gets its own SO_REUSEPORT listener
+	size_t MaxConnections; // Connection slots, preallocated and split between the loops (0 for one per file we can open)
+
+	size_t OutboundHighWater; // Queued output (bytes) that triggers SlowConsumer
+	size_t OutboundLowWater; // DROP_OLDEST trims the queue back to this
+	SlowConsumerPolicy SlowConsumer;
+
+	size_t LineRate; // Lines a second each client can send (0 for no limit)
+	size_t LineBurst; // Lines each client can send at once, above LineRate
+	size_t ByteRate; // Bytes a second each client can send (0 for no limit)
+	size_t ByteBurst; // Bytes each client can send at once, above ByteRate
+	FloodPolicy Flood;
+
+	size_t ConnectRate; // Connections a second from any one address (0 for no limit)
+	size_t ConnectBurst; // Connections any one address can make at once, above ConnectRate
+	size_t SessionsPerAddress; // Connections open at once from any one address (0 for no limit)
+
+	size_t HistoryLines; // Lines each room remembers for new joiners (0 for none)
+	size_t HistoryRoomBytes; // Memory for each room's history
+	size_t HistoryTotalBytes; // Memory for all the rooms' histories put together
+
+	std::string JournalDir; // Where to keep the on-disk message log ("" for none)
+	size_t JournalSegmentBytes; // Size of each log file
+	size_t JournalSyncMs; // Longest a logged line waits to be flushed to disk
+
+	std::string SnapshotPath; // Where to save the rooms for a warm restart ("" for nowhere)
+	size_t SnapshotSeconds; // How often to save them, besides on SIGHUP/SIGTERM (0 for never)
+
+	std::string HandoffPath; // Unix socket a successor can take everything over from ("" for none)
+	bool Takeover; // Start by taking over from the server at HandoffPath
+
+	std::string AdminPath; // Unix socket serving the metrics ("" for none)
+
+	ServerConfig()
+		: Port(4919), // 0x1337
+		  LoopCount(1),
+		  ReusePort(false),
+		  MaxConnections(0),
+		  OutboundHighWater(1024 * 1024),
+		  OutboundLowWater(256 * 1024),
+		  SlowConsumer(SlowConsumerPolicy::DISCONNECT),
+		  LineRate(0),
+		  LineBurst(40),
+		  ByteRate(0),
+		  ByteBurst(64 * 1024),
+		  Flood(FloodPolicy::DELAY),
+		  ConnectRate(0),
+		  ConnectBurst(20),
+		  SessionsPerAddress(0),
+		  HistoryLines(50),
+		  HistoryRoomBytes(16 * 1024),
+		  HistoryTotalBytes(64 * 1024 * 1024),
+		  JournalSegmentBytes(8 * 1024 * 1024),
+		  JournalSyncMs(100),
+		  SnapshotSeconds(60),
+		  Takeover(false)
+	{
+	}
+};
+
+}
+
+#endif
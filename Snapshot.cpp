@@ -0,0 +1,209 @@
+#include "Snapshot.hpp"
+
+#include <stdexcept>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string.h> // for memcpy, strerror
+
+using std::string;
+using std::string_view;
+
+using ChatServer::SnapshotReader;
+using ChatServer::SnapshotWriter;
+
+namespace
+{
+
+const char FILE_MAGIC[8] = { 'C', 'H', 'A', 'T', 'S', 'N', 'P', '1' };
+
+/** What's at the front of the file **/
+struct FileHeader
+{
+	char Magic[8];
+	uint32_t Check; // FNV-1a of the body
+	uint32_t Reserved;
+	uint64_t Length; // Bytes of body
+};
+
+uint32_t Checksum(const char* data, size_t length)
+{
+	uint32_t hash = 2166136261U;
+	for(size_t i = 0; i < length; ++i)
+	{
+		hash ^= static_cast<unsigned char>(data[i]);
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+/** Writes all of it, or says why not **/
+void WriteAll(int fd, const char* data, size_t length, const string& path)
+{
+	while(length > 0)
+	{
+		ssize_t written = write(fd, data, length);
+		if(written < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if(written <= 0)
+		{
+			throw std::runtime_error("Can't write " + path + ": " + strerror(errno));
+		}
+		data += written;
+		length -= written;
+	}
+}
+
+}
+
+void SnapshotWriter::PutNumber(uint32_t number)
+{
+	_strBody.append(reinterpret_cast<const char*>(&number), sizeof(number));
+}
+
+void SnapshotWriter::PutString(string_view str)
+{
+	PutNumber(static_cast<uint32_t>(str.length()));
+	_strBody.append(str);
+}
+
+const string& SnapshotWriter::Body() const
+{
+	return _strBody;
+}
+
+void SnapshotWriter::Save(const string& path) const
+{
+	FileHeader header;
+	memcpy(header.Magic, FILE_MAGIC, sizeof(FILE_MAGIC));
+	header.Check = Checksum(_strBody.data(), _strBody.length());
+	header.Reserved = 0;
+	header.Length = _strBody.length();
+
+	string temp = path + ".tmp";
+	int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+	if(fd < 0)
+	{
+		throw std::runtime_error("Can't create " + temp + ": " + strerror(errno));
+	}
+
+	try
+	{
+		WriteAll(fd, reinterpret_cast<const char*>(&header), sizeof(header), temp);
+		WriteAll(fd, _strBody.data(), _strBody.length(), temp);
+		if(fsync(fd) != 0)
+		{
+			throw std::runtime_error("Can't sync " + temp + ": " + strerror(errno));
+		}
+	}
+	catch(const std::runtime_error&)
+	{
+		close(fd);
+		unlink(temp.c_str());
+		throw;
+	}
+	close(fd);
+
+	// Either the old snapshot or the new one, never half of one
+	if(rename(temp.c_str(), path.c_str()) != 0)
+	{
+		unlink(temp.c_str());
+		throw std::runtime_error("Can't replace " + path + ": " + strerror(errno));
+	}
+}
+
+SnapshotReader::SnapshotReader(const string& path)
+	: _pData(NULL), _iSize(0), _bMapped(false), _pNext(NULL), _pEnd(NULL)
+{
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if(fd < 0)
+	{
+		if(errno == ENOENT)
+		{
+			// Nothing saved yet
+			return;
+		}
+		throw std::runtime_error("Can't open " + path + ": " + strerror(errno));
+	}
+
+	struct stat info;
+	if(fstat(fd, &info) != 0 || info.st_size < static_cast<off_t>(sizeof(FileHeader)))
+	{
+		close(fd);
+		throw std::runtime_error(path + " is too short to be a snapshot");
+	}
+
+	void* map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+	{
+		throw std::runtime_error("Can't map " + path + ": " + strerror(errno));
+	}
+	_pData = static_cast<const char*>(map);
+	_iSize = info.st_size;
+	_bMapped = true;
+
+	FileHeader header;
+	memcpy(&header, _pData, sizeof(header));
+	if(memcmp(header.Magic, FILE_MAGIC, sizeof(FILE_MAGIC)) != 0 ||
+	   header.Length != _iSize - sizeof(header) ||
+	   header.Check != Checksum(_pData + sizeof(header), header.Length))
+	{
+		munmap(const_cast<char*>(_pData), _iSize);
+		_pData = NULL;
+		throw std::runtime_error(path + " is not a good snapshot");
+	}
+
+	_pNext = _pData + sizeof(header);
+	_pEnd = _pData + _iSize;
+}
+
+SnapshotReader::SnapshotReader(const char* body, size_t length)
+	: _pData(body), _iSize(length), _bMapped(false), _pNext(body), _pEnd(body + length)
+{
+}
+
+SnapshotReader::~SnapshotReader()
+{
+	if(_bMapped)
+	{
+		munmap(const_cast<char*>(_pData), _iSize);
+	}
+}
+
+bool SnapshotReader::IsOpen() const
+{
+	return _pData != NULL;
+}
+
+bool SnapshotReader::GetNumber(uint32_t& number)
+{
+	if(static_cast<size_t>(_pEnd - _pNext) < sizeof(number))
+	{
+		return false;
+	}
+	memcpy(&number, _pNext, sizeof(number));
+	_pNext += sizeof(number);
+	return true;
+}
+
+bool SnapshotReader::GetString(string_view& str)
+{
+	uint32_t length;
+	if(!GetNumber(length) || static_cast<size_t>(_pEnd - _pNext) < length)
+	{
+		return false;
+	}
+	str = string_view(_pNext, length);
+	_pNext += length;
+	return true;
+}
+
+bool SnapshotReader::AtEnd() const
+{
+	return _pNext == _pEnd;
+}
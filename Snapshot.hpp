@@ -0,0 +1,79 @@
+#ifndef SNAPSHOT_HPP
+#define SNAPSHOT_HPP
+
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <cstddef>
+
+namespace ChatServer
+{
+
+/**
+	Builds a snapshot file: a header (magic, checksum, length) followed by
+	a body of little fixed-width numbers and length-prefixed strings, in
+	whatever order the caller puts them - the reader has to take them out
+	in the same order.
+**/
+class SnapshotWriter
+{
+private:
+	std::string _strBody;
+
+public:
+	void PutNumber(uint32_t number);
+	void PutString(std::string_view str);
+
+	/** Everything put so far (for sending somewhere other than a file) **/
+	const std::string& Body() const;
+
+	/**
+	Writes the snapshot to 'path', atomically: it goes to a temporary file
+	first, which is synced and then renamed over the old one.  Throws
+	std::runtime_error if that doesn't work out.
+	**/
+	void Save(const std::string& path) const;
+};
+
+/**
+	Reads back what a SnapshotWriter saved.  The file is mapped rather than
+	read, and the strings handed out point straight into the mapping, so
+	they're good for as long as the reader is around.  Every read is
+	bounds-checked: a short or corrupt file makes a Get*() fail rather than
+	read off the end.
+**/
+class SnapshotReader
+{
+private:
+	const char* _pData; // The mapping (NULL if there isn't one)
+	size_t _iSize;
+	bool _bMapped; // Whether _pData is ours to unmap
+	const char* _pNext; // Next thing to read, in the body
+	const char* _pEnd; // End of the body
+
+	SnapshotReader(const SnapshotReader&);
+	SnapshotReader& operator=(const SnapshotReader&);
+
+public:
+	/**
+	Maps the snapshot; IsOpen() says whether there was one.  Throws
+	std::runtime_error if there's a file, but it isn't a good snapshot.
+	**/
+	SnapshotReader(const std::string& path);
+
+	/** Reads a body that's already in memory (see SnapshotWriter::Body()) **/
+	SnapshotReader(const char* body, size_t length);
+	~SnapshotReader();
+
+	bool IsOpen() const;
+
+	bool GetNumber(uint32_t& number);
+	bool GetString(std::string_view& str);
+
+	/** True once everything's been read **/
+	bool AtEnd() const;
+};
+
+}
+
+#endif
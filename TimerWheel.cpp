@@ -0,0 +1,200 @@
+#include "TimerWheel.hpp"
+
+using std::chrono::milliseconds;
+using std::chrono::duration_cast;
+using std::chrono::steady_clock;
+
+using ChatServer::TimerWheel;
+
+TimerWheel::Timer::Timer(std::function<void()> callback)
+	: _iExpires(0), _fnCallback(callback)
+{
+}
+
+TimerWheel::Timer::~Timer()
+{
+	// Owners should Cancel() first, but never leave a dangling link behind
+	TimerWheel::Unlink(*this);
+}
+
+bool TimerWheel::Timer::IsScheduled() const
+{
+	return Next != this;
+}
+
+TimerWheel::TimerWheel(milliseconds tick)
+	: _tick(tick), _tStart(steady_clock::now()), _iNow(0), _iCount(0)
+{
+}
+
+void TimerWheel::Schedule(Timer& timer, milliseconds delay)
+{
+	uint64_t ticks = (delay.count() + _tick.count() - 1) / _tick.count();
+
+	// The wheel may not have been advanced for a while (the loop sleeps until
+	// the next timer), so measure from the real time, not from _iNow.  The
+	// current tick is already partly gone, so count from the end of it - a
+	// timer may fire up to a tick late, but never early.
+	uint64_t current = ElapsedTicks(steady_clock::now());
+	if(current < _iNow)
+	{
+		current = _iNow;
+	}
+
+	Cancel(timer);
+	timer._iExpires = current + 1 + ticks;
+	Place(timer);
+	++_iCount;
+}
+
+void TimerWheel::Cancel(Timer& timer)
+{
+	if(timer.IsScheduled())
+	{
+		Unlink(timer);
+		--_iCount;
+	}
+}
+
+void TimerWheel::Advance(steady_clock::time_point now)
+{
+	uint64_t target = ElapsedTicks(now);
+	if(_iCount == 0 && _iNow < target)
+	{
+		// Nothing to fire or cascade, so there's no need to go a tick at a
+		// time - a fine wheel left idle for hours would take a while
+		_iNow = target;
+		return;
+	}
+	while(_iNow < target)
+	{
+		Tick();
+	}
+}
+
+int TimerWheel::NextTimeout(steady_clock::time_point now) const
+{
+	if(_iCount == 0)
+	{
+		return -1;
+	}
+
+	// The next tick that does anything is either one with something due on
+	// level 0, or the next cascade (when level 0 wraps around).
+	uint64_t next = _iNow + 1;
+	while((next & MASK) != 0)
+	{
+		const Link& slot = _aSlots[0][next & MASK];
+		if(slot.Next != &slot)
+		{
+			break;
+		}
+		++next;
+	}
+
+	auto due = _tStart + _tick * next;
+	if(due <= now)
+	{
+		return 0;
+	}
+
+	// Round up, so we don't wake a hair early and go straight back to sleep
+	auto wait = std::chrono::duration_cast<milliseconds>(due - now) + milliseconds(1);
+	return static_cast<int>(wait.count());
+}
+
+uint64_t TimerWheel::ElapsedTicks(steady_clock::time_point now) const
+{
+	return duration_cast<milliseconds>(now - _tStart) / _tick;
+}
+
+void TimerWheel::Place(Timer& timer)
+{
+	if(timer._iExpires < _iNow)
+	{
+		timer._iExpires = _iNow;
+	}
+
+	// Find the finest level whose range reaches the expiry time
+	uint64_t delta = timer._iExpires - _iNow;
+	int level = 0;
+	while(level < LEVELS - 1 && delta >= (1ULL << (BITS * (level + 1))))
+	{
+		++level;
+	}
+
+	// Anything past the end of the top level waits as long as it can
+	if(delta >= (1ULL << (BITS * LEVELS)))
+	{
+		timer._iExpires = _iNow + (1ULL << (BITS * LEVELS)) - 1;
+	}
+
+	Link& head = _aSlots[level][(timer._iExpires >> (BITS * level)) & MASK];
+	timer.Prev = head.Prev;
+	timer.Next = &head;
+	head.Prev->Next = &timer;
+	head.Prev = &timer;
+}
+
+void TimerWheel::Unlink(Link& link)
+{
+	link.Prev->Next = link.Next;
+	link.Next->Prev = link.Prev;
+	link.Prev = &link;
+	link.Next = &link;
+}
+
+void TimerWheel::Tick()
+{
+	++_iNow;
+	uint64_t slot = _iNow & MASK;
+
+	// Level 0 wrapped, so the next slot up is now within reach
+	if(slot == 0)
+	{
+		for(int level = 1; level < LEVELS; ++level)
+		{
+			uint64_t upper = (_iNow >> (BITS * level)) & MASK;
+			Cascade(level, upper);
+			if(upper != 0)
+			{
+				break;
+			}
+		}
+	}
+
+	// Move the due timers out first: a callback can cancel or reschedule
+	// other timers (or itself) without upsetting the list we're walking.
+	Link& head = _aSlots[0][slot];
+	if(head.Next == &head)
+	{
+		return;
+	}
+
+	Link due;
+	due.Next = head.Next;
+	due.Prev = head.Prev;
+	due.Next->Prev = &due;
+	due.Prev->Next = &due;
+	head.Next = &head;
+	head.Prev = &head;
+
+	while(due.Next != &due)
+	{
+		Timer* timer = static_cast<Timer*>(due.Next);
+		Unlink(*timer);
+		--_iCount;
+		timer->_fnCallback();
+	}
+}
+
+void TimerWheel::Cascade(int level, uint64_t slot)
+{
+	Link& head = _aSlots[level][slot];
+	while(head.Next != &head)
+	{
+		Timer* timer = static_cast<Timer*>(head.Next);
+		Unlink(*timer);
+		Place(*timer);
+	}
+}
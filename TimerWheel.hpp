@@ -0,0 +1,99 @@
+#ifndef TIMER_WHEEL_HPP
+#define TIMER_WHEEL_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+
+namespace ChatServer
+{
+
+/**
+	A hierarchical timing wheel: LEVELS wheels of SLOTS slots each, where a
+	slot on level N covers SLOTS^N ticks.  Timers far in the future sit in a
+	coarse slot and get moved ("cascaded") down a level as their time gets
+	closer, so scheduling, cancelling and firing are all O(1) no matter how
+	many timers there are.
+
+	Timers are intrusive - the owner embeds a TimerWheel::Timer, and the wheel
+	never allocates.  Not thread-safe: each EventLoop has its own wheel.
+**/
+class TimerWheel
+{
+public:
+	/** Links a timer into a slot's list (or a slot's list head) **/
+	struct Link
+	{
+		Link* Prev;
+		Link* Next;
+
+		Link() : Prev(this), Next(this) {}
+	};
+
+	/** One scheduled callback.  Embed it in whatever it's a timer for. **/
+	class Timer : private Link
+	{
+		friend class TimerWheel;
+
+		uint64_t _iExpires; // Tick this timer is due on
+		std::function<void()> _fnCallback; // Run (once) when it comes due
+
+		Timer(const Timer&);
+		Timer& operator=(const Timer&);
+
+	public:
+		Timer(std::function<void()> callback);
+		~Timer();
+
+		/** True if the timer is waiting to fire **/
+		bool IsScheduled() const;
+	};
+
+	TimerWheel(std::chrono::milliseconds tick);
+
+	/** (Re)schedules the timer to fire after 'delay' - never sooner, at most a tick later **/
+	void Schedule(Timer& timer, std::chrono::milliseconds delay);
+
+	/** Stops the timer from firing; harmless if it isn't scheduled **/
+	void Cancel(Timer& timer);
+
+	/** Fires everything that has come due by 'now' **/
+	void Advance(std::chrono::steady_clock::time_point now);
+
+	/**
+	How long (ms) until the wheel next needs advancing, for epoll_wait(); -1
+	if nothing is scheduled at all.
+	**/
+	int NextTimeout(std::chrono::steady_clock::time_point now) const;
+
+private:
+	static const int BITS = 6;
+	static const uint64_t SLOTS = 1 << BITS; // Slots per level
+	static const uint64_t MASK = SLOTS - 1;
+	static const int LEVELS = 4; // 64^4 ticks - a long way off at 1s a tick
+
+	std::chrono::milliseconds _tick; // Length of one tick
+	std::chrono::steady_clock::time_point _tStart; // When tick 0 began
+	uint64_t _iNow; // Ticks processed so far
+	size_t _iCount; // Timers currently scheduled
+	Link _aSlots[LEVELS][SLOTS];
+
+	/** Whole ticks between _tStart and 'now' **/
+	uint64_t ElapsedTicks(std::chrono::steady_clock::time_point now) const;
+
+	/** Puts the timer in the right slot for its expiry time **/
+	void Place(Timer& timer);
+
+	/** Takes the timer out of whatever slot it's in **/
+	static void Unlink(Link& link);
+
+	/** Moves one tick forward, cascading and firing as needed **/
+	void Tick();
+
+	/** Re-places every timer in the given slot, now that it's closer **/
+	void Cascade(int level, uint64_t slot);
+};
+
+}
+
+#endif
@@ -0,0 +1,739 @@
+/**
+	Load generator for chatd.  Opens a crowd of loopback clients that log in,
+	join rooms and then chat, whisper and ask /who at the configured rates,
+	and reports throughput plus latency percentiles:
+
+	  fan-out  - from a room message being sent to each member receiving it
+	  /msg     - from a whisper being sent to its target receiving it
+	  /who     - from sending /who to the end of the reply
+
+	Every message carries its send time, so latency is measured end to end
+	through the server with no clock sync needed (it's all one process).
+
+	Usage: chatbench [options]   (see --help)
+**/
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <deque>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstdint>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h> // for strerror, memchr
+
+using std::cout;
+using std::cerr;
+using std::endl;
+using std::vector;
+using std::deque;
+using std::string;
+using std::thread;
+using std::atomic;
+using std::chrono::steady_clock;
+using std::chrono::duration_cast;
+using std::chrono::nanoseconds;
+using std::chrono::milliseconds;
+
+struct Options
+{
+	string Host = "127.0.0.1";
+	string Port = "4919";
+	int Clients = 1000;
+	int Rooms = 10;
+	int Threads = 4;
+	int Seconds = 10; // Measured run time
+	int Warmup = 2; // Unmeasured run time before that
+	double ChatRate = 1000; // Room messages per second, all clients together
+	double MsgRate = 100; // Whispers per second
+	double WhoRate = 10; // /who requests per second
+	int Payload = 64; // Bytes of chatter per message
+	string Prefix = "bench"; // User/room names start with this (letters only)
+};
+
+enum Phase { CONNECTING, WARMUP, MEASURING, DONE };
+
+const int LOGIN_STALL_SECONDS = 10; // Give up if no one gets in for this long
+
+static atomic<int> g_phase(CONNECTING);
+static const steady_clock::time_point g_epoch = steady_clock::now();
+
+static uint64_t NowNs()
+{
+	return duration_cast<nanoseconds>(steady_clock::now() - g_epoch).count();
+}
+
+/**
+	Log-linear latency histogram (in microseconds): 32 buckets per power of
+	two, so every percentile is within ~3% - fixed size no matter how many
+	samples go in, and cheap to merge across threads.
+**/
+class Histogram
+{
+	static const int SUB_BITS = 5;
+	static const uint64_t SUB = 1 << SUB_BITS;
+
+	vector<uint64_t> _vCounts;
+	uint64_t _iTotal;
+	uint64_t _iMax;
+
+	static size_t Index(uint64_t v)
+	{
+		if(v < SUB)
+		{
+			return v;
+		}
+		int shift = 63 - __builtin_clzll(v) - SUB_BITS;
+		return (shift + 1) * SUB + ((v >> shift) & (SUB - 1));
+	}
+
+	static uint64_t Value(size_t index)
+	{
+		if(index < SUB)
+		{
+			return index;
+		}
+		int shift = index / SUB - 1;
+		return (SUB + index % SUB) << shift;
+	}
+
+public:
+	Histogram() : _vCounts(64 * SUB, 0), _iTotal(0), _iMax(0) {}
+
+	void Record(uint64_t us)
+	{
+		++_vCounts[Index(us)];
+		++_iTotal;
+		_iMax = std::max(_iMax, us);
+	}
+
+	void Merge(const Histogram& other)
+	{
+		for(size_t i = 0; i < _vCounts.size(); ++i)
+		{
+			_vCounts[i] += other._vCounts[i];
+		}
+		_iTotal += other._iTotal;
+		_iMax = std::max(_iMax, other._iMax);
+	}
+
+	uint64_t Count() const { return _iTotal; }
+	uint64_t Max() const { return _iMax; }
+
+	/** Smallest value that 'fraction' of the samples are at or below **/
+	uint64_t Percentile(double fraction) const
+	{
+		uint64_t wanted = static_cast<uint64_t>(fraction * _iTotal + 0.5);
+		uint64_t seen = 0;
+		for(size_t i = 0; i < _vCounts.size(); ++i)
+		{
+			seen += _vCounts[i];
+			if(seen >= wanted && seen > 0)
+			{
+				return std::min(Value(i), _iMax);
+			}
+		}
+		return _iMax;
+	}
+};
+
+/** What one worker saw; summed up at the end **/
+struct Stats
+{
+	uint64_t ChatSent = 0;
+	uint64_t MsgSent = 0;
+	uint64_t WhoSent = 0;
+	uint64_t LinesReceived = 0;
+	uint64_t BytesReceived = 0;
+	uint64_t Disconnects = 0;
+	Histogram FanOut;
+	Histogram Whisper;
+	Histogram Who;
+
+	void Merge(const Stats& other)
+	{
+		ChatSent += other.ChatSent;
+		MsgSent += other.MsgSent;
+		WhoSent += other.WhoSent;
+		LinesReceived += other.LinesReceived;
+		BytesReceived += other.BytesReceived;
+		Disconnects += other.Disconnects;
+		FanOut.Merge(other.FanOut);
+		Whisper.Merge(other.Whisper);
+		Who.Merge(other.Who);
+	}
+};
+
+/** Letters-only names, since that's all chatd allows: bench + aaaaa, aaaab... **/
+static string UserName(const Options& opt, int index)
+{
+	string suffix(5, 'a');
+	for(int i = 4; i >= 0; --i, index /= 26)
+	{
+		suffix[i] = 'a' + index % 26;
+	}
+	return opt.Prefix + suffix;
+}
+
+static string RoomName(const Options& opt, int index)
+{
+	return opt.Prefix + "room" + std::to_string(index);
+}
+
+class Worker
+{
+	enum State { LOGGING_IN, JOINING, READY, DEAD };
+
+	struct Client
+	{
+		int Socket;
+		int Index;
+		State Status;
+		string In; // Partial line from the last read
+		string Out; // Whatever the socket wouldn't take yet
+		deque<uint64_t> WhoSent; // Send times of unanswered /who's
+	};
+
+	const Options& _opt;
+	atomic<int>& _iReady;
+	vector<Client> _vClients;
+	int _iEpollFD;
+	std::mt19937 _rng;
+	double _dShare; // This worker's fraction of the total load
+	Stats _stats;
+	string _strPadding;
+	uint64_t _iChatTotal = 0; // Messages of each kind due so far (sent or not)
+	uint64_t _iMsgTotal = 0;
+	uint64_t _iWhoTotal = 0;
+
+	void Fail(const string& what)
+	{
+		cerr << "chatbench: " << what << endl;
+		exit(EXIT_FAILURE);
+	}
+
+	void Connect(Client& client, const addrinfo* addr)
+	{
+		client.Socket = socket(addr->ai_family, SOCK_STREAM, 0);
+		if(client.Socket < 0)
+		{
+			Fail(string("socket: ") + strerror(errno));
+		}
+		if(connect(client.Socket, addr->ai_addr, addr->ai_addrlen) != 0)
+		{
+			Fail(string("connect: ") + strerror(errno));
+		}
+		int one = 1;
+		setsockopt(client.Socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		fcntl(client.Socket, F_SETFL, fcntl(client.Socket, F_GETFL, 0) | O_NONBLOCK);
+
+		epoll_event ev;
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.u32 = &client - _vClients.data();
+		epoll_ctl(_iEpollFD, EPOLL_CTL_ADD, client.Socket, &ev);
+	}
+
+	void Close(Client& client)
+	{
+		if(client.Status == READY && g_phase.load() != DONE)
+		{
+			++_stats.Disconnects;
+		}
+		if(client.Status != READY && g_phase.load() == CONNECTING)
+		{
+			Fail("server hung up on " + UserName(_opt, client.Index) + " while logging in");
+		}
+		close(client.Socket);
+		client.Status = DEAD;
+	}
+
+	void Send(Client& client, const string& line)
+	{
+		if(client.Status == DEAD)
+		{
+			return;
+		}
+		client.Out += line;
+		Flush(client);
+	}
+
+	void Flush(Client& client)
+	{
+		size_t sent = 0;
+		while(sent < client.Out.size())
+		{
+			ssize_t n = send(client.Socket, client.Out.data() + sent, client.Out.size() - sent, MSG_NOSIGNAL);
+			if(n < 0)
+			{
+				if(errno != EAGAIN && errno != EWOULDBLOCK)
+				{
+					Close(client);
+				}
+				break;
+			}
+			sent += n;
+		}
+		client.Out.erase(0, sent);
+	}
+
+	void Read(Client& client)
+	{
+		char buffer[16384];
+		while(client.Status != DEAD)
+		{
+			ssize_t n = recv(client.Socket, buffer, sizeof(buffer), 0);
+			if(n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+			{
+				Close(client);
+				return;
+			}
+			if(n < 0)
+			{
+				return;
+			}
+			if(g_phase.load() == MEASURING)
+			{
+				_stats.BytesReceived += n;
+			}
+
+			client.In.append(buffer, n);
+			size_t start = 0, end;
+			while((end = client.In.find('\n', start)) != string::npos)
+			{
+				HandleLine(client, client.In.data() + start, end - start);
+				start = end + 1;
+			}
+			client.In.erase(0, start);
+		}
+	}
+
+	/** Pulls the send time out of a "... t=<ns> xxxx" line; 0 if there isn't one **/
+	static uint64_t SentAt(const char* line, size_t length)
+	{
+		static const char TAG[] = ": t=";
+		const char* end = line + length;
+		const char* tag = std::search(line, end, TAG, TAG + sizeof(TAG) - 1);
+		if(tag == end)
+		{
+			return 0;
+		}
+		return strtoull(tag + sizeof(TAG) - 1, NULL, 10);
+	}
+
+	static bool StartsWith(const char* line, size_t length, const char* prefix)
+	{
+		size_t n = strlen(prefix);
+		return length >= n && memcmp(line, prefix, n) == 0;
+	}
+
+	void HandleLine(Client& client, const char* line, size_t length)
+	{
+		bool measuring = g_phase.load() == MEASURING;
+		if(measuring)
+		{
+			++_stats.LinesReceived;
+		}
+
+		switch(client.Status)
+		{
+			case LOGGING_IN:
+				if(StartsWith(line, length, "Login Name?"))
+				{
+					Send(client, UserName(_opt, client.Index) + "\n");
+				}
+				else if(StartsWith(line, length, "Welcome, "))
+				{
+					client.Status = JOINING;
+					Send(client, "/join " + RoomName(_opt, client.Index % _opt.Rooms) + "\n");
+				}
+				else if(StartsWith(line, length, "That name is taken"))
+				{
+					Fail(UserName(_opt, client.Index) + " is already logged in - try another --prefix");
+				}
+				return;
+			case JOINING:
+				if(StartsWith(line, length, "entering room: "))
+				{
+					client.Status = READY;
+					++_iReady;
+				}
+				return;
+			default:
+				break;
+		}
+
+		if(!measuring)
+		{
+			return;
+		}
+
+		uint64_t now = NowNs();
+		if(line[0] == '[')
+		{
+			uint64_t sent = SentAt(line, length);
+			if(sent != 0)
+			{
+				_stats.FanOut.Record((now - sent) / 1000);
+			}
+		}
+		else if(StartsWith(line, length, "end of list"))
+		{
+			if(!client.WhoSent.empty())
+			{
+				_stats.Who.Record((now - client.WhoSent.front()) / 1000);
+				client.WhoSent.pop_front();
+			}
+		}
+		else if(!StartsWith(line, length, "You whisper"))
+		{
+			uint64_t sent = SentAt(line, length);
+			if(sent != 0)
+			{
+				_stats.Whisper.Record((now - sent) / 1000);
+			}
+		}
+	}
+
+	/** A random client that's ready to talk, or NULL if there aren't any **/
+	Client* Pick()
+	{
+		std::uniform_int_distribution<size_t> any(0, _vClients.size() - 1);
+		for(int tries = 0; tries < 8; ++tries)
+		{
+			Client& client = _vClients[any(_rng)];
+			if(client.Status == READY)
+			{
+				return &client;
+			}
+		}
+		return NULL;
+	}
+
+	string Stamp()
+	{
+		return "t=" + std::to_string(NowNs()) + " " + _strPadding + "\n";
+	}
+
+	/** Sends whatever's come due since the load started, at each rate **/
+	void Generate(double elapsed)
+	{
+		bool measuring = g_phase.load() == MEASURING;
+		std::uniform_int_distribution<int> anyUser(0, _opt.Clients - 1);
+
+		uint64_t chatDue = static_cast<uint64_t>(elapsed * _opt.ChatRate * _dShare);
+		for(; _iChatTotal < chatDue; ++_iChatTotal)
+		{
+			Client* client = Pick();
+			if(client != NULL)
+			{
+				Send(*client, Stamp());
+				_stats.ChatSent += measuring;
+			}
+		}
+
+		uint64_t msgDue = static_cast<uint64_t>(elapsed * _opt.MsgRate * _dShare);
+		for(; _iMsgTotal < msgDue; ++_iMsgTotal)
+		{
+			Client* client = Pick();
+			int target = anyUser(_rng);
+			if(client != NULL && target != client->Index)
+			{
+				Send(*client, "/msg " + UserName(_opt, target) + " " + Stamp());
+				_stats.MsgSent += measuring;
+			}
+		}
+
+		uint64_t whoDue = static_cast<uint64_t>(elapsed * _opt.WhoRate * _dShare);
+		for(; _iWhoTotal < whoDue; ++_iWhoTotal)
+		{
+			Client* client = Pick();
+			if(client != NULL)
+			{
+				if(measuring)
+				{
+					client->WhoSent.push_back(NowNs());
+					++_stats.WhoSent;
+				}
+				Send(*client, "/who\n");
+			}
+		}
+	}
+
+public:
+	Worker(const Options& opt, atomic<int>& ready, int first, int count, int seed)
+		: _opt(opt), _iReady(ready), _vClients(count), _iEpollFD(epoll_create1(0)),
+		  _rng(seed), _dShare(static_cast<double>(count) / opt.Clients),
+		  _strPadding(std::max(opt.Payload, 1), 'x')
+	{
+		for(int i = 0; i < count; ++i)
+		{
+			_vClients[i].Index = first + i;
+			_vClients[i].Status = LOGGING_IN;
+		}
+	}
+
+	void Run(const addrinfo* addr)
+	{
+		for(auto& client: _vClients)
+		{
+			Connect(client, addr);
+		}
+
+		epoll_event events[256];
+		steady_clock::time_point loadStart;
+		bool loading = false;
+		while(g_phase.load() != DONE)
+		{
+			int n = epoll_wait(_iEpollFD, events, 256, 1);
+			for(int i = 0; i < n; ++i)
+			{
+				Client& client = _vClients[events[i].data.u32];
+				if(events[i].events & EPOLLOUT)
+				{
+					Flush(client);
+				}
+				if(events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+				{
+					Read(client);
+				}
+			}
+
+			if(g_phase.load() == CONNECTING)
+			{
+				continue;
+			}
+			if(!loading)
+			{
+				loading = true;
+				loadStart = steady_clock::now();
+			}
+			Generate(duration_cast<nanoseconds>(steady_clock::now() - loadStart).count() / 1e9);
+		}
+
+		for(auto& client: _vClients)
+		{
+			if(client.Status != DEAD)
+			{
+				close(client.Socket);
+			}
+		}
+		close(_iEpollFD);
+	}
+
+	const Stats& GetStats() const { return _stats; }
+};
+
+static void usage(const char* prog)
+{
+	cerr << "Usage: " << prog << " [options]" << endl;
+	cerr << "  -H, --host=HOST        server to hammer (default 127.0.0.1)" << endl;
+	cerr << "  -p, --port=PORT        its port (default 4919)" << endl;
+	cerr << "  -c, --clients=N        connections to open (default 1000)" << endl;
+	cerr << "  -r, --rooms=N          rooms to spread them over (default 10)" << endl;
+	cerr << "  -t, --threads=N        client threads (default 4)" << endl;
+	cerr << "  -d, --duration=SECS    measured run time (default 10)" << endl;
+	cerr << "  -w, --warmup=SECS      unmeasured load before that (default 2)" << endl;
+	cerr << "      --chat-rate=N      room messages per second, in total (default 1000)" << endl;
+	cerr << "      --msg-rate=N       /msg whispers per second (default 100)" << endl;
+	cerr << "      --who-rate=N       /who requests per second (default 10)" << endl;
+	cerr << "      --payload=BYTES    chatter per message (default 64)" << endl;
+	cerr << "      --prefix=NAME      user and room name prefix, letters only (default bench)" << endl;
+	exit(EXIT_FAILURE);
+}
+
+static int parse_int(const char* arg, const char* prog, int min)
+{
+	char* end = NULL;
+	long value = strtol(arg, &end, 10);
+	if(end == arg || *end != '\0' || value < min)
+	{
+		usage(prog);
+	}
+	return static_cast<int>(value);
+}
+
+static double parse_rate(const char* arg, const char* prog)
+{
+	char* end = NULL;
+	double value = strtod(arg, &end);
+	if(end == arg || *end != '\0' || value < 0)
+	{
+		usage(prog);
+	}
+	return value;
+}
+
+static void parse_args(int argc, char** argv, Options& opt)
+{
+	enum { OPT_CHAT_RATE = 256, OPT_MSG_RATE, OPT_WHO_RATE, OPT_PAYLOAD, OPT_PREFIX };
+	static const struct option options[] = {
+		{ "host",      required_argument, NULL, 'H' },
+		{ "port",      required_argument, NULL, 'p' },
+		{ "clients",   required_argument, NULL, 'c' },
+		{ "rooms",     required_argument, NULL, 'r' },
+		{ "threads",   required_argument, NULL, 't' },
+		{ "duration",  required_argument, NULL, 'd' },
+		{ "warmup",    required_argument, NULL, 'w' },
+		{ "chat-rate", required_argument, NULL, OPT_CHAT_RATE },
+		{ "msg-rate",  required_argument, NULL, OPT_MSG_RATE },
+		{ "who-rate",  required_argument, NULL, OPT_WHO_RATE },
+		{ "payload",   required_argument, NULL, OPT_PAYLOAD },
+		{ "prefix",    required_argument, NULL, OPT_PREFIX },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	int o;
+	while((o = getopt_long(argc, argv, "H:p:c:r:t:d:w:", options, NULL)) != -1)
+	{
+		switch(o)
+		{
+			case 'H': opt.Host = optarg; break;
+			case 'p': opt.Port = optarg; break;
+			case 'c': opt.Clients = parse_int(optarg, argv[0], 2); break;
+			case 'r': opt.Rooms = parse_int(optarg, argv[0], 1); break;
+			case 't': opt.Threads = parse_int(optarg, argv[0], 1); break;
+			case 'd': opt.Seconds = parse_int(optarg, argv[0], 1); break;
+			case 'w': opt.Warmup = parse_int(optarg, argv[0], 0); break;
+			case OPT_CHAT_RATE: opt.ChatRate = parse_rate(optarg, argv[0]); break;
+			case OPT_MSG_RATE: opt.MsgRate = parse_rate(optarg, argv[0]); break;
+			case OPT_WHO_RATE: opt.WhoRate = parse_rate(optarg, argv[0]); break;
+			case OPT_PAYLOAD: opt.Payload = parse_int(optarg, argv[0], 1); break;
+			case OPT_PREFIX: opt.Prefix = optarg; break;
+			default: usage(argv[0]);
+		}
+	}
+
+	// Keep lines under chatd's 1024 byte limit, and names under its 30
+	if(opt.Payload > 900 || opt.Prefix.empty() || opt.Prefix.length() > 20 ||
+	   !std::all_of(opt.Prefix.begin(), opt.Prefix.end(), ::isalpha) ||
+	   opt.Clients > 26 * 26 * 26 * 26 * 26)
+	{
+		usage(argv[0]);
+	}
+	opt.Threads = std::min(opt.Threads, opt.Clients);
+}
+
+static void PrintLatency(const char* name, const Histogram& h)
+{
+	cout << "  " << std::left << std::setw(9) << name << std::right;
+	if(h.Count() == 0)
+	{
+		cout << "no samples" << endl;
+		return;
+	}
+	cout << "p50 " << std::setw(8) << h.Percentile(0.50) << "us"
+	     << "  p99 " << std::setw(8) << h.Percentile(0.99) << "us"
+	     << "  p999 " << std::setw(8) << h.Percentile(0.999) << "us"
+	     << "  max " << std::setw(8) << h.Max() << "us"
+	     << "  (" << h.Count() << " samples)" << endl;
+}
+
+int main(int argc, char** argv)
+{
+	Options opt;
+	parse_args(argc, argv, opt);
+
+	// Thousands of sockets won't fit under the usual soft limit
+	struct rlimit files;
+	if(getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max)
+	{
+		files.rlim_cur = files.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &files);
+	}
+
+	addrinfo hints = {};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	addrinfo* addr = NULL;
+	int err = getaddrinfo(opt.Host.c_str(), opt.Port.c_str(), &hints, &addr);
+	if(err != 0)
+	{
+		cerr << "chatbench: " << opt.Host << ": " << gai_strerror(err) << endl;
+		return EXIT_FAILURE;
+	}
+
+	atomic<int> ready(0);
+	vector<Worker*> workers;
+	vector<thread> threads;
+	int first = 0;
+	for(int i = 0; i < opt.Threads; ++i)
+	{
+		int count = opt.Clients / opt.Threads + (i < opt.Clients % opt.Threads);
+		workers.push_back(new Worker(opt, ready, first, count, 4919 + i));
+		first += count;
+	}
+
+	auto start = steady_clock::now();
+	for(auto worker: workers)
+	{
+		threads.push_back(thread(&Worker::Run, worker, addr));
+	}
+
+	// Give up if logins stop making progress, rather than waiting forever
+	int lastReady = 0;
+	auto lastProgress = steady_clock::now();
+	while(ready.load() < opt.Clients)
+	{
+		std::this_thread::sleep_for(milliseconds(10));
+		if(ready.load() != lastReady)
+		{
+			lastReady = ready.load();
+			lastProgress = steady_clock::now();
+		}
+		else if(steady_clock::now() - lastProgress > std::chrono::seconds(LOGIN_STALL_SECONDS))
+		{
+			cerr << "chatbench: only " << lastReady << " of " << opt.Clients 
+			     << " clients got logged in" << endl;
+			exit(EXIT_FAILURE);
+		}
+	}
+	double setup = duration_cast<milliseconds>(steady_clock::now() - start).count() / 1000.0;
+	cout << opt.Clients << " clients logged in and joined " << opt.Rooms << " rooms in "
+	     << std::fixed << std::setprecision(2) << setup << "s" << endl;
+
+	g_phase = WARMUP;
+	std::this_thread::sleep_for(std::chrono::seconds(opt.Warmup));
+	g_phase = MEASURING;
+	auto measureStart = steady_clock::now();
+	std::this_thread::sleep_for(std::chrono::seconds(opt.Seconds));
+	double elapsed = duration_cast<nanoseconds>(steady_clock::now() - measureStart).count() / 1e9;
+	g_phase = DONE;
+
+	Stats total;
+	for(size_t i = 0; i < workers.size(); ++i)
+	{
+		threads[i].join();
+		total.Merge(workers[i]->GetStats());
+		delete workers[i];
+	}
+	freeaddrinfo(addr);
+
+	cout << "over " << elapsed << "s:" << endl;
+	cout << "  sent     " << total.ChatSent / elapsed << " chat/s, "
+	     << total.MsgSent / elapsed << " msg/s, " << total.WhoSent / elapsed << " who/s" << endl;
+	cout << "  received " << total.LinesReceived / elapsed << " lines/s, "
+	     << total.BytesReceived / elapsed / (1024.0 * 1024.0) << " MB/s" << endl;
+	if(total.Disconnects > 0)
+	{
+		cout << "  " << total.Disconnects << " clients were disconnected" << endl;
+	}
+	cout << "latency (send to receipt):" << endl;
+	PrintLatency("fan-out", total.FanOut);
+	PrintLatency("/msg", total.Whisper);
+	PrintLatency("/who", total.Who);
+	return total.Disconnects > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,479 @@
+/**
+	Disconnect-heavy load for chatd.  A room full of listeners stays put
+	while churn threads keep connecting, logging in, joining that room,
+	whispering to someone who's just left, and dropping the connection -
+	half of them politely (FIN), half rudely (RST) - as fast as they can.
+	That's the reconnect-storm path: every cycle is a login, a join and a
+	leave broadcast to the whole room, a failed lookup, and a disconnect.
+
+	Reports cycles per second and cycle latency and, given the server's pid,
+	how much CPU the server spent per thousand cycles.
+
+	Usage: churnbench [options]   (see --help)
+**/
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstdint>
+#include <unistd.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h> // for strerror
+
+using std::cout;
+using std::cerr;
+using std::endl;
+using std::vector;
+using std::string;
+using std::thread;
+using std::atomic;
+using std::chrono::steady_clock;
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::nanoseconds;
+
+struct Options
+{
+	string Host = "127.0.0.1";
+	string Port = "4919";
+	int Listeners = 200; // Clients sitting in the room the whole time
+	int Threads = 8; // Churning connections, one at a time each
+	int Seconds = 10;
+	int ServerPid = 0; // For measuring the server's CPU time (0 to skip)
+	string Prefix = "churn"; // User/room names start with this (letters only)
+};
+
+const int REPLY_TIMEOUT_MS = 5000; // Longest to wait for the server to answer
+
+static atomic<bool> g_done(false);
+
+/** Latency histogram (in microseconds): 16 buckets per power of two **/
+class Histogram
+{
+	static const int SUB_BITS = 4;
+	static const uint64_t SUB = 1 << SUB_BITS;
+
+	vector<uint64_t> _vCounts;
+	uint64_t _iTotal;
+	uint64_t _iMax;
+
+	static size_t Index(uint64_t v)
+	{
+		if(v < SUB)
+		{
+			return v;
+		}
+		int shift = 63 - __builtin_clzll(v) - SUB_BITS;
+		return (shift + 1) * SUB + ((v >> shift) & (SUB - 1));
+	}
+
+	static uint64_t Value(size_t index)
+	{
+		if(index < SUB)
+		{
+			return index;
+		}
+		int shift = index / SUB - 1;
+		return (SUB + index % SUB) << shift;
+	}
+
+public:
+	Histogram() : _vCounts(64 * SUB, 0), _iTotal(0), _iMax(0) {}
+
+	void Record(uint64_t us)
+	{
+		++_vCounts[Index(us)];
+		++_iTotal;
+		_iMax = std::max(_iMax, us);
+	}
+
+	void Merge(const Histogram& other)
+	{
+		for(size_t i = 0; i < _vCounts.size(); ++i)
+		{
+			_vCounts[i] += other._vCounts[i];
+		}
+		_iTotal += other._iTotal;
+		_iMax = std::max(_iMax, other._iMax);
+	}
+
+	uint64_t Count() const { return _iTotal; }
+	uint64_t Max() const { return _iMax; }
+
+	/** Smallest value that 'fraction' of the samples are at or below **/
+	uint64_t Percentile(double fraction) const
+	{
+		uint64_t wanted = static_cast<uint64_t>(fraction * _iTotal + 0.5);
+		uint64_t seen = 0;
+		for(size_t i = 0; i < _vCounts.size(); ++i)
+		{
+			seen += _vCounts[i];
+			if(seen >= wanted && seen > 0)
+			{
+				return std::min(Value(i), _iMax);
+			}
+		}
+		return _iMax;
+	}
+};
+
+/** Letters-only names, since that's all chatd allows: churn + aaaaa, aaaab... **/
+static string Name(const string& prefix, int index)
+{
+	string suffix(5, 'a');
+	for(int i = 4; i >= 0; --i, index /= 26)
+	{
+		suffix[i] = 'a' + index % 26;
+	}
+	return prefix + suffix;
+}
+
+static void Fail(const string& what)
+{
+	cerr << "churnbench: " << what << endl;
+	exit(EXIT_FAILURE);
+}
+
+/** A blocking connection that reads a line at a time **/
+class Connection
+{
+	int _iSocket;
+	string _strIn;
+
+public:
+	Connection(const addrinfo* addr)
+	{
+		_iSocket = socket(addr->ai_family, SOCK_STREAM, 0);
+		if(_iSocket < 0)
+		{
+			Fail(string("socket: ") + strerror(errno));
+		}
+		if(connect(_iSocket, addr->ai_addr, addr->ai_addrlen) != 0)
+		{
+			Fail(string("connect: ") + strerror(errno));
+		}
+		int one = 1;
+		setsockopt(_iSocket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+
+	~Connection()
+	{
+		if(_iSocket >= 0)
+		{
+			close(_iSocket);
+		}
+	}
+
+	int Socket() const { return _iSocket; }
+
+	void Send(const string& line)
+	{
+		if(send(_iSocket, line.data(), line.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(line.size()))
+		{
+			Fail(string("send: ") + strerror(errno));
+		}
+	}
+
+	/** Reads until a line starting with any of the prefixes turns up **/
+	void Expect(const vector<string>& prefixes)
+	{
+		while(true)
+		{
+			size_t end;
+			while((end = _strIn.find('\n')) != string::npos)
+			{
+				bool found = false;
+				for(auto& prefix: prefixes)
+				{
+					found = found || _strIn.compare(0, prefix.length(), prefix) == 0;
+				}
+				_strIn.erase(0, end + 1);
+				if(found)
+				{
+					return;
+				}
+			}
+
+			struct pollfd ready = { _iSocket, POLLIN, 0 };
+			if(poll(&ready, 1, REPLY_TIMEOUT_MS) <= 0)
+			{
+				Fail("no \"" + prefixes[0] + "\" from the server");
+			}
+			char buffer[4096];
+			ssize_t got = recv(_iSocket, buffer, sizeof(buffer), 0);
+			if(got <= 0)
+			{
+				Fail("server hung up waiting for \"" + prefixes[0] + "\"");
+			}
+			_strIn.append(buffer, got);
+		}
+	}
+
+	void Expect(const string& prefix)
+	{
+		Expect(vector<string>{ prefix });
+	}
+
+	/** Hangs up with a reset rather than a FIN **/
+	void Abort()
+	{
+		struct linger now = { 1, 0 };
+		setsockopt(_iSocket, SOL_SOCKET, SO_LINGER, &now, sizeof(now));
+		close(_iSocket);
+		_iSocket = -1;
+	}
+};
+
+/** Just keeps the listeners' sockets drained, so the room's output keeps flowing **/
+static void Listen(vector<int> sockets)
+{
+	vector<struct pollfd> fds;
+	for(int s: sockets)
+	{
+		fds.push_back({ s, POLLIN, 0 });
+	}
+	char buffer[65536];
+	while(!g_done.load())
+	{
+		if(poll(fds.data(), fds.size(), 100) <= 0)
+		{
+			continue;
+		}
+		for(auto& fd: fds)
+		{
+			if(fd.revents & POLLIN)
+			{
+				while(recv(fd.fd, buffer, sizeof(buffer), MSG_DONTWAIT) > 0);
+			}
+			if(fd.revents & (POLLHUP | POLLERR))
+			{
+				Fail("the server dropped one of the listeners");
+			}
+		}
+	}
+}
+
+/** Connects, logs in, joins, whispers to the last one to go, and leaves - over and over **/
+static void Churn(const Options& opt, const addrinfo* addr, int id, uint64_t* cycles, Histogram* latency)
+{
+	string room = opt.Prefix + "room";
+	string gone; // Whoever this thread disconnected last
+	for(int i = 0; !g_done.load(); ++i)
+	{
+		auto start = steady_clock::now();
+		string name = Name(opt.Prefix + "x", id * 100000 + i % 100000);
+		{
+			Connection c(addr);
+			c.Expect("Login Name?");
+			c.Send(name + "\n");
+			c.Expect("Welcome, ");
+			c.Send("/join " + room + "\n");
+			c.Expect("entering room: ");
+			if(!gone.empty())
+			{
+				// Usually they're gone already, but the server may not have
+				// noticed yet
+				c.Send("/msg " + gone + " are you still there?\n");
+				c.Expect({ "User '", "You whisper to ", gone + " is not here" });
+			}
+			if(i % 2 == 0)
+			{
+				c.Abort();
+			}
+		}
+		gone = name;
+		latency->Record(duration_cast<microseconds>(steady_clock::now() - start).count());
+		++*cycles;
+	}
+}
+
+/** The process's user + system CPU time, in seconds (0 if it can't be read) **/
+static double CpuSeconds(int pid)
+{
+	std::ifstream stat("/proc/" + std::to_string(pid) + "/stat");
+	string line;
+	if(pid == 0 || !std::getline(stat, line))
+	{
+		return 0;
+	}
+
+	// Fields 14 and 15, counting from after the ")" that ends the name
+	std::istringstream fields(line.substr(line.rfind(')') + 2));
+	string field;
+	unsigned long long user = 0, system = 0;
+	for(int i = 3; i <= 15 && fields >> field; ++i)
+	{
+		if(i == 14)
+		{
+			user = strtoull(field.c_str(), NULL, 10);
+		}
+		else if(i == 15)
+		{
+			system = strtoull(field.c_str(), NULL, 10);
+		}
+	}
+	return static_cast<double>(user + system) / sysconf(_SC_CLK_TCK);
+}
+
+static void usage(const char* prog)
+{
+	cerr << "Usage: " << prog << " [options]" << endl;
+	cerr << "  -H, --host=HOST        server to hammer (default 127.0.0.1)" << endl;
+	cerr << "  -p, --port=PORT        its port (default 4919)" << endl;
+	cerr << "  -l, --listeners=N      clients sitting in the room throughout (default 200)" << endl;
+	cerr << "  -t, --threads=N        churning connections at once (default 8)" << endl;
+	cerr << "  -d, --duration=SECS    run time (default 10)" << endl;
+	cerr << "      --server-pid=PID   report the server's CPU time per 1000 cycles" << endl;
+	cerr << "      --prefix=NAME      user and room name prefix, letters only (default churn)" << endl;
+	exit(EXIT_FAILURE);
+}
+
+static int parse_int(const char* arg, const char* prog, int min)
+{
+	char* end = NULL;
+	long value = strtol(arg, &end, 10);
+	if(end == arg || *end != '\0' || value < min)
+	{
+		usage(prog);
+	}
+	return static_cast<int>(value);
+}
+
+static void parse_args(int argc, char** argv, Options& opt)
+{
+	enum { OPT_SERVER_PID = 256, OPT_PREFIX };
+	static const struct option options[] = {
+		{ "host",       required_argument, NULL, 'H' },
+		{ "port",       required_argument, NULL, 'p' },
+		{ "listeners",  required_argument, NULL, 'l' },
+		{ "threads",    required_argument, NULL, 't' },
+		{ "duration",   required_argument, NULL, 'd' },
+		{ "server-pid", required_argument, NULL, OPT_SERVER_PID },
+		{ "prefix",     required_argument, NULL, OPT_PREFIX },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	int o;
+	while((o = getopt_long(argc, argv, "H:p:l:t:d:", options, NULL)) != -1)
+	{
+		switch(o)
+		{
+			case 'H': opt.Host = optarg; break;
+			case 'p': opt.Port = optarg; break;
+			case 'l': opt.Listeners = parse_int(optarg, argv[0], 0); break;
+			case 't': opt.Threads = parse_int(optarg, argv[0], 1); break;
+			case 'd': opt.Seconds = parse_int(optarg, argv[0], 1); break;
+			case OPT_SERVER_PID: opt.ServerPid = parse_int(optarg, argv[0], 1); break;
+			case OPT_PREFIX: opt.Prefix = optarg; break;
+			default: usage(argv[0]);
+		}
+	}
+
+	// Names have to stay under chatd's 30 characters
+	if(opt.Prefix.empty() || opt.Prefix.length() > 20 ||
+	   !std::all_of(opt.Prefix.begin(), opt.Prefix.end(), ::isalpha) ||
+	   opt.Listeners > 26 * 26 * 26 * 26 * 26 || opt.Threads > 100)
+	{
+		usage(argv[0]);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	Options opt;
+	parse_args(argc, argv, opt);
+
+	struct rlimit files;
+	if(getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max)
+	{
+		files.rlim_cur = files.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &files);
+	}
+
+	addrinfo hints = {};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	addrinfo* addr = NULL;
+	int err = getaddrinfo(opt.Host.c_str(), opt.Port.c_str(), &hints, &addr);
+	if(err != 0)
+	{
+		cerr << "churnbench: " << opt.Host << ": " << gai_strerror(err) << endl;
+		return EXIT_FAILURE;
+	}
+
+	// Fill the room first; everyone who churns through it gets announced to them
+	vector<Connection*> listeners;
+	vector<int> sockets;
+	for(int i = 0; i < opt.Listeners; ++i)
+	{
+		Connection* c = new Connection(addr);
+		c->Expect("Login Name?");
+		c->Send(Name(opt.Prefix, i) + "\n");
+		c->Expect("Welcome, ");
+		c->Send("/join " + opt.Prefix + "room\n");
+		c->Expect("entering room: ");
+		listeners.push_back(c);
+		sockets.push_back(c->Socket());
+	}
+	cout << opt.Listeners << " listeners in the room" << endl;
+	thread drain(Listen, sockets);
+
+	vector<uint64_t> cycles(opt.Threads, 0);
+	vector<Histogram> latency(opt.Threads);
+	vector<thread> threads;
+	double cpuBefore = CpuSeconds(opt.ServerPid);
+	auto start = steady_clock::now();
+	for(int i = 0; i < opt.Threads; ++i)
+	{
+		threads.push_back(thread(Churn, std::cref(opt), addr, i, &cycles[i], &latency[i]));
+	}
+
+	std::this_thread::sleep_for(std::chrono::seconds(opt.Seconds));
+	g_done = true;
+	for(auto& t: threads)
+	{
+		t.join();
+	}
+	double elapsed = duration_cast<nanoseconds>(steady_clock::now() - start).count() / 1e9;
+	double cpu = CpuSeconds(opt.ServerPid) - cpuBefore;
+	drain.join();
+
+	uint64_t total = 0;
+	Histogram all;
+	for(int i = 0; i < opt.Threads; ++i)
+	{
+		total += cycles[i];
+		all.Merge(latency[i]);
+	}
+	for(auto c: listeners)
+	{
+		delete c;
+	}
+	freeaddrinfo(addr);
+
+	cout << std::fixed << std::setprecision(2);
+	cout << "over " << elapsed << "s: " << total << " connect/login/join/leave cycles, "
+	     << total / elapsed << "/s" << endl;
+	cout << "  cycle    p50 " << std::setw(8) << all.Percentile(0.50) << "us"
+	     << "  p99 " << std::setw(8) << all.Percentile(0.99) << "us"
+	     << "  max " << std::setw(8) << all.Max() << "us" << endl;
+	if(opt.ServerPid != 0 && total > 0)
+	{
+		cout << "  server   " << cpu << "s CPU, " << cpu * 1000 * 1000 / total << "ms per 1000 cycles" << endl;
+	}
+	return EXIT_SUCCESS;
+}
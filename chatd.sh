@@ -70,6 +70,27 @@ do_reload() {
 	return 0
 }
 
+#
+# Function that starts a new daemon, which takes over the running one's
+# connections (it needs --handoff=PATH in DAEMON_ARGS) and then replaces it
+#
+do_upgrade()
+{
+	start-stop-daemon --start --background --pidfile $PIDFILE.new --make-pidfile --startas $DAEMON -- $DAEMON_ARGS --takeover
+	RETVAL="$?"
+	[ "$RETVAL" = 0 ] || return 2
+
+	# The old one exits once the new one has everything
+	OLDPID=$(cat $PIDFILE 2>/dev/null)
+	for i in 1 2 3 4 5 6 7 8 9 10
+	do
+		[ -n "$OLDPID" ] && kill -0 "$OLDPID" 2>/dev/null || break
+		sleep 1
+	done
+	mv -f $PIDFILE.new $PIDFILE
+	return 0
+}
+
 case "$1" in
   start)
 	[ "$VERBOSE" != no ] && log_daemon_msg "Starting $DESC" "$NAME"
@@ -108,8 +129,16 @@ case "$1" in
 		;;
 	esac
 	;;
+  upgrade)
+	log_daemon_msg "Upgrading $DESC" "$NAME"
+	do_upgrade
+	case "$?" in
+		0) log_end_msg 0 ;;
+		*) log_end_msg 1 ;;
+	esac
+	;;
   *)
-	echo "Usage: $SCRIPTNAME {start|stop|status|restart|force-reload}" >&2
+	echo "Usage: $SCRIPTNAME {start|stop|status|restart|force-reload|upgrade}" >&2
 	exit 3
 	;;
 esac
@@ -1,34 +1,312 @@
 #include <iostream>
 #include <functional>
+#include <algorithm>
 #include <vector>
+#include <memory>
 #include <thread>
+#include <mutex>
+#include <string>
 #include <cerrno>
+#include <cstdlib>
 #include <stdexcept>
 #include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/resource.h>
 #include <netinet/in.h>
 #include <string.h> // for memset
 #include <pwd.h> // getpwnam
 #include <syslog.h> // syslog!
 
 #include "ChatManager.hpp"
-#include "ClientHandler.hpp"
+#include "EventLoop.hpp"
+#include "Handoff.hpp"
+#include "Log.hpp"
+#include "Metrics.hpp"
+#include "RateLimit.hpp"
+#include "ServerConfig.hpp"
 
 using std::cerr;
 using std::endl;
 using std::vector;
 using std::thread;
+using std::string;
 
-using ChatServer::ClientHandler;
+using ChatServer::AddressLimits;
 using ChatServer::ChatManager;
+using ChatServer::ClientState;
+using ChatServer::EventLoop;
+using ChatServer::FloodPolicy;
+using ChatServer::Handoff;
+using ChatServer::Log;
+using ChatServer::MetricsServer;
+using ChatServer::ServerConfig;
+using ChatServer::SlowConsumerPolicy;
 
 const char* DROP_TO_USER = "chatd";
+const int MAX_LOOPS = 256; // Sanity cap on -t
+const size_t MIN_JOURNAL_SEGMENT = 64 * 1024; // Room for any line, and then some
+const int RESTORE_GRACE_SECONDS = 300; // How long restored rooms wait for their members
+const size_t MIN_DEFAULT_CONNECTIONS = 65536; // Least room made for connections when not told how much
 
-void start_processing(int fd, ChatManager& cm)
+void usage(const char* prog)
 {
-	ClientHandler ch(fd, cm);
-	ch.HandleClient();
+	cerr << "Usage: " << prog << " [options]" << endl;
+	cerr << "  -t, --threads=N         run N event loops, one thread each (default 1)" << endl;
+	cerr << "  -r, --reuseport         give each loop its own SO_REUSEPORT listener" << endl;
+	cerr << "  -c, --max-conns=N       connections to make room for, 0 for one per open file allowed (default 0)" << endl;
+	cerr << "      --out-high=BYTES    queued output that marks a slow client (default 1048576)" << endl;
+	cerr << "      --out-low=BYTES     drop-oldest trims queued output to this (default 262144)" << endl;
+	cerr << "      --slow=POLICY       'disconnect' or 'drop-oldest' (default disconnect)" << endl;
+	cerr << "      --line-rate=N       lines a second each client can send, 0 for any (default 0)" << endl;
+	cerr << "      --line-burst=N      lines each client can send at once (default 40)" << endl;
+	cerr << "      --byte-rate=N       bytes a second each client can send, 0 for any (default 0)" << endl;
+	cerr << "      --byte-burst=N      bytes each client can send at once (default 65536)" << endl;
+	cerr << "      --flood=POLICY      'delay', 'drop' or 'disconnect' clients over the rates (default delay)" << endl;
+	cerr << "      --conn-rate=N       connections a second from one address, 0 for any (default 0)" << endl;
+	cerr << "      --conn-burst=N      connections one address can make at once (default 20)" << endl;
+	cerr << "      --max-per-ip=N      connections open at once from one address, 0 for any (default 0)" << endl;
+	cerr << "      --history=LINES     lines each room replays to new joiners (default 50)" << endl;
+	cerr << "      --history-room=N    bytes of history each room can keep (default 16384)" << endl;
+	cerr << "      --history-total=N   bytes of history all rooms can keep (default 67108864)" << endl;
+	cerr << "      --journal=DIR       keep a log of everything said under DIR (default none)" << endl;
+	cerr << "      --journal-segment=N bytes in each journal file (default 8388608)" << endl;
+	cerr << "      --journal-sync=MS   longest a line waits to be flushed to disk (default 100)" << endl;
+	cerr << "      --snapshot=FILE     save the rooms to FILE for a warm restart (default none)" << endl;
+	cerr << "      --snapshot-every=S  seconds between saves, 0 for only on exit/SIGHUP (default 60)" << endl;
+	cerr << "      --handoff=PATH      let a new chatd take over through the Unix socket PATH" << endl;
+	cerr << "      --takeover          take over from the chatd at --handoff, if there is one" << endl;
+	cerr << "      --admin=PATH        serve metrics (Prometheus text) on the Unix socket PATH" << endl;
+	exit(EXIT_FAILURE);
+}
+
+size_t parse_size(const char* arg, const char* prog)
+{
+	char* end = NULL;
+	unsigned long long value = strtoull(arg, &end, 10);
+	if(end == arg || *end != '\0')
+	{
+		usage(prog);
+	}
+	return static_cast<size_t>(value);
+}
+
+void parse_args(int argc, char** argv, ServerConfig& config)
+{
+	enum { OPT_OUT_HIGH = 256, OPT_OUT_LOW, OPT_SLOW, OPT_LINE_RATE, OPT_LINE_BURST, OPT_BYTE_RATE,
+	       OPT_BYTE_BURST, OPT_FLOOD, OPT_CONN_RATE, OPT_CONN_BURST, OPT_MAX_PER_IP, OPT_HISTORY, OPT_HISTORY_ROOM, OPT_HISTORY_TOTAL,
+	       OPT_JOURNAL, OPT_JOURNAL_SEGMENT, OPT_JOURNAL_SYNC, OPT_SNAPSHOT, OPT_SNAPSHOT_EVERY,
+	       OPT_HANDOFF, OPT_TAKEOVER, OPT_ADMIN };
+	static const struct option options[] = {
+		{ "threads",   required_argument, NULL, 't' },
+		{ "reuseport", no_argument,       NULL, 'r' },
+		{ "max-conns", required_argument, NULL, 'c' },
+		{ "out-high",  required_argument, NULL, OPT_OUT_HIGH },
+		{ "out-low",   required_argument, NULL, OPT_OUT_LOW },
+		{ "slow",      required_argument, NULL, OPT_SLOW },
+		{ "line-rate",  required_argument, NULL, OPT_LINE_RATE },
+		{ "line-burst", required_argument, NULL, OPT_LINE_BURST },
+		{ "byte-rate",  required_argument, NULL, OPT_BYTE_RATE },
+		{ "byte-burst", required_argument, NULL, OPT_BYTE_BURST },
+		{ "flood",      required_argument, NULL, OPT_FLOOD },
+		{ "conn-rate",  required_argument, NULL, OPT_CONN_RATE },
+		{ "conn-burst", required_argument, NULL, OPT_CONN_BURST },
+		{ "max-per-ip", required_argument, NULL, OPT_MAX_PER_IP },
+		{ "history",       required_argument, NULL, OPT_HISTORY },
+		{ "history-room",  required_argument, NULL, OPT_HISTORY_ROOM },
+		{ "history-total", required_argument, NULL, OPT_HISTORY_TOTAL },
+		{ "journal",         required_argument, NULL, OPT_JOURNAL },
+		{ "journal-segment", required_argument, NULL, OPT_JOURNAL_SEGMENT },
+		{ "journal-sync",    required_argument, NULL, OPT_JOURNAL_SYNC },
+		{ "snapshot",        required_argument, NULL, OPT_SNAPSHOT },
+		{ "snapshot-every",  required_argument, NULL, OPT_SNAPSHOT_EVERY },
+		{ "handoff",         required_argument, NULL, OPT_HANDOFF },
+		{ "takeover",        no_argument,       NULL, OPT_TAKEOVER },
+		{ "admin",           required_argument, NULL, OPT_ADMIN },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	int opt;
+	while((opt = getopt_long(argc, argv, "t:rc:", options, NULL)) != -1)
+	{
+		switch(opt)
+		{
+			case 't':
+				config.LoopCount = atoi(optarg);
+				if(config.LoopCount < 1 || config.LoopCount > MAX_LOOPS)
+				{
+					usage(argv[0]);
+				}
+				break;
+			case 'r':
+				config.ReusePort = true;
+				break;
+			case 'c':
+				config.MaxConnections = parse_size(optarg, argv[0]);
+				break;
+			case OPT_OUT_HIGH:
+				config.OutboundHighWater = parse_size(optarg, argv[0]);
+				break;
+			case OPT_OUT_LOW:
+				config.OutboundLowWater = parse_size(optarg, argv[0]);
+				break;
+			case OPT_SLOW:
+				if(string(optarg) == "disconnect")
+				{
+					config.SlowConsumer = SlowConsumerPolicy::DISCONNECT;
+				}
+				else if(string(optarg) == "drop-oldest")
+				{
+					config.SlowConsumer = SlowConsumerPolicy::DROP_OLDEST;
+				}
+				else
+				{
+					usage(argv[0]);
+				}
+				break;
+			case OPT_LINE_RATE:
+				config.LineRate = parse_size(optarg, argv[0]);
+				break;
+			case OPT_LINE_BURST:
+				config.LineBurst = parse_size(optarg, argv[0]);
+				break;
+			case OPT_BYTE_RATE:
+				config.ByteRate = parse_size(optarg, argv[0]);
+				break;
+			case OPT_BYTE_BURST:
+				config.ByteBurst = parse_size(optarg, argv[0]);
+				break;
+			case OPT_FLOOD:
+				if(string(optarg) == "delay")
+				{
+					config.Flood = FloodPolicy::DELAY;
+				}
+				else if(string(optarg) == "drop")
+				{
+					config.Flood = FloodPolicy::DROP;
+				}
+				else if(string(optarg) == "disconnect")
+				{
+					config.Flood = FloodPolicy::DISCONNECT;
+				}
+				else
+				{
+					usage(argv[0]);
+				}
+				break;
+			case OPT_CONN_RATE:
+				config.ConnectRate = parse_size(optarg, argv[0]);
+				break;
+			case OPT_CONN_BURST:
+				config.ConnectBurst = parse_size(optarg, argv[0]);
+				break;
+			case OPT_MAX_PER_IP:
+				config.SessionsPerAddress = parse_size(optarg, argv[0]);
+				break;
+			case OPT_HISTORY:
+				config.HistoryLines = parse_size(optarg, argv[0]);
+				break;
+			case OPT_HISTORY_ROOM:
+				config.HistoryRoomBytes = parse_size(optarg, argv[0]);
+				break;
+			case OPT_HISTORY_TOTAL:
+				config.HistoryTotalBytes = parse_size(optarg, argv[0]);
+				break;
+			case OPT_JOURNAL:
+				config.JournalDir = optarg;
+				break;
+			case OPT_JOURNAL_SEGMENT:
+				config.JournalSegmentBytes = parse_size(optarg, argv[0]);
+				break;
+			case OPT_JOURNAL_SYNC:
+				config.JournalSyncMs = parse_size(optarg, argv[0]);
+				break;
+			case OPT_SNAPSHOT:
+				config.SnapshotPath = optarg;
+				break;
+			case OPT_SNAPSHOT_EVERY:
+				config.SnapshotSeconds = parse_size(optarg, argv[0]);
+				break;
+			case OPT_HANDOFF:
+				config.HandoffPath = optarg;
+				break;
+			case OPT_TAKEOVER:
+				config.Takeover = true;
+				break;
+			case OPT_ADMIN:
+				config.AdminPath = optarg;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	if(config.OutboundLowWater > config.OutboundHighWater)
+	{
+		cerr << "--out-low can't be more than --out-high" << endl;
+		usage(argv[0]);
+	}
+
+	if(config.LineBurst == 0 || config.ByteBurst == 0 || config.ConnectBurst == 0)
+	{
+		cerr << "--line-burst, --byte-burst and --conn-burst have to be at least 1" << endl;
+		usage(argv[0]);
+	}
+
+	if(config.MaxConnections != 0 && config.MaxConnections < static_cast<size_t>(config.LoopCount))
+	{
+		cerr << "--max-conns has to give every loop at least one connection" << endl;
+		usage(argv[0]);
+	}
+
+	if(config.JournalSegmentBytes < MIN_JOURNAL_SEGMENT)
+	{
+		cerr << "--journal-segment has to be at least " << MIN_JOURNAL_SEGMENT << endl;
+		usage(argv[0]);
+	}
+
+	if(config.Takeover && config.HandoffPath.empty())
+	{
+		cerr << "--takeover needs --handoff to say where to take over from" << endl;
+		usage(argv[0]);
+	}
+}
+
+/**
+	Every connection takes a file descriptor, so raise our limit on them as
+	far as we're allowed.  Unless told otherwise, make room for as many
+	connections as that limit allows, and never fewer than
+	MIN_DEFAULT_CONNECTIONS: slots nobody uses cost no memory (see
+	ConnectionPool).
+**/
+void size_connections(ServerConfig& config)
+{
+	size_t files = 0;
+	struct rlimit limit;
+	if(getrlimit(RLIMIT_NOFILE, &limit) == 0)
+	{
+		if(limit.rlim_cur < limit.rlim_max)
+		{
+			// Not allowed past the system's own cap, though; settle for what we had
+			struct rlimit raised = limit;
+			raised.rlim_cur = limit.rlim_max;
+			if(setrlimit(RLIMIT_NOFILE, &raised) == 0)
+			{
+				limit = raised;
+			}
+		}
+		files = (limit.rlim_cur == RLIM_INFINITY) ? 0 : limit.rlim_cur;
+	}
+
+	if(config.MaxConnections == 0)
+	{
+		config.MaxConnections = std::max(files, MIN_DEFAULT_CONNECTIONS);
+	}
 }
 
 void bail(const char* msg)
@@ -37,7 +315,8 @@ void bail(const char* msg)
 	syslog(LOG_ALERT, "Bailing: %s", msg);
 	syslog(LOG_ALERT, "Errno: %s", strerror(errno));
 
-	// Close out the logs
+	// Close out the logs, after anything still queued
+	Log::Flush();
 	closelog();
 
 	// Exit with EXIT_FAILURE
@@ -85,36 +364,74 @@ void drop_from_root()
 	}
 }
 
-int main(int argc, char** argv)
+void save_snapshot(ChatManager& cm, const ServerConfig& config)
 {
-	int server_sock_fd, client_sock_fd, port_number;
-	socklen_t client_length;
-	struct sockaddr_in server_address, client_address;
-	int result = 0;
-	int pid = 0;
-
-	// Open syslog, only log LOG_NOTICE and above
-	setlogmask(LOG_UPTO (LOG_NOTICE));
-	openlog(argv[0], LOG_CONS | LOG_PID, 0);
+	if(config.SnapshotPath.empty())
+	{
+		return;
+	}
 
-	// We don't want to run as root - that's bad!
-	if(getuid() == 0)
+	try
 	{
-		// So if we're currently root, DROP to chatd:chatgrp
-		drop_from_root();
+		cm.SaveSnapshot(config.SnapshotPath);
 	}
+	catch(const std::runtime_error& e)
+	{
+		syslog(LOG_ERR, "Error saving snapshot: %s", e.what());
+	}
+}
+
+/**
+	Runs on a thread of its own, with every other thread blocking 'signals',
+	so all the signal handling happens here rather than in a handler: saves
+	a snapshot now and then, and on SIGHUP; saves one and shuts down on 
+	SIGTERM / SIGINT.
+**/
+void handle_signals(ChatManager& cm, const ServerConfig& config, sigset_t signals)
+{
+	int elapsed = 0;
+	while(true)
+	{
+		struct timespec second = { 1, 0 };
+		int sig = sigtimedwait(&signals, NULL, &second);
+		if(sig == SIGTERM || sig == SIGINT)
+		{
+			syslog(LOG_NOTICE, "Caught signal %d, shutting down", sig);
+			save_snapshot(cm, config);
+			cm.FlushJournal();
+			Log::Flush();
+			closelog();
 
-	// Create the ChatManager object
-	ChatManager cm;
+			// Straight out - the loops are still running, so it isn't safe to
+			// tear anything down from under them
+			_exit(EXIT_SUCCESS);
+		}
+		else if(sig == SIGHUP)
+		{
+			save_snapshot(cm, config);
+			continue;
+		}
 
-	// Vector of threads for handling clients
-	vector<thread> threads;
+		// Otherwise a second has gone by
+		++elapsed;
+		if(elapsed == RESTORE_GRACE_SECONDS)
+		{
+			cm.ForgetReturning();
+		}
+		if(config.SnapshotSeconds > 0 && elapsed % config.SnapshotSeconds == 0)
+		{
+			save_snapshot(cm, config);
+		}
+	}
+}
 
-	// Vector of client handlers
-	vector<ClientHandler> handlers;
+int open_listener(int port_number, bool reuse_port)
+{
+	struct sockaddr_in server_address;
+	int result = 0;
 
 	// Create a socket
-	server_sock_fd = socket(PF_INET, SOCK_STREAM, 0);
+	int server_sock_fd = socket(PF_INET, SOCK_STREAM, 0);
 
 	if(server_sock_fd < 0)
 	{
@@ -123,7 +440,6 @@ int main(int argc, char** argv)
 
 	// Initialize address structure
 	memset((char*)&server_address, '\0', sizeof(server_address));
-	port_number = 4919; // 0x1337
 	server_address.sin_family = AF_INET;
 	server_address.sin_addr.s_addr = INADDR_ANY;
 	server_address.sin_port = htons(port_number);
@@ -142,6 +458,23 @@ int main(int argc, char** argv)
 		bail("Error: could not set socket options");
 	}
 
+	// Let every event loop bind its own socket to the same port, and have the
+	// kernel spread incoming connections across them.
+	if(reuse_port)
+	{
+		result = setsockopt(
+						   server_sock_fd, 
+							 SOL_SOCKET, 
+							 SO_REUSEPORT, 
+							 &yes, 
+							 sizeof(int)
+							 );
+		if(result != 0)
+		{
+			bail("Error: could not set SO_REUSEPORT");
+		}
+	}
+
 	// Bind
 	result = bind(
 					   server_sock_fd, 
@@ -153,24 +486,200 @@ int main(int argc, char** argv)
 		bail("Error: could not bind socket");
 	}
 
-	// Listen for connections
-	result = listen(server_sock_fd, 10);
+	// Listen for connections - with room for a reconnect storm
+	result = listen(server_sock_fd, SOMAXCONN);
 	if(result != 0)
 	{
 		close(server_sock_fd);
 		bail("Error: could not listen on socket");
 	}
 
+	return server_sock_fd;
+}
+
+int main(int argc, char** argv)
+{
+	int server_sock_fd = -1, client_sock_fd;
+	socklen_t client_length;
+	struct sockaddr_in client_address;
+	ServerConfig config;
+
+	// Parse the command line before anything else
+	parse_args(argc, argv, config);
+	size_connections(config);
+
+	// Open syslog, only log LOG_NOTICE and above
+	setlogmask(LOG_UPTO (LOG_NOTICE));
+	openlog(argv[0], LOG_CONS | LOG_PID, 0);
+	Log::Start();
+
+	// We don't want to run as root - that's bad!
+	if(getuid() == 0)
+	{
+		// So if we're currently root, DROP to chatd:chatgrp
+		drop_from_root();
+	}
+
+	// Signals get handled on a thread of their own (see handle_signals), so
+	// block them here, before any other threads start and inherit the mask
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	// Create the ChatManager object (which opens the journal, if there is one)
+	std::unique_ptr<ChatManager> cm;
+	try
+	{
+		cm.reset(new ChatManager(config));
+	}
+	catch(const std::runtime_error& e)
+	{
+		syslog(LOG_ALERT, "%s", e.what());
+		bail("Unable to start, could not open the journal");
+	}
+
+	// Take over from the server that's running now, if asked to - its
+	// listening sockets, its clients and its rooms
+	std::unique_ptr<Handoff> handoff;
+	vector<int> inherited;
+	vector<std::pair<int, ClientState> > clients;
+	bool took_over = false;
+	if(!config.HandoffPath.empty())
+	{
+		handoff.reset(new Handoff(config.HandoffPath));
+	}
+	if(config.Takeover)
+	{
+		try
+		{
+			took_over = handoff->Receive(*cm, inherited, clients);
+		}
+		catch(const std::runtime_error& e)
+		{
+			syslog(LOG_ALERT, "Takeover failed: %s", e.what());
+			bail("Unable to take over from the running server");
+		}
+		if(!took_over)
+		{
+			syslog(LOG_NOTICE, "Nobody at %s to take over from, starting fresh", config.HandoffPath.c_str());
+		}
+	}
+
+	// Otherwise put the rooms back the way they were, ready for everyone to reconnect
+	if(!took_over && !config.SnapshotPath.empty())
+	{
+		cm->LoadSnapshot(config.SnapshotPath);
+	}
+	thread(handle_signals, std::ref(*cm), std::cref(config), signals).detach();
+
+	// Metrics, for anyone watching
+	std::unique_ptr<MetricsServer> admin;
+	if(!config.AdminPath.empty())
+	{
+		admin.reset(new MetricsServer(config.AdminPath));
+		try
+		{
+			admin->Listen();
+		}
+		catch(const std::runtime_error& e)
+		{
+			syslog(LOG_ALERT, "%s", e.what());
+			bail("Unable to start, could not open the admin socket");
+		}
+		thread(&MetricsServer::Serve, admin.get()).detach();
+	}
+
+	// What each address is allowed, across all the loops
+	AddressLimits limits(config);
+
+	// Event loops for handling clients, one thread each
+	vector<EventLoop*> loops;
+	vector<thread> threads;
+	vector<int> listeners;
+
 	syslog(
 		LOG_NOTICE, 
-		"Server established, listening on port %d", 
-		port_number
+		"Server established, listening on port %d with %d event loop(s)%s, room for %zu connections", 
+		config.Port,
+		config.LoopCount,
+		config.ReusePort ? " (SO_REUSEPORT)" : "",
+		config.MaxConnections
 		);
+	if(!config.JournalDir.empty())
+	{
+		syslog(LOG_NOTICE, "Journaling to %s", config.JournalDir.c_str());
+	}
 	try
 	{
+		for(int i = 0; i < config.LoopCount; ++i)
+		{
+			loops.push_back(new EventLoop(*cm, config, limits));
+			if(config.ReusePort)
+			{
+				size_t n = loops.size() - 1;
+				listeners.push_back(n < inherited.size() ? inherited[n] : open_listener(config.Port, true));
+				loops.back()->Listen(listeners.back());
+			}
+			threads.push_back(thread(&EventLoop::Run, loops.back()));
+		}
+
+		if(!config.ReusePort)
+		{
+			server_sock_fd = inherited.empty() ? open_listener(config.Port, false) : inherited[0];
+			listeners.push_back(server_sock_fd);
+		}
+
+		// Fewer listeners than last time; anything still queued on the extras
+		// is lost, so keep -t and -r the same across an upgrade
+		for(size_t i = listeners.size(); i < inherited.size(); ++i)
+		{
+			close(inherited[i]);
+		}
+
+		// Everyone we took over carries on where they left off
+		for(size_t i = 0; i < clients.size(); ++i)
+		{
+			loops[i % loops.size()]->Resume(clients[i].first, clients[i].second);
+		}
+
+		// And the next server can take over from us
+		if(handoff)
+		{
+			handoff->Listen();
+			thread(&Handoff::Serve, handoff.get(), std::ref(*cm), loops, listeners).detach();
+		}
+
+		if(config.ReusePort)
+		{
+			// The loops do all the accepting, nothing left for us to do
+			for(auto& t: threads)
+			{
+				t.join();
+			}
+			return 0;
+		}
+
+		// Non-blocking, so a connection the next server accepted first (during
+		// a handoff) doesn't leave us stuck in accept()
+		fcntl(server_sock_fd, F_SETFL, fcntl(server_sock_fd, F_GETFL) | O_NONBLOCK);
+
+		int next_loop = 0;
 		while(true)
 		{
-			// Accept the connection, spawn a new thread to handle it
+			struct pollfd ready = { server_sock_fd, POLLIN, 0 };
+			poll(&ready, 1, -1);
+
+			// No accepting while a handoff's under way
+			std::unique_lock<std::mutex> accepting;
+			if(handoff)
+			{
+				accepting = std::unique_lock<std::mutex>(handoff->AcceptMutex());
+			}
+
+			// Accept the connection, hand it to the next loop in line
 			client_length = sizeof(client_address);
 			client_sock_fd = accept(
 											   server_sock_fd, 
@@ -186,8 +695,8 @@ int main(int argc, char** argv)
 				continue;
 			}
 
-			thread t(start_processing, client_sock_fd, std::ref(cm));
-			t.detach();
+			loops[next_loop]->Adopt(client_sock_fd);
+			next_loop = (next_loop + 1) % config.LoopCount;
 		}
 	} 
 	catch(const std::runtime_error& e)